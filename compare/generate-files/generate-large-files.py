@@ -279,10 +279,26 @@ parser.add_argument(
     default=30,
     help="Number of .h files to generate (default: 30)",
 )
+parser.add_argument(
+    "-s",
+    "--seed",
+    type=int,
+    default=None,
+    help="Seed for the random generator, to make the same files every time (default: different files each run)",
+)
+parser.add_argument(
+    "-o",
+    "--output",
+    default="generated_input",
+    help="Directory to generate the files in (default: generated_input)",
+)
 args = parser.parse_args()
 
+# With a seed, the same arguments always give byte-for-byte the same files, which is what the perf gate in compare/ relies on
+random.seed(args.seed)
+
 # Generate large files
-FOLDER_NAME = "generated_input"
+FOLDER_NAME = args.output
 
 # Clear out existing folder if it exists
 if os.path.exists(FOLDER_NAME):
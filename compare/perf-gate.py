@@ -0,0 +1,300 @@
+"""Perf regression gate for fast-cpp.
+
+Runs the fast-wc binary on a few fixed corpora that generate-large-files.py makes from pinned seeds,
+collects the --json stats (phase timings, peak RSS and, where the machine has them, hardware counters)
+and compares them with the baseline checked in as perf-baseline.json.  Exits 1, with a table of what
+changed, if throughput (MB/s per thread) dropped or peak RSS grew by more than the threshold.
+
+Timings are the fastest of the runs: anything else running on the machine can only make a run slower,
+so the fastest is the one noise has touched least, and it moves far less from one gate run to the next
+than the median does.
+
+    python3 perf-gate.py                 # check against the baseline
+    python3 perf-gate.py --update        # measure and write a new baseline, with the same thread count
+    python3 perf-gate.py --rebaseline    # the same, but with --threads (default: every CPU) instead
+
+MB/s per thread at one thread count says little about another, so the gate always runs with the thread
+count the baseline was recorded with, and refuses to compare any other.
+"""
+
+import argparse
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import tempfile
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# name -> (.c files, .h files, seed).  Changing one of these changes the corpus, so the baseline has to be updated with it.
+CORPORA = {
+    "small": (4, 8, 1),
+    "large": (32, 16, 2),
+}
+
+# The fast-wc flags each corpus is run with, besides -n and -s
+CONFIGS = ["", "-p"]
+
+
+def corpus_dir(root, name):
+    return os.path.join(root, name)
+
+
+def make_corpus(root, name):
+    """Generate the corpus unless it is already there with the same parameters."""
+    c_files, h_files, seed = CORPORA[name]
+    params = f"-c {c_files} -H {h_files} -s {seed}"
+    path = corpus_dir(root, name)
+    stamp = path + ".params"
+    if os.path.isdir(path) and os.path.exists(stamp):
+        with open(stamp) as f:
+            if f.read().strip() == params:
+                return path
+    print(f"Generating corpus {name} ({params})...", flush=True)
+    os.makedirs(root, exist_ok=True)
+    subprocess.run(
+        [
+            sys.executable,
+            os.path.join(SCRIPT_DIR, "generate-files", "generate-large-files.py"),
+            *params.split(),
+            "-o",
+            path,
+        ],
+        check=True,
+        stdout=subprocess.DEVNULL,
+    )
+    with open(stamp, "w") as f:
+        f.write(params + "\n")
+    return path
+
+
+def run_once(binary, threads, config, path):
+    with tempfile.NamedTemporaryFile(suffix=".json") as out:
+        cmd = [binary, f"-n{threads}", *config.split(), "-s", "--perf-counters", "--json", out.name, path]
+        # --perf-counters says on stderr when the machine has none; that is expected, not worth showing
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(out.name) as f:
+            return json.load(f)
+
+
+def per_byte(counts, event, nbytes):
+    if counts is None or counts.get(event) is None or nbytes == 0:
+        return None
+    return counts[event] / nbytes
+
+
+def summarize(runs):
+    """The fastest timings, the highest peak RSS and the median counters of the runs of one corpus and config."""
+    first = runs[0]
+    threads = first["threads"]
+    nbytes = first["bytes"]
+
+    def median(values):
+        values = [v for v in values if v is not None]
+        return statistics.median(values) if values else None
+
+    result = {
+        "threads": threads,
+        "files": first["files"],
+        "bytes": nbytes,
+        "distinct_words": first["words"],
+        "mb_s_per_thread": round(max(nbytes / 1e6 / (r["total"]["wall_ms"] / 1e3) / threads for r in runs), 1),
+        "peak_rss_kb": max(r.get("peak_rss_kb", -1) for r in runs),
+        "phases_ms": {
+            phase: min(r["phases"][phase]["wall_ms"] for r in runs) for phase in first["phases"]
+        },
+    }
+    # Instructions per byte rather than raw counts: it doesn't move with the clock speed, so it shows a change in the code itself
+    scan = [r.get("perf_counters", {}).get("scan") for r in runs]
+    counters = {
+        "scan_instructions_per_byte": median(per_byte(c, "instructions", nbytes) for c in scan),
+        "scan_cycles_per_byte": median(per_byte(c, "cycles", nbytes) for c in scan),
+        "scan_branch_misses_per_kb": median(
+            None if v is None else v * 1024 for v in (per_byte(c, "branch-misses", nbytes) for c in scan)
+        ),
+    }
+    if any(v is not None for v in counters.values()):
+        result["counters"] = counters
+    return result
+
+
+def measure(args):
+    """Run every corpus and config.  Returns key -> (path, config, runs)."""
+    measured = {}
+    for name in CORPORA:
+        path = make_corpus(args.corpora, name)
+        for config in CONFIGS:
+            key = f"{name} {config}".strip()
+            print(f"Running {key} ({args.runs} runs)...", flush=True)
+            run_once(args.binary, args.threads, config, path)  # warm the page cache
+            runs = [run_once(args.binary, args.threads, config, path) for _ in range(args.runs)]
+            measured[key] = (path, config, runs)
+    return measured
+
+
+def looks_slower(baseline, key, now, args):
+    old = baseline["results"].get(key)
+    pct = None if old is None else change(old["mb_s_per_thread"], now["mb_s_per_thread"])
+    return pct is not None and -pct > args.threshold
+
+
+def confirm(baseline, measured, args):
+    """Give each config that looks slower a second batch of runs before calling it a regression.  A stretch of noise long enough to
+    spoil every run of one batch is common on a shared machine; one that spoils two batches in a row much less so."""
+    for key, (path, config, runs) in measured.items():
+        if looks_slower(baseline, key, summarize(runs), args):
+            print(f"{key} looks slower; running it {args.runs} more times to make sure...", flush=True)
+            runs.extend(run_once(args.binary, args.threads, config, path) for _ in range(args.runs))
+
+
+def cpu_model():
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return platform.processor() or "unknown"
+
+
+def host():
+    return {"cpu": cpu_model(), "cpus": os.cpu_count(), "machine": platform.machine()}
+
+
+def fmt(value, digits=1):
+    if value is None:
+        return "-"
+    if isinstance(value, float):
+        return f"{value:,.{digits}f}"
+    return f"{value:,}"
+
+
+def change(old, new):
+    if old is None or new is None or old == 0:
+        return None
+    return (new - old) / old * 100
+
+
+def compare(baseline, results, args):
+    """Print a table for each corpus and config, and return the number of regressions."""
+    failures = 0
+    if baseline.get("host") != host():
+        print(f"Note: the baseline was measured on {baseline.get('host')}, this is {host()}; timings may not be comparable")
+    for key, now in results.items():
+        print(f"\n{key}")
+        old = baseline["results"].get(key)
+        if old is None:
+            print("  not in the baseline; run with --update to add it")
+            failures += 1
+            continue
+        # The counts must be the same, or we aren't measuring the same thing: the corpus has changed, or the output has
+        for field in ("files", "bytes", "distinct_words"):
+            if old[field] != now[field]:
+                print(f"  FAIL  {field} was {fmt(old[field])}, now {fmt(now[field])}: the corpus or the counting has changed")
+                failures += 1
+
+        rows = []
+        # (metric, baseline, now, how much worse is a regression, True if bigger is better)
+        gated = [
+            ("MB/s per thread", old["mb_s_per_thread"], now["mb_s_per_thread"], args.threshold, True),
+            ("peak RSS KB", old["peak_rss_kb"], now["peak_rss_kb"], args.rss_threshold, False),
+        ]
+        for metric, a, b, limit, higher_is_better in gated:
+            pct = change(a, b)
+            worse = pct is not None and (-pct if higher_is_better else pct) > limit
+            failures += worse
+            rows.append((metric, a, b, pct, "FAIL" if worse else "ok"))
+        for phase, b in now["phases_ms"].items():
+            rows.append((f"{phase} ms", old["phases_ms"].get(phase), b, change(old["phases_ms"].get(phase), b), ""))
+        for counter, b in now.get("counters", {}).items():
+            a = old.get("counters", {}).get(counter)
+            rows.append((counter.replace("_", " "), a, b, change(a, b), ""))
+
+        print(f"  {'':4}  {'metric':<30} {'baseline':>14} {'now':>14} {'change':>9}")
+        for metric, a, b, pct, verdict in rows:
+            pct_text = "-" if pct is None else f"{pct:+.1f}%"
+            print(f"  {verdict:4}  {metric:<30} {fmt(a, 3):>14} {fmt(b, 3):>14} {pct_text:>9}")
+    return failures
+
+
+parser = argparse.ArgumentParser(description="Fail if fast-cpp has got slower or bigger than the checked-in baseline")
+parser.add_argument(
+    "--binary",
+    default=os.path.join(SCRIPT_DIR, "..", "competitors", "fast-cpp", "fast-wc"),
+    help="The fast-wc to measure (default: the one compile.sh builds)",
+)
+parser.add_argument(
+    "--baseline",
+    default=os.path.join(SCRIPT_DIR, "perf-baseline.json"),
+    help="Baseline to compare with, or write with --update (default: perf-baseline.json next to this script)",
+)
+parser.add_argument(
+    "--corpora",
+    default=os.path.join(SCRIPT_DIR, "generate-files", "gate_input"),
+    help="Where to generate the corpora, which are kept between runs (default: generate-files/gate_input)",
+)
+parser.add_argument("--runs", type=int, default=10, help="Timed runs of each corpus and config (default: 10)")
+parser.add_argument(
+    "--threads",
+    type=int,
+    default=None,
+    help="fast-wc -n; must be the baseline's unless rebaselining (default: the baseline's, or every CPU with --rebaseline)",
+)
+parser.add_argument(
+    "--threshold", type=float, default=10, help="Percent drop in MB/s per thread that fails the gate (default: 10)"
+)
+parser.add_argument(
+    "--rss-threshold", type=float, default=10, help="Percent growth in peak RSS that fails the gate (default: 10)"
+)
+parser.add_argument("--update", action="store_true", help="Write the measurements as the new baseline instead of checking them")
+parser.add_argument(
+    "--rebaseline", action="store_true", help="Like --update, but the new baseline may use a different thread count"
+)
+args = parser.parse_args()
+
+if not os.access(args.binary, os.X_OK):
+    print(f"Error: {args.binary} is not an executable; build it first")
+    sys.exit(2)
+
+try:
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+except FileNotFoundError:
+    baseline = None
+if baseline is None and not args.rebaseline:
+    print(f"Error: no baseline at {args.baseline}; make one with --rebaseline")
+    sys.exit(2)
+
+if args.rebaseline:
+    if args.threads is None:
+        args.threads = os.cpu_count()
+else:
+    if args.threads is None:
+        args.threads = baseline["threads"]
+    elif args.threads != baseline["threads"]:
+        print(
+            f"Error: the baseline was recorded with {baseline['threads']} threads, not {args.threads}, so its MB/s per thread can't be "
+            f"compared with this; leave --threads out, or record a new baseline with --rebaseline --threads {args.threads}"
+        )
+        sys.exit(2)
+
+measured = measure(args)
+
+if args.update or args.rebaseline:
+    results = {key: summarize(runs) for key, (path, config, runs) in measured.items()}
+    with open(args.baseline, "w") as f:
+        json.dump({"host": host(), "threads": args.threads, "runs": args.runs, "results": results}, f, indent=2)
+        f.write("\n")
+    print(f"\nWrote {args.baseline}")
+    sys.exit(0)
+
+confirm(baseline, measured, args)
+results = {key: summarize(runs) for key, (path, config, runs) in measured.items()}
+failures = compare(baseline, results, args)
+if failures:
+    print(f"\n{failures} regression(s) beyond the thresholds (MB/s per thread {args.threshold}%, peak RSS {args.rss_threshold}%)")
+    sys.exit(1)
+print("\nNo regressions")
@@ -2,11 +2,21 @@
 
 if [[ -z "$1" ]]; then
   echo "Usage: $0 <directory>"
+  echo "       $0 --gate [--update|--rebaseline] [perf-gate.py options]"
   exit 1
 fi
 
 # Resolve this script's directory
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+# The perf regression gate: build fast-cpp, then hold it to the baseline in perf-baseline.json (see perf-gate.py)
+if [[ "$1" == "--gate" ]]; then
+  shift
+  echo "Building..."
+  "$SCRIPT_DIR/../competitors/fast-cpp/compile.sh" || exit 2
+  exec python3 "$SCRIPT_DIR/perf-gate.py" "$@"
+fi
+
 DIR="$1"
 
 echo "Comparing on directory: $DIR"
@@ -0,0 +1,133 @@
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <dirent.h>
+#include <sched.h>
+
+namespace affinity {
+
+// cpu -> node, read once.  libnuma would tell us the same, but only by making it a build dependency, and the kernel already lists each
+// node's CPUs in sysfs in the "0-3,8-11" form.
+static std::vector<int> cpu_nodes;
+static int nodes = 1;
+
+static void read_topology()
+{
+	static std::once_flag once;
+	std::call_once(once, [] {
+		DIR *dir = opendir("/sys/devices/system/node");
+		if (dir == nullptr)
+		{
+			return;
+		}
+		int found = 0;
+		while (dirent *entry = readdir(dir))
+		{
+			int node;
+			if (sscanf(entry->d_name, "node%d", &node) != 1)
+			{
+				continue;
+			}
+			char path[300];
+			snprintf(path, sizeof path, "/sys/devices/system/node/%s/cpulist", entry->d_name);
+			FILE *f = fopen(path, "r");
+			if (f == nullptr)
+			{
+				continue;
+			}
+			bool any = false;
+			int lo, hi;
+			while (fscanf(f, "%d", &lo) == 1)
+			{
+				if (fscanf(f, "-%d", &hi) != 1)
+				{
+					hi = lo;
+				}
+				for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+				{
+					if ((int)cpu_nodes.size() <= cpu)
+					{
+						cpu_nodes.resize(cpu + 1, 0);
+					}
+					cpu_nodes[cpu] = node;
+					any = true;
+				}
+				if (fgetc(f) != ',')
+				{
+					break;
+				}
+			}
+			fclose(f);
+			found += any;
+		}
+		closedir(dir);
+		nodes = std::max(found, 1);
+	});
+}
+
+int node_of(int cpu)
+{
+	read_topology();
+	return cpu >= 0 && cpu < (int)cpu_nodes.size() ? cpu_nodes[cpu] : 0;
+}
+
+int node_count()
+{
+	read_topology();
+	return nodes;
+}
+
+std::vector<int> worker_cpus(bool by_node)
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, &set))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+	}
+	if (!by_node || node_count() == 1)
+	{
+		return cpus;
+	}
+	// Deal them out: the first CPU of each node, then the second of each, and so on
+	std::vector<std::vector<int>> per_node;
+	for (int cpu : cpus)
+	{
+		int node = node_of(cpu);
+		if ((int)per_node.size() <= node)
+		{
+			per_node.resize(node + 1);
+		}
+		per_node[node].push_back(cpu);
+	}
+	std::vector<int> dealt;
+	for (size_t round = 0; dealt.size() < cpus.size(); round++)
+	{
+		for (auto &node : per_node)
+		{
+			if (round < node.size())
+			{
+				dealt.push_back(node[round]);
+			}
+		}
+	}
+	return dealt;
+}
+
+bool pin_current(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof set, &set) == 0;
+}
+
+} // namespace affinity
@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+ * Thread placement for --pin and --numa: which CPUs the wcounter threads go on, and which NUMA node each CPU belongs to.
+ */
+#include <vector>
+
+namespace affinity {
+
+// The CPUs we are allowed to run on (see sched_getaffinity), one per wcounter thread in turn.  Without by_node they are in number
+// order, which on most machines fills one socket before starting on the next.  With by_node the nodes take turns instead, so with
+// fewer threads than CPUs every node (and so every node's memory controller) still gets its share of the threads.
+std::vector<int> worker_cpus(bool by_node);
+
+// The NUMA node cpu is on, from /sys/devices/system/node.  A machine (or kernel) without NUMA is all node 0.
+int node_of(int cpu);
+
+// How many nodes have CPUs of their own
+int node_count();
+
+// Keep the calling thread on cpu from now on.  Returns false if the kernel says no.
+bool pin_current(int cpu);
+
+} // namespace affinity
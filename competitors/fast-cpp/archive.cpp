@@ -0,0 +1,606 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Both libraries are optional: each format is there if its header is, and CMakeLists.txt and compile.sh link the library to match
+// (or, if only the header is there, define FASTWC_NO_GZIP or FASTWC_NO_ZSTD)
+#if __has_include(<zlib.h>) && !defined(FASTWC_NO_GZIP)
+#include <zlib.h>
+#define FASTWC_GZIP 1
+#endif
+#if __has_include(<zstd.h>) && !defined(FASTWC_NO_ZSTD)
+#include <zstd.h>
+#define FASTWC_ZSTD 1
+#endif
+
+namespace archive {
+
+namespace {
+
+bool ends_with(std::string_view s, std::string_view suffix)
+{
+	return s.size() >= suffix.size() && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+[[noreturn]] void fail_errno(const char *what, const char *path)
+{
+	throw fs::filesystem_error(what, path, std::error_code(errno, std::generic_category()));
+}
+
+// Where the tarball's bytes come from, after decompression.  read() returns 0 at the end, and throws if the data is damaged.
+class Source
+{
+public:
+	virtual ~Source() = default;
+	virtual size_t read(char *buf, size_t len) = 0;
+};
+
+class FileSource : public Source
+{
+public:
+	explicit FileSource(int fdesc) : fdesc(fdesc) {}
+
+	size_t read(char *buf, size_t len) override
+	{
+		while (true)
+		{
+			ssize_t got = ::read(fdesc, buf, len);
+			if (got == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if (got == -1)
+			{
+				throw std::system_error(errno, std::generic_category(), "read");
+			}
+			return got;
+		}
+	}
+
+private:
+	int fdesc;
+};
+
+#ifdef FASTWC_GZIP
+// A .gz can be several gzip members one after another (that is what "cat a.gz b.gz" makes, and what some parallel compressors write),
+// so at the end of each member we carry on with the next, if there is one.
+class GzipSource : public Source
+{
+public:
+	explicit GzipSource(int fdesc) : file(fdesc), in(256 * 1024)
+	{
+		if (inflateInit2(&z, 15 + 16) != Z_OK)
+		{
+			throw std::runtime_error("unable to start zlib");
+		}
+	}
+	~GzipSource() override { inflateEnd(&z); }
+
+	size_t read(char *buf, size_t len) override
+	{
+		z.next_out = (Bytef *)buf;
+		z.avail_out = len;
+		while (z.avail_out == len)
+		{
+			if (z.avail_in == 0)
+			{
+				z.avail_in = file.read(in.data(), in.size());
+				z.next_in = (Bytef *)in.data();
+				if (z.avail_in == 0)
+				{
+					if (!between_members)
+					{
+						throw std::runtime_error("the gzip data ends too soon");
+					}
+					break;
+				}
+			}
+			if (between_members)
+			{
+				inflateReset(&z);
+				between_members = false;
+			}
+			int ret = inflate(&z, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END)
+			{
+				between_members = true;
+			}
+			else if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				throw std::runtime_error(std::string("damaged gzip data: ") + (z.msg != nullptr ? z.msg : "unknown error"));
+			}
+		}
+		return len - z.avail_out;
+	}
+
+private:
+	FileSource file;
+	std::vector<char> in;
+	z_stream z{};
+	bool between_members = false;
+};
+#endif
+
+#ifdef FASTWC_ZSTD
+// zstd frames are independent of each other, so an archive of several frames can be decompressed a frame per thread.  The frames
+// still have to come out in order, since a file in the tarball can run on from one frame into the next, so each thread decompresses
+// into a buffer of its own, and read() hands them out in frame order.  Threads don't get more than a few frames ahead of read(), which
+// bounds the memory to a few frames' worth.  A single frame (the usual zstd output) is just streamed on the calling thread.
+class ZstdSource : public Source
+{
+public:
+	ZstdSource(int fdesc, const char *path, int nthreads)
+	{
+		struct stat sb;
+		if (fstat(fdesc, &sb) == -1)
+		{
+			fail_errno("unable to read archive", path);
+		}
+		size = sb.st_size;
+		map = (const char *)mmap(nullptr, std::max<size_t>(size, 1), PROT_READ, MAP_PRIVATE, fdesc, 0);
+		if (map == MAP_FAILED)
+		{
+			fail_errno("unable to map archive", path);
+		}
+		for (size_t pos = 0; pos < size;)
+		{
+			size_t n = ZSTD_findFrameCompressedSize(map + pos, size - pos);
+			if (ZSTD_isError(n))
+			{
+				munmap((void *)map, size);
+				throw std::runtime_error(std::string("damaged zstd data: ") + ZSTD_getErrorName(n));
+			}
+			frames.push_back({pos, n});
+			pos += n;
+		}
+		if (frames.size() > 1 && nthreads > 1)
+		{
+			window = 2 * nthreads;
+			decoded.resize(frames.size());
+			for (int t = 0; t < nthreads; t++)
+			{
+				workers.emplace_back(&ZstdSource::decode_frames, this);
+			}
+		}
+		else
+		{
+			stream = ZSTD_createDStream();
+			input = {map, size, 0};
+		}
+	}
+
+	~ZstdSource() override
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (auto &t : workers)
+		{
+			t.join();
+		}
+		if (stream != nullptr)
+		{
+			ZSTD_freeDStream(stream);
+		}
+		munmap((void *)map, std::max<size_t>(size, 1));
+	}
+
+	size_t read(char *buf, size_t len) override
+	{
+		if (workers.empty())
+		{
+			ZSTD_outBuffer out{buf, len, 0};
+			while (out.pos == 0 && input.pos < input.size)
+			{
+				size_t ret = ZSTD_decompressStream(stream, &out, &input);
+				if (ZSTD_isError(ret))
+				{
+					throw std::runtime_error(std::string("damaged zstd data: ") + ZSTD_getErrorName(ret));
+				}
+			}
+			return out.pos;
+		}
+		std::unique_lock<std::mutex> guard(lock);
+		while (next_out < frames.size())
+		{
+			changed.wait(guard, [&] { return decoded[next_out].done || !error.empty(); });
+			if (!error.empty())
+			{
+				throw std::runtime_error(error);
+			}
+			Decoded &d = decoded[next_out];
+			if (out_pos < d.data.size())
+			{
+				size_t n = std::min(len, d.data.size() - out_pos);
+				memcpy(buf, d.data.data() + out_pos, n);
+				out_pos += n;
+				return n;
+			}
+			// This frame is used up: free it, and let the threads start on another
+			std::string().swap(d.data);
+			next_out++;
+			out_pos = 0;
+			changed.notify_all();
+		}
+		return 0;
+	}
+
+private:
+	struct Frame
+	{
+		size_t begin;
+		size_t len;
+	};
+	struct Decoded
+	{
+		std::string data;
+		bool done = false;
+	};
+
+	void decode_frames()
+	{
+		ZSTD_DCtx *dctx = ZSTD_createDCtx();
+		std::vector<char> chunk(ZSTD_DStreamOutSize());
+		while (true)
+		{
+			size_t f;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard, [&] { return stopping || next_frame >= frames.size() || next_frame < next_out + window; });
+				if (stopping || next_frame >= frames.size())
+				{
+					break;
+				}
+				f = next_frame++;
+			}
+			std::string data;
+			unsigned long long expected = ZSTD_getFrameContentSize(map + frames[f].begin, frames[f].len);
+			if (expected != ZSTD_CONTENTSIZE_UNKNOWN && expected != ZSTD_CONTENTSIZE_ERROR)
+			{
+				data.reserve(expected);
+			}
+			ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+			ZSTD_inBuffer in{map + frames[f].begin, frames[f].len, 0};
+			std::string failed;
+			while (in.pos < in.size)
+			{
+				ZSTD_outBuffer out{chunk.data(), chunk.size(), 0};
+				size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+				if (ZSTD_isError(ret))
+				{
+					failed = std::string("damaged zstd data: ") + ZSTD_getErrorName(ret);
+					break;
+				}
+				data.append(chunk.data(), out.pos);
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			if (!failed.empty())
+			{
+				error = failed;
+			}
+			decoded[f].data = std::move(data);
+			decoded[f].done = true;
+			changed.notify_all();
+		}
+		ZSTD_freeDCtx(dctx);
+	}
+
+	const char *map;
+	size_t size;
+	std::vector<Frame> frames;
+	// The single-threaded case
+	ZSTD_DStream *stream = nullptr;
+	ZSTD_inBuffer input{};
+	// The parallel case
+	std::vector<std::thread> workers;
+	std::vector<Decoded> decoded;
+	size_t window = 0;
+	size_t next_frame = 0; // the next frame a thread will take
+	size_t next_out = 0;   // the frame read() is handing out
+	size_t out_pos = 0;
+	std::string error;
+	bool stopping = false;
+	std::mutex lock;
+	std::condition_variable changed;
+};
+#endif
+
+// Buffered reading of the decompressed tarball.  The file contents are handed to the sink straight out of our buffer, a buffer-full
+// at a time, so there is no copying beyond what the decompressor does.
+class Input
+{
+public:
+	explicit Input(Source &source) : source(source), buf(1024 * 1024) {}
+
+	// Exactly n bytes, or false if the data has already ended
+	bool take(char *dst, size_t n)
+	{
+		for (size_t wanted = n; n > 0;)
+		{
+			if (!fill())
+			{
+				if (n < wanted)
+				{
+					throw std::runtime_error("not a tar archive, or a truncated one");
+				}
+				return false;
+			}
+			size_t m = std::min(n, len - pos);
+			memcpy(dst, buf.data() + pos, m);
+			pos += m;
+			dst += m;
+			n -= m;
+		}
+		return true;
+	}
+
+	// The next n bytes, in pieces, to sink (or nowhere, if sink is null)
+	void pass(uint64_t n, const DataSink *sink)
+	{
+		while (n > 0)
+		{
+			if (!fill())
+			{
+				throw std::runtime_error("the archive ends in the middle of a file");
+			}
+			size_t m = std::min<uint64_t>(n, len - pos);
+			if (sink != nullptr)
+			{
+				(*sink)(buf.data() + pos, m);
+			}
+			pos += m;
+			n -= m;
+		}
+	}
+
+private:
+	bool fill()
+	{
+		if (pos == len)
+		{
+			len = source.read(buf.data(), buf.size());
+			pos = 0;
+		}
+		return len > 0;
+	}
+
+	Source &source;
+	std::vector<char> buf;
+	size_t pos = 0;
+	size_t len = 0;
+};
+
+// A number in a tar header: octal text, or for big values GNU's base-256, flagged by the top bit of the first byte
+uint64_t tar_number(const char *field, size_t len)
+{
+	uint64_t n = 0;
+	if ((unsigned char)field[0] & 0x80)
+	{
+		n = (unsigned char)field[0] & 0x7F;
+		for (size_t i = 1; i < len; i++)
+		{
+			n = (n << 8) | (unsigned char)field[i];
+		}
+		return n;
+	}
+	for (size_t i = 0; i < len && field[i] != '\0' && field[i] != ' '; i++)
+	{
+		if (field[i] < '0' || field[i] > '7')
+		{
+			throw std::runtime_error("not a tar archive, or a damaged one");
+		}
+		n = n * 8 + (field[i] - '0');
+	}
+	return n;
+}
+
+// The checksum is the sum of the header's bytes, counting its own field as spaces.  Checking it is what tells a tarball from garbage.
+bool header_ok(const char *h)
+{
+	uint64_t sum = 0;
+	for (int i = 0; i < 512; i++)
+	{
+		sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+	}
+	return sum == tar_number(h + 148, 8);
+}
+
+// A pax extended header is a list of "length key=value\n" records; the one we care about is the file's real (long) path
+std::string pax_path(std::string_view records)
+{
+	std::string path;
+	while (!records.empty())
+	{
+		size_t len = 0, i = 0;
+		while (i < records.size() && records[i] >= '0' && records[i] <= '9')
+		{
+			len = len * 10 + (records[i++] - '0');
+		}
+		if (len == 0 || len > records.size())
+		{
+			break;
+		}
+		std::string_view record = records.substr(i, len - i);
+		if (record.substr(0, 6) == " path=")
+		{
+			path = record.substr(6, record.size() - 7);
+		}
+		records.remove_prefix(len);
+	}
+	return path;
+}
+
+// The same rule as walk_files: the part of the last path component from its last '.', unless that '.' starts it
+std::string_view extension_of(std::string_view name)
+{
+	size_t slash = name.rfind('/');
+	std::string_view base = slash == std::string_view::npos ? name : name.substr(slash + 1);
+	size_t dot = base.rfind('.');
+	return dot == std::string_view::npos || dot == 0 ? std::string_view() : base.substr(dot);
+}
+
+size_t read_tar(Source &source, utils::ExtensionPred pred, const DataSink &sink)
+{
+	Input input(source);
+	size_t nfiles = 0;
+	std::string long_name;
+	char h[512];
+	while (input.take(h, sizeof h))
+	{
+		// The archive ends with (at least) two blocks of zeros
+		if (std::all_of(h, h + sizeof h, [](char c) { return c == '\0'; }))
+		{
+			break;
+		}
+		if (!header_ok(h))
+		{
+			throw std::runtime_error("not a tar archive, or a damaged one");
+		}
+		uint64_t size = tar_number(h + 124, 12);
+		uint64_t padding = (512 - size % 512) % 512;
+		char type = h[156];
+		if (type == 'L' || type == 'x')
+		{
+			// The name of the next entry, when it is too long for the header: GNU's way, and POSIX's
+			if (size > 1024 * 1024)
+			{
+				throw std::runtime_error("not a tar archive, or a damaged one");
+			}
+			std::string text(size, '\0');
+			if (!input.take(text.data(), size))
+			{
+				throw std::runtime_error("the archive ends in the middle of a header");
+			}
+			input.pass(padding, nullptr);
+			long_name = type == 'L' ? std::string(text.c_str()) : pax_path(text);
+			continue;
+		}
+		std::string name = long_name;
+		long_name.clear();
+		if (name.empty())
+		{
+			name.assign(h, strnlen(h, 100));
+			// ustar splits a long path into a prefix and a name
+			if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0')
+			{
+				name = std::string(h + 345, strnlen(h + 345, 155)) + "/" + name;
+			}
+		}
+		// Regular files only: no directories, links, devices, or (type 'g') global pax headers
+		bool regular = type == '0' || type == '\0' || type == '7';
+		if (regular && pred(extension_of(name)))
+		{
+			input.pass(size, &sink);
+			sink(nullptr, 0);
+			nfiles++;
+			input.pass(padding, nullptr);
+		}
+		else
+		{
+			input.pass(size + padding, nullptr);
+		}
+	}
+	return nfiles;
+}
+
+} // namespace
+
+bool is_archive(const char *path)
+{
+	// Every kind we know of, whether or not this build can read it, so that a .tar.zst without zstd gets told so (see missing_support)
+	// rather than being taken for a directory that isn't there
+	std::string_view p(path);
+	bool ok = ends_with(p, ".tar") || ends_with(p, ".tar.gz") || ends_with(p, ".tgz") || ends_with(p, ".tar.zst") || ends_with(p, ".tzst");
+	struct stat sb;
+	return ok && stat(path, &sb) == 0 && S_ISREG(sb.st_mode);
+}
+
+const char *missing_support(const char *path)
+{
+	std::string_view p(path);
+#ifndef FASTWC_GZIP
+	if (ends_with(p, ".gz") || ends_with(p, ".tgz"))
+	{
+		return "gzip";
+	}
+#endif
+#ifndef FASTWC_ZSTD
+	if (ends_with(p, ".zst") || ends_with(p, ".tzst"))
+	{
+		return "zstd";
+	}
+#endif
+	(void)p;
+	return nullptr;
+}
+
+const char *formats()
+{
+#if defined(FASTWC_GZIP) && defined(FASTWC_ZSTD)
+	return "tar, gzip, zstd";
+#elif defined(FASTWC_GZIP)
+	return "tar, gzip";
+#elif defined(FASTWC_ZSTD)
+	return "tar, zstd";
+#else
+	return "tar";
+#endif
+}
+
+size_t read_files(const char *path, utils::ExtensionPred pred, int nthreads, const DataSink &sink)
+{
+	int fdesc = open(path, O_RDONLY | O_CLOEXEC);
+	if (fdesc == -1)
+	{
+		fail_errno("unable to open archive", path);
+	}
+	struct Closer
+	{
+		int fdesc;
+		~Closer() { close(fdesc); }
+	} closer{fdesc};
+	if (const char *missing = missing_support(path))
+	{
+		throw std::runtime_error(std::string(missing) + " support not built in (formats: " + formats() + ")");
+	}
+	std::string_view p(path);
+	std::unique_ptr<Source> source;
+#ifdef FASTWC_ZSTD
+	if (ends_with(p, ".zst") || ends_with(p, ".tzst"))
+	{
+		source = std::make_unique<ZstdSource>(fdesc, path, nthreads);
+	}
+#endif
+#ifdef FASTWC_GZIP
+	if (ends_with(p, ".gz") || ends_with(p, ".tgz"))
+	{
+		source = std::make_unique<GzipSource>(fdesc);
+	}
+#endif
+	if (source == nullptr)
+	{
+		(void)nthreads;
+		source = std::make_unique<FileSource>(fdesc);
+	}
+	return read_tar(*source, pred, sink);
+}
+
+} // namespace archive
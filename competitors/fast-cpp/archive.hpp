@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Reading the files straight out of a tarball (.tar, .tar.gz, and .tar.zst where zstd is available), without unpacking it to disk.
+ */
+#include <cstddef>
+#include <functional>
+#include "utils.hpp"
+
+namespace archive {
+
+// Whether path is a regular file that looks like an archive: .tar, .tar.gz or .tgz, or .tar.zst or .tzst, whichever of those this
+// build can actually read
+bool is_archive(const char *path);
+
+// The compression ("gzip" or "zstd") of an archive at path that this build has no library for, or nullptr if it can read it
+const char *missing_support(const char *path);
+
+// What we can read, for the banner: "tar, gzip, zstd" when built with both libraries
+const char *formats();
+
+// Called with the contents of each wanted file in the archive, in pieces, and then once with len 0 when the file is done.  The data is
+// only valid during the call.
+using DataSink = std::function<void(const char *data, size_t len)>;
+
+// Go through the archive at path, handing every regular file whose extension passes pred to sink, in archive order.  A zstd archive
+// made of several frames (as pzstd or zstd --long with big inputs makes them) is decompressed by nthreads threads at once, a frame
+// each; gzip has no such boundaries to split at, so that is always one thread.  Returns the number of files.  Throws
+// fs::filesystem_error if the archive can't be read, and std::runtime_error if it is damaged.
+size_t read_files(const char *path, utils::ExtensionPred pred, int nthreads, const DataSink &sink);
+
+} // namespace archive
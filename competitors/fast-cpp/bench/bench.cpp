@@ -0,0 +1,314 @@
+/*
+ * Microbenchmarks for the pieces of fast-wc, the C++ side's answer to the criterion benches in fast-wc-rust/benches.
+ */
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../hot_tokens.hpp"
+#include "../ranking.hpp"
+#include "../stats.hpp"
+#include "../tokenizer.hpp"
+#include "../utils.hpp"
+#include "../word_table.hpp"
+
+// Each benchmark is one function timed over a number of runs, after one warm-up run that isn't counted.  We keep every run's time and
+// report the fastest, the median and the mean: the fastest is the most repeatable number on a noisy machine, and a median far above it
+// says the machine was noisy.  "items" and "bytes" turn the times into throughputs.
+struct Result
+{
+	std::string name;
+	int64_t items;
+	int64_t bytes;
+	std::vector<int64_t> ns;
+};
+
+std::vector<Result> results;
+int runs = 10;
+const char *filter = nullptr;
+
+void bench(const std::string &name, int64_t items, int64_t bytes, const std::function<void()> &setup, const std::function<void()> &body)
+{
+	if (filter != nullptr && name.find(filter) == std::string::npos)
+	{
+		return;
+	}
+	Result r{name, items, bytes, {}};
+	for (int i = 0; i <= runs; i++)
+	{
+		// setup() isn't timed: it puts things back the way body() expects to find them (an empty table, an unsorted array, ...)
+		setup();
+		int64_t t0 = stats::now_ns(CLOCK_MONOTONIC);
+		body();
+		int64_t t1 = stats::now_ns(CLOCK_MONOTONIC);
+		if (i > 0)
+		{
+			r.ns.push_back(t1 - t0);
+		}
+	}
+	std::sort(r.ns.begin(), r.ns.end());
+	fprintf(stderr, "%-28s %10.3f ms min %10.3f ms median", name.c_str(), r.ns.front() / 1e6, r.ns[r.ns.size() / 2] / 1e6);
+	if (bytes > 0)
+	{
+		fprintf(stderr, " %9.1f MB/s", bytes / (r.ns.front() / 1e9) / 1e6);
+	}
+	if (items > 0)
+	{
+		fprintf(stderr, " %8.2f ns/item", (double)r.ns.front() / items);
+	}
+	fprintf(stderr, "\n");
+	results.push_back(std::move(r));
+}
+
+// Stops the compiler from deciding a result is unused and throwing the work away
+template <class T>
+void keep(const T &value)
+{
+	asm volatile("" : : "r"(&value) : "memory");
+}
+
+// The corpus, read into memory once so that none of the benchmarks measure the disk.  Files are joined with a newline in between, so
+// no word runs from the end of one file into the next.
+std::string load_corpus(const char *dir, int64_t &nfiles)
+{
+	std::string text;
+	std::mutex lock;
+	nfiles = 0;
+	utils::walk_files(dir, utils::has_extension<utils::CSources>, 4, [&](int dirfd, const char *name) {
+		int fdesc = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+		if (fdesc == -1)
+		{
+			return;
+		}
+		std::string file;
+		char buf[64 * 1024];
+		ssize_t n;
+		while ((n = read(fdesc, buf, sizeof(buf))) > 0)
+		{
+			file.append(buf, n);
+		}
+		close(fdesc);
+		std::lock_guard<std::mutex> guard(lock);
+		text += file;
+		text += '\n';
+		nfiles++;
+	});
+	return text;
+}
+
+void write_json(FILE *out, const char *corpus, int64_t nfiles, int64_t nbytes, int64_t nwords, int64_t ndistinct, int nthreads)
+{
+	fprintf(out, "{\"corpus\": \"%s\", \"files\": %" PRId64 ", \"bytes\": %" PRId64 ", \"words\": %" PRId64 ", \"distinct\": %" PRId64
+	             ", \"threads\": %d, \"kernel\": \"%s\", \"runs\": %d, \"benchmarks\": [",
+	        corpus, nfiles, nbytes, nwords, ndistinct, nthreads, tokenizer::kernel_name(), runs);
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result &r = results[i];
+		double mean = 0;
+		for (int64_t t : r.ns)
+		{
+			mean += t;
+		}
+		mean /= r.ns.size();
+		fprintf(out,
+		        "%s\n  {\"name\": \"%s\", \"items\": %" PRId64 ", \"bytes\": %" PRId64 ", \"min_ns\": %" PRId64 ", \"median_ns\": %" PRId64
+		        ", \"mean_ns\": %.0f, \"times_ns\": [",
+		        i > 0 ? "," : "", r.name.c_str(), r.items, r.bytes, r.ns.front(), r.ns[r.ns.size() / 2], mean);
+		for (size_t j = 0; j < r.ns.size(); j++)
+		{
+			fprintf(out, "%s%" PRId64, j > 0 ? ", " : "", r.ns[j]);
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "\n]}\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *corpus = "generated_input";
+	const char *json_path = nullptr;
+	int nthreads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc)
+		{
+			corpus = argv[++i];
+		}
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			json_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+		{
+			runs = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			nthreads = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+		{
+			filter = argv[++i];
+		}
+		else
+		{
+			printf("Usage: fast-wc-bench [--corpus DIR] [--json FILE] [--runs N] [--threads N] [--filter NAME]\n");
+			return 1;
+		}
+	}
+	tokenizer::init();
+	int64_t nfiles;
+	std::string text;
+	try
+	{
+		text = load_corpus(corpus, nfiles);
+	}
+	catch (const std::exception &e)
+	{
+		printf("Unable to read the corpus %s.  Make one with compare/generate-files/generate-large-files.py.\n", corpus);
+		return 1;
+	}
+	if (text.empty())
+	{
+		printf("No .c or .h files in %s\n", corpus);
+		return 1;
+	}
+	const char *data = text.data();
+	int64_t nbytes = text.size();
+
+	// The words, pulled out once, so that the table benchmarks measure the table alone
+	std::vector<std::string_view> words;
+	size_t tail = tokenizer::scan_words<tokenizer::Ident>(data, text.size(), [&](size_t start, size_t end) { words.emplace_back(data + start, end - start); });
+	if (tail < text.size())
+	{
+		words.emplace_back(data + tail, text.size() - tail);
+	}
+	int64_t nwords = words.size();
+	fprintf(stderr, "%s: %" PRId64 " files, %" PRId64 " bytes, %" PRId64 " words, %d threads, %s kernel\n\n", corpus, nfiles, nbytes, nwords,
+	        nthreads, tokenizer::kernel_name());
+
+	// The tokenizer loop on its own: classify and walk the masks, with a callback that does next to nothing
+	auto tokenize = [&](auto policy) {
+		using Policy = decltype(policy);
+		bench(std::string("tokenize/") + Policy::name, 0, nbytes, [] {}, [&] {
+			size_t sum = 0;
+			tokenizer::scan_words<Policy>(data, text.size(), [&](size_t start, size_t end) { sum += end - start; });
+			keep(sum);
+		});
+	};
+	tokenize(tokenizer::Ident{});
+	tokenize(tokenizer::Hyphen{});
+	tokenize(tokenizer::Utf8{});
+
+	// What found() does for every word: WordTable::add, starting from an empty table, so the misses and the rehashes are included
+	WordTable table;
+	bench("insert/cold", nwords, 0, [&] { table = WordTable(); }, [&] {
+		for (std::string_view w : words)
+		{
+			table.add(w.data(), w.size());
+		}
+	});
+	// And into a table that already has every word, which is all hits: the steady state for a thread that has seen a few files
+	bench("insert/warm", nwords, 0, [] {}, [&] {
+		for (std::string_view w : words)
+		{
+			table.add(w.data(), w.size());
+		}
+	});
+	// Both at once, as the scan loop really runs them: hashing in the scanner and handing the hash to the table (scan_hashed), and for
+	// comparison the table hashing the word itself
+	bench("tokenize+insert", nwords, nbytes, [&] { table = WordTable(); }, [&] {
+		tokenizer::scan_hashed<tokenizer::Ident>(data, text.size(), [&](size_t start, size_t end, uint64_t hash) {
+			table.add_hashed(data + start, end - start, hash);
+		});
+	});
+	bench("tokenize+insert/unfused", nwords, nbytes, [&] { table = WordTable(); }, [&] {
+		tokenizer::scan_words<tokenizer::Ident>(data, text.size(), [&](size_t start, size_t end) { table.add(data + start, end - start); });
+	});
+	// The hot tokens (hot_tokens.hpp) go to an array of their own, and only the rest to the table, as found() does with --hot-tokens
+	int hot_counts[hot::count<hot::CTokens>];
+	bench("tokenize+insert/hot", nwords, nbytes, [&] { table = WordTable(); std::fill(std::begin(hot_counts), std::end(hot_counts), 0); }, [&] {
+		tokenizer::scan_hashed<tokenizer::Ident>(data, text.size(), [&](size_t start, size_t end, uint64_t hash) {
+			int t = hot::find<hot::CTokens>(data + start, end - start, hash);
+			if (t >= 0)
+			{
+				hot_counts[t]++;
+				return;
+			}
+			table.add_hashed(data + start, end - start, hash);
+		});
+	});
+	int64_t ndistinct = table.size();
+
+	// One sub-count per thread, each from its own slice of the words, the way the wcounter threads leave them
+	std::vector<WordTable> subs(nthreads);
+	for (size_t i = 0; i < words.size(); i++)
+	{
+		subs[i * nthreads / words.size()].add(words[i].data(), words[i].size());
+	}
+	int64_t nsub = 0;
+	for (const WordTable &s : subs)
+	{
+		nsub += s.size();
+	}
+	WordTable total;
+	bench("merge/sequential", nsub, 0, [&] { total = WordTable(); }, [&] {
+		for (const WordTable &s : subs)
+		{
+			total.merge(s);
+		}
+	});
+	// The -p merge, as fast-wc's wcounter threads run it (ranking::ShardedMerge): every thread partitions its sub-count by the high bits
+	// of each word's hash, and then each thread totals up and sorts the shard that belongs to it.  Then the final k-way merge of the
+	// shards' runs, which fast-wc does on the main thread.
+	std::unique_ptr<ranking::ShardedMerge> sharded;
+	bench("merge/parallel", nsub, 0, [&] { sharded = std::make_unique<ranking::ShardedMerge>(nthreads); }, [&] {
+		std::barrier<> partitioned(nthreads);
+		std::vector<std::thread> threads;
+		for (int n = 0; n < nthreads; n++)
+		{
+			threads.emplace_back([&, n] {
+				sharded->partition(n, subs[n]);
+				partitioned.arrive_and_wait();
+				sharded->reduce(n, 0);
+			});
+		}
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+	});
+	bench("merge/parallel+runs", nsub, 0, [] {}, [&] { keep(ranking::merge_runs(sharded->runs())); });
+
+	// The final sort of the sequentially merged total, by count and then by word: everything, as fast-wc's parallel_sort does it, and
+	// just the top 100 as -t100 does it
+	bench("sort/full", total.size(), 0, [] {}, [&] { keep(ranking::parallel_sort(total, nthreads)); });
+	bench("sort/top100", total.size(), 0, [] {}, [&] { keep(ranking::top_k_sort(total, 100)); });
+
+	if (json_path != nullptr)
+	{
+		FILE *out = fopen(json_path, "w");
+		if (out == nullptr)
+		{
+			printf("Unable to write %s (errno %d)\n", json_path, errno);
+			return 1;
+		}
+		write_json(out, corpus, nfiles, nbytes, nwords, ndistinct, nthreads);
+		fclose(out);
+	}
+	return 0;
+}
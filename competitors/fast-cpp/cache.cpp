@@ -0,0 +1,171 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = {'F', 'W', 'C', 'A', 'C', 'H', 'E', '1'};
+// Version 1 kept each word's length in 16 bits, which cut off words longer than 64 KB
+static const uint32_t VERSION = 2;
+
+CountCache::CountCache(const char *path, const char *set, int nthreads) : path(path), kept(nthreads), recorded(nthreads)
+{
+	strncpy(token_set, set, sizeof(token_set) - 1);
+	int fdesc = open(path, O_RDONLY | O_CLOEXEC);
+	if (fdesc == -1)
+	{
+		return; // no cache yet, which is fine
+	}
+	struct stat sb;
+	if (fstat(fdesc, &sb) == 0 && (size_t)sb.st_size >= sizeof(CacheHeader))
+	{
+		void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fdesc, 0);
+		if (map != MAP_FAILED)
+		{
+			data = (const char *)map;
+			data_size = sb.st_size;
+		}
+	}
+	close(fdesc);
+	if (data == nullptr)
+	{
+		return;
+	}
+	CacheHeader h;
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION || strncmp(h.token_set, token_set, sizeof(token_set)) != 0 ||
+	    h.nentries > (data_size - sizeof(CacheHeader)) / sizeof(CacheEntry))
+	{
+		return;
+	}
+	entries = (const CacheEntry *)(data + sizeof(CacheHeader));
+	nentries = h.nentries;
+	// A damaged file could point us past the end of the mapping, so check every entry's range once here rather than on each use.  The
+	// word records inside each range are checked by find(), only for the entries we actually look up.
+	for (uint64_t i = 0; i < nentries; i++)
+	{
+		if (entries[i].words_offset > data_size || entries[i].words_bytes > data_size - entries[i].words_offset)
+		{
+			entries = nullptr;
+			nentries = 0;
+			return;
+		}
+	}
+}
+
+CountCache::~CountCache()
+{
+	if (data != nullptr)
+	{
+		munmap((void *)data, data_size);
+	}
+}
+
+const CacheEntry *CountCache::find(const CacheKey &key) const
+{
+	const CacheEntry *end = entries + nentries;
+	const CacheEntry *e = std::lower_bound(entries, end, key, [](const CacheEntry &a, const CacheKey &k) { return a.key < k; });
+	return (e != end && e->key == key && words_fit(*e)) ? e : nullptr;
+}
+
+// Exactly nwords records, each with all its characters, filling exactly words_bytes.  Anything else is a damaged (or truncated)
+// entry, whose count or lengths would have for_each_word read past the entry, or past the end of the mapping.
+bool CountCache::words_fit(const CacheEntry &e) const
+{
+	const char *p = data + e.words_offset;
+	const char *end = p + e.words_bytes;
+	for (uint64_t i = 0; i < e.nwords; i++)
+	{
+		uint32_t len;
+		if (end - p < 8)
+		{
+			return false;
+		}
+		memcpy(&len, p + 4, 4);
+		if (len == 0 || (uint64_t)(end - p - 8) < len)
+		{
+			return false;
+		}
+		p += 8 + len;
+	}
+	return p == end;
+}
+
+void CountCache::record(int n, const CacheKey &key, const WordTable &counts)
+{
+	Recorded r{key, counts.size(), {}};
+	for (auto [word, count] : counts)
+	{
+		uint32_t c = count;
+		uint32_t len = word.size();
+		size_t at = r.words.size();
+		r.words.resize(at + 8 + len);
+		memcpy(r.words.data() + at, &c, 4);
+		memcpy(r.words.data() + at + 4, &len, 4);
+		memcpy(r.words.data() + at + 8, word.data(), len);
+	}
+	recorded[n].push_back(std::move(r));
+}
+
+bool CountCache::save()
+{
+	// (key, words, their size, how many) for every entry, old and new alike
+	struct Out
+	{
+		CacheKey key;
+		const char *words;
+		uint64_t words_bytes;
+		uint64_t nwords;
+	};
+	std::vector<Out> out;
+	for (auto &list : kept)
+	{
+		for (const CacheEntry *e : list)
+		{
+			out.push_back(Out{e->key, data + e->words_offset, e->words_bytes, e->nwords});
+		}
+	}
+	for (auto &list : recorded)
+	{
+		for (const Recorded &r : list)
+		{
+			out.push_back(Out{r.key, r.words.data(), r.words.size(), r.nwords});
+		}
+	}
+	std::sort(out.begin(), out.end(), [](const Out &a, const Out &b) { return a.key < b.key; });
+	// The same inode can turn up twice (through a hard link, say); we only need it once
+	out.erase(std::unique(out.begin(), out.end(), [](const Out &a, const Out &b) { return a.key == b.key; }), out.end());
+
+	std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == nullptr)
+	{
+		return false;
+	}
+	CacheHeader h = {};
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	memcpy(h.token_set, token_set, sizeof(token_set));
+	h.nentries = out.size();
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	uint64_t offset = sizeof(CacheHeader) + out.size() * sizeof(CacheEntry);
+	for (const Out &o : out)
+	{
+		CacheEntry e{o.key, offset, o.words_bytes, o.nwords};
+		ok = ok && fwrite(&e, sizeof(e), 1, f) == 1;
+		offset += o.words_bytes;
+	}
+	for (const Out &o : out)
+	{
+		ok = ok && (o.words_bytes == 0 || fwrite(o.words, o.words_bytes, 1, f) == 1);
+	}
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/*
+ * The --cache file: the word counts of every file we scanned last time, so a rerun only has to scan the files that changed.
+ */
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "word_table.hpp"
+
+// A file (or one chunk of a big file) is identified by where it lives and what it looked like when we counted it.  If any of the
+// device, inode, size or modification time has changed since, we assume the contents have too and scan it again.  begin and end are
+// the byte range of the chunk, or 0 and -1 for a whole file.
+struct CacheKey
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	int64_t begin;
+	int64_t end;
+
+	static CacheKey of(const struct stat &sb, int64_t begin, int64_t end)
+	{
+		return CacheKey{(uint64_t)sb.st_dev, (uint64_t)sb.st_ino, (uint64_t)sb.st_size,
+		                (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec, begin, end};
+	}
+	bool operator<(const CacheKey &o) const
+	{
+		return memcmp(this, &o, sizeof(CacheKey)) < 0;
+	}
+	bool operator==(const CacheKey &o) const { return memcmp(this, &o, sizeof(CacheKey)) == 0; }
+};
+
+// The file is laid out so that we can mmap it and use it in place, without parsing or copying anything up front:
+//
+//   a CacheHeader
+//   nentries CacheEntry records, sorted by key, so a lookup is a binary search
+//   the words of each entry, as (uint32 count, uint32 length, characters) records one after the other
+//
+// A file from a different version, or one made with a different token set (whose counts would mean something else), is ignored.
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	char token_set[16];
+	uint32_t reserved;
+	uint64_t nentries;
+};
+
+struct CacheEntry
+{
+	CacheKey key;
+	uint64_t words_offset;
+	uint64_t words_bytes;
+	uint64_t nwords;
+};
+
+class CountCache
+{
+public:
+	CountCache(const char *path, const char *token_set, int nthreads);
+	~CountCache();
+	CountCache(const CountCache &) = delete;
+	CountCache &operator=(const CountCache &) = delete;
+
+	// The entry for this key from the last run, or nullptr, as if it weren't there, if the entry is damaged.  Safe to call from several
+	// threads at once.
+	const CacheEntry *find(const CacheKey &key) const;
+
+	// Calls on_word(word, len, count) for each word of a cached entry.  find() has already checked that the records fit the entry.
+	template <class OnWord>
+	void for_each_word(const CacheEntry *e, OnWord &&on_word) const
+	{
+		const char *p = data + e->words_offset;
+		for (uint64_t i = 0; i < e->nwords; i++)
+		{
+			uint32_t count, len;
+			memcpy(&count, p, 4);
+			memcpy(&len, p + 4, 4);
+			on_word(p + 8, len, count);
+			p += 8 + len;
+		}
+	}
+
+	// Thread n used a cached entry, so it should go into the next cache file too
+	void keep(int n, const CacheEntry *e) { kept[n].push_back(e); }
+
+	// Thread n just scanned the file or chunk described by key, and these are its counts
+	void record(int n, const CacheKey &key, const WordTable &counts);
+
+	// Write the new cache file: everything kept or recorded during this run, and nothing else, so files that have gone away drop out.
+	// We write to a temporary file and rename it into place, so an interrupted run never leaves a half-written cache behind.
+	bool save();
+
+private:
+	bool words_fit(const CacheEntry &e) const;
+
+	struct Recorded
+	{
+		CacheKey key;
+		uint64_t nwords;
+		std::vector<char> words;
+	};
+	std::string path;
+	char token_set[16] = {};
+	const char *data = nullptr;
+	size_t data_size = 0;
+	const CacheEntry *entries = nullptr;
+	uint64_t nentries = 0;
+	std::vector<std::vector<const CacheEntry *>> kept;
+	std::vector<std::vector<Recorded>> recorded;
+};
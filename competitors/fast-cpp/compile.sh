@@ -4,8 +4,30 @@ set -e
 
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 
-c++ -O3 -std=c++20 \
+# zlib and zstd are optional (see archive.cpp): link whichever of them this machine has the development files for
+DEFS=()
+LIBS=()
+have() {
+  echo "#include <$2>" | c++ -E -x c++ - >/dev/null 2>&1 && echo "int main(){}" | c++ -x c++ - "-l$1" -o /dev/null 2>/dev/null
+}
+if have z zlib.h; then LIBS+=(-lz); else DEFS+=(-DFASTWC_NO_GZIP); fi
+if have zstd zstd.h; then LIBS+=(-lzstd); else DEFS+=(-DFASTWC_NO_ZSTD); fi
+
+c++ -O3 -std=c++20 ${DEFS[@]+"${DEFS[@]}"} \
   "$SCRIPT_DIR/fast-wc.cpp" \
+  "$SCRIPT_DIR/affinity.cpp" \
+  "$SCRIPT_DIR/archive.cpp" \
   "$SCRIPT_DIR/utils.cpp" \
-  -lpthread -lstdc++fs \
+  "$SCRIPT_DIR/tokenizer.cpp" \
+  "$SCRIPT_DIR/uring.cpp" \
+  "$SCRIPT_DIR/stats.cpp" \
+  "$SCRIPT_DIR/perf.cpp" \
+  "$SCRIPT_DIR/output.cpp" \
+  "$SCRIPT_DIR/cache.cpp" \
+  "$SCRIPT_DIR/partial.cpp" \
+  "$SCRIPT_DIR/ranking.cpp" \
+  "$SCRIPT_DIR/serve.cpp" \
+  "$SCRIPT_DIR/space_saving.cpp" \
+  "$SCRIPT_DIR/word_counter.cpp" \
+  ${LIBS[@]+"${LIBS[@]}"} -lpthread -lstdc++fs \
   -o "$SCRIPT_DIR/fast-wc"
@@ -2,336 +2,1546 @@
 /*
  * Ken's word-counter in C++
  */
+#include <cinttypes>
+#include <climits>
 #include <cstdlib>
 #include <cstdio>
 #include <thread>
-#include <mutex>
 #include <vector>
 #include <cstring>
-#include <map>
 #include <array>
+#include <algorithm>
 #include <semaphore>
+#include <barrier>
+#include <bit>
+#include <memory>
+#include <string>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <atomic>
 #include "utils.hpp"
+#include "word_table.hpp"
+#include "tokenizer.hpp"
+#include "work_queue.hpp"
+#include "uring.hpp"
+#include "stats.hpp"
+#include "perf.hpp"
+#include "output.hpp"
+#include "affinity.hpp"
+#include "archive.hpp"
+#include "cache.hpp"
+#include "hot_tokens.hpp"
+#include "partial.hpp"
+#include "ranking.hpp"
+#include "scanning.hpp"
+#include "serve.hpp"
+#include "space_saving.hpp"
 
-const int MAXTHREADS = 64;
-const int FDESCS = MAXTHREADS;
-const int BASICBLOCK = 1024;
+// The most files (or chunks of files) that can be open and waiting to be scanned at any one time, and the unit reads are sized in (see
+// scanning.hpp)
+using scanning::FDESCS;
+using scanning::BASICBLOCK;
 const int COMMON = 1024;
-std::mutex lock;
-char token_chars[512] = {0};
-char buffers[MAXTHREADS][BASICBLOCK * 128];
-int fdescs[FDESCS];
-std::counting_semaphore<1> fcount(FDESCS);
-std::counting_semaphore<1> opencount(0);
-int free_ptr, next_ptr;
-int nblocks = 16;
+
+// One unit of work for a wcounter thread: either a whole file, or, for a big file, one chunk of it.  The chunks of a file all share
+// its file descriptor, and chunks_left counts down so that whichever thread finishes the last chunk is the one that closes it.
+struct WorkItem
+{
+	int fdesc;
+	off_t begin;
+	off_t end; // -1 means "the whole file"
+	std::atomic_int *chunks_left;
+	// With --cache, a file (or chunk) whose counts we already have.  Then there is nothing to read, and fdesc is -1.
+	const CacheEntry *cached = nullptr;
+	// The file's size, if the opener already had to stat it, otherwise -1
+	off_t size = -1;
+};
+
+// The file opener hands out work through one lock-free ring per wcounter thread (see work_queue.hpp), and fcount throttles it so that
+// at most FDESCS items are in flight.
+std::unique_ptr<WorkQueues<WorkItem>> work_queues;
+std::counting_semaphore<FDESCS> fcount(FDESCS);
+// -b#.  0, the default, picks the read size per file (see ReadScan).
+int nblocks = 0;
+off_t chunk_size = 1024 * 1024;
 int BLOCKSIZE;
 bool parallel_merge = false;
+bool use_mmap = false;
 bool silent = false;
 int nthreads = 1;
+int ndiscovery = 4;
+size_t top_k = 0;
+// --prefetch: how many full blocks the I/O threads may be ahead by (0 is off), and how many I/O threads
+int prefetch_depth = 0;
+int io_threads = 2;
 std::atomic_int file_count(0);
 std::atomic_int expected_file_count(0);
-std::atomic_int blocks_scanned(0);
-std::atomic_int bytes_scanned(0);
-std::counting_semaphore<1>* ready_for_merge[MAXTHREADS];
+std::vector<stats::ThreadStats> thread_stats;
+// Opening happens in the discovery threads, and they each add their own time spent in openat() here
+std::atomic<int64_t> open_wall_ns(0);
+std::atomic<int64_t> open_cpu_ns(0);
+stats::PhaseTime discover_time;
+bool verbose = false;
+bool perf_counters = false;
+
+// With --pin each wcounter thread stays on a CPU of its own, worker_cpus[n], instead of being moved around by the scheduler.  --numa
+// does the same, but deals the CPUs out node by node (see affinity.hpp), and has each thread allocate its table again once it is on
+// its CPU.  Linux puts a page on the node of the thread that first touches it, so the table a thread fills is then in its own node's
+// memory, as are the read buffers, which the threads allocate for themselves anyway.  The only time a thread reaches into another
+// node's memory is when it merges its shard of everybody's tables, in shard_merge.
+std::vector<int> worker_cpus;
+bool numa_local = false;
+const char *json_path = nullptr;
+std::unique_ptr<std::barrier<>> scan_done;
 
-// C++ needs to know the declaration of anything it sees at the time it first sees it.  This particular method is used
-// before I define it.  Mostly, I just wanted you to see an example of that.  The & means "by reference"
-inline void found_something(int &, char *&, char *&, int &);
+// C++ needs to know the declaration of anything it sees at the time it first sees it.  These methods are used
+// before I define them.  Mostly, I just wanted you to see an example of that.
+void shard_merge(int n);
+void approx_merge(int n);
 
-// Here, I am defining a new "type" that really is just an alias ("a different word for") a tree that has keys that are
-// C++ strings and values that are integer counts
-using WordCount = std::map<std::string, int>;
+// Here, I am defining a new "type" that really is just an alias ("a different word for") a table that maps words to integer
+// counts.  This used to be a std::map<std::string, int>, but see word_table.hpp for why a flat hash table is much faster here.
+using WordCount = WordTable;
 
 // We will be creating separate sub-counts on a per-thread basis and then later combining them.  This avoids a need to lock
 // for each counting action, which would be very slow otherwise.
-WordCount sub_count[MAXTHREADS];
+std::vector<WordCount> sub_count;
 WordCount total_count;
 
-// Here is our file opener.  It would normally use the C++ FILE class, but it turns out we would need a lock (mutex) for each fread operation
-// to avoid a form of conflict with the fopen operation.  That becomes quite slow, so instead this code uses the actual Linux system calls,
-// open() and (in the word counter), read().  Doing direct Linux calls is allowed but a bit non-standard because this is such a low-level
-// approach.  The big win is that I avoided extra creation of std::string objects, which cut my runtime costs down by about 50%
+// Where found() puts the words thread n finds.  Normally that is just its sub-count, but with --cache we need each file's counts on
+// their own, so they get counted into a separate table first (see scan_done_into).
+std::vector<WordCount *> counting;
+std::unique_ptr<CountCache> cache;
+const char *cache_path = nullptr;
+const char *partial_path = nullptr;
+// --files-from: a list of the files to count, in place of a directory to walk
+const char *files_from = nullptr;
+// --serve: stay up, keep the counts current and answer queries on this socket (see serve.hpp)
+const char *serve_path = nullptr;
+
+// --hot-tokens: the hot tokens' counts, one array per thread (see found).  With --cache each file's counts have to be kept apart, and
+// a hot count doesn't know which file it came from, so then we don't use them.
+using HotSet = hot::CTokens;
+struct alignas(64) HotCounts
+{
+	int count[hot::count<HotSet>] = {};
+};
+std::vector<HotCounts> hot_counts;
+bool use_hot = false;
+
+// With --approx K each thread keeps a Space-Saving summary of K counters instead of a full sub-count (see space_saving.hpp)
+size_t approx_k = 0;
+std::vector<SpaceSaving> summaries;
+
+// A single big file would otherwise be scanned by one thread while all the others sit idle, so we cut files bigger than chunk_size into
+// roughly equal byte ranges and hand those out separately.  This says how many chunks a file gets.
+off_t chunks_for(const struct stat &sb)
+{
+	// (With --prefetch a big file is spread over many blocks anyway, see prefetcher)
+	if (nthreads > 1 && chunk_size > 0 && prefetch_depth == 0 && S_ISREG(sb.st_mode) && sb.st_size > chunk_size)
+	{
+		return (sb.st_size + chunk_size - 1) / chunk_size;
+	}
+	return 1;
+}
+
+// With --cache, queue a file straight from the cache without even opening it.  Only if every one of its chunks is there, though;
+// otherwise we return false and it gets scanned as usual.  The caller already holds one fcount slot.
+bool queue_cached(const struct stat &sb)
+{
+	off_t nchunks = chunks_for(sb);
+	off_t len = (sb.st_size + nchunks - 1) / nchunks;
+	std::vector<const CacheEntry *> hits(nchunks);
+	for (off_t c = 0; c < nchunks; c++)
+	{
+		CacheKey key = nchunks == 1 ? CacheKey::of(sb, 0, -1) : CacheKey::of(sb, c * len, std::min((c + 1) * len, (off_t)sb.st_size));
+		if ((hits[c] = cache->find(key)) == nullptr)
+		{
+			return false;
+		}
+	}
+	for (off_t c = 0; c < nchunks; c++)
+	{
+		if (c > 0)
+		{
+			fcount.acquire();
+		}
+		work_queues->push(WorkItem{-1, (off_t)hits[c]->key.begin, (off_t)hits[c]->key.end, nullptr, hits[c]});
+	}
+	return true;
+}
+
+void add_open_time(const stats::Stopwatch &sw)
+{
+	stats::PhaseTime t = sw.elapsed();
+	open_wall_ns += t.wall_ns;
+	open_cpu_ns += t.cpu_ns;
+}
+
+// Opens one file and queues it up for the wcounter threads.  It would normally use the C++ FILE class, but it turns out we would need a lock
+// (mutex) for each fread operation to avoid a form of conflict with the fopen operation.  That becomes quite slow, so instead this code uses the
+// actual Linux system calls, openat() and (in the word counter), read().  Doing direct Linux calls is allowed but a bit non-standard because this
+// is such a low-level approach.  The big win is that I avoided extra creation of std::string objects, which cut my runtime costs down by about 50%
+void open_and_queue(int dirfd, const char *name)
+{
+	expected_file_count++;
+	fcount.acquire();
+	stats::Stopwatch sw;
+	struct stat sb;
+	bool have_stat = false;
+	if (cache)
+	{
+		// The cache is keyed by what stat says, so we can tell whether a file is unchanged before we open it
+		have_stat = fstatat(dirfd, name, &sb, 0) == 0;
+		if (have_stat && queue_cached(sb))
+		{
+			add_open_time(sw);
+			return;
+		}
+	}
+	int fdesc = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fdesc == -1)
+	{
+		printf("Unable to open file: %s (errno %d)\n", name, errno);
+		fcount.release();
+		return;
+	}
+	if (prefetch_depth > 0)
+	{
+		// Start the kernel reading the file now, so that it is (at least partly) in the page cache by the time an I/O thread gets to it
+		posix_fadvise(fdesc, 0, 0, POSIX_FADV_WILLNEED);
+	}
+	// Each chunk takes an fcount slot of its own
+	off_t nchunks = 1;
+	if (nthreads > 1 && chunk_size > 0 && prefetch_depth == 0)
+	{
+		have_stat = have_stat || fstat(fdesc, &sb) == 0;
+		if (have_stat)
+		{
+			nchunks = chunks_for(sb);
+		}
+	}
+	add_open_time(sw);
+	// Whatever stat said about the size goes along with the work, so that the scanner doesn't have to fstat the file all over again
+	off_t size = have_stat && S_ISREG(sb.st_mode) ? (off_t)sb.st_size : -1;
+	if (nchunks == 1)
+	{
+		work_queues->push(WorkItem{fdesc, 0, -1, nullptr, nullptr, size});
+		return;
+	}
+	off_t len = (sb.st_size + nchunks - 1) / nchunks;
+	auto chunks_left = new std::atomic_int(nchunks);
+	for (off_t c = 0; c < nchunks; c++)
+	{
+		if (c > 0)
+		{
+			fcount.acquire();
+		}
+		work_queues->push(WorkItem{fdesc, c * len, std::min((c + 1) * len, (off_t)sb.st_size), chunks_left, nullptr, size});
+	}
+}
+
+// Which files we count (-e) and what counts as a word (-k).  Both are picked from compile-time sets, see utils.hpp and tokenizer.hpp.
+utils::ExtensionPred extension_filter = utils::has_extension<utils::CSources>;
+const char *extension_set = utils::CSources::name;
+const char *token_set = tokenizer::Ident::name;
+
+// Here is our file opener.  We don't wait for the whole tree to be listed before opening anything: the directory walker hands us each
+// .c or .h file the moment it finds it (from several traversal threads at once), and we open it and queue it right away, so the
+// wcounter threads are already busy while the rest of the tree is still being discovered.
+//
+// With --files-from somebody (git ls-files, usually) has already done the discovering, so we skip the walk, and with it every .git
+// and build directory the walk would have gone through, and open the files on the list instead.
 void fopener(char *dir)
 {
-	std::vector<fs::path> files_to_sweep;
+	stats::Stopwatch sw;
 	try
 	{
-		files_to_sweep = utils::find_all_files(dir, [](const std::string &extension){ return extension == ".h" || extension == ".c"; });
+		if (files_from != nullptr)
+		{
+			utils::list_files(files_from, ndiscovery, open_and_queue);
+		}
+		else
+		{
+			utils::walk_files(dir, extension_filter, ndiscovery, open_and_queue);
+		}
 	}
 	catch(const std::exception& e)
 	{
-		printf("File scanner unable to access folder %s\n", dir);
+		printf(files_from != nullptr ? "File scanner unable to read file list %s\n" : "File scanner unable to access folder %s\n", dir);
 		exit(0);
 	}
-
-	int nfiles = files_to_sweep.size();
 	if (!silent)
 	{
-		printf("In %s found %d files to scan\n", dir, nfiles);
-		expected_file_count = nfiles;
+		printf("In %s found %d files to scan\n", dir, expected_file_count.load());
 	}
-	while (nfiles--)
+	discover_time.wall_ns = sw.elapsed().wall_ns;
+	// No more work is coming.  Once the queues drain, the wcounter threads see this and move on to merging.
+	work_queues->close();
+}
+
+// These methods are used if a word is found.  The word is in the char[] buffer we read the file data into, and because that buffer will be
+// reused later for a new read on other data, we can't safely just leave it there.  This is why the table copies each new word into its own arena.
+//
+// The usual version gets the word's hash along with it.  The tokenizer works the hash out the moment it finds the end of the word, while the bytes
+// are still in L1 (see scan_hashed in tokenizer.hpp), so the table compares hashes first and only reads the characters again for the memcmp that
+// confirms a hit.  We used to write a null after every word instead, so that found() could take a C string, and then strlen went over the word
+// again, and the hash a third time.  It is also where --approx comes in.  That branch goes the same way for the whole run, so the branch predictor
+// makes it close to free.
+//
+// With --hot-tokens, the few dozen words in hot_tokens.hpp (int, if, return, struct, NULL, i, 0, the, ...), which make up more than half
+// of all the words in typical C, skip the table altogether.  A perfect hash tells us in one multiply and one compare whether a word is
+// one of them, and if it is, its count is just an entry in a little array of our own that never leaves L1.  They go into the table (or
+// the summary) once, with fold_hot, at the end.  It isn't the default, because it doesn't pay: the table's hit path is already about
+// as short, and those same words' slots are just as sure to be in L1, while whether the next word is a hot one is close to a coin
+// toss, so the extra branch is mispredicted about every other word.  On the generated corpus it costs 25 ns a word instead of 18 (see
+// "tokenize+insert/hot" in bench/bench.cpp).  It is kept for CPUs and corpora where that might come out the other way.
+inline void found(int &tn, const char *word, int len, uint64_t hash)
+{
+	if (use_hot)
 	{
-		fcount.acquire();
-		int slot = free_ptr % FDESCS;
-		if ((fdescs[slot] = open(files_to_sweep[nfiles].c_str(), O_RDONLY)) == -1)
+		int t = hot::find<HotSet>(word, len, hash);
+		if (t >= 0)
 		{
-			printf("Unable to open file: %s (errno %d)\n", files_to_sweep[nfiles].c_str(), errno);
+			hot_counts[tn].count[t]++;
+			return;
 		}
-		else
+	}
+	if (approx_k > 0)
+	{
+		summaries[tn].add_hashed(word, len, hash);
+		return;
+	}
+	counting[tn]->add_hashed(word, len, hash);
+}
+
+// For the rare word we have to hash ourselves: the end of a file that ends in a word, or a word that split between two reads
+inline void found(int &tn, const char *word, int len)
+{
+	found(tn, word, len, hash_word(word, len));
+}
+
+// The read() based scanner, and skipping the split word at the start of a chunk, are in scanning.hpp, shared with WordCounter.  Here
+// ReadScan just hands the words it finds to found(), for thread n, and its stats go into thread n's.
+struct Found
+{
+	int n;
+	void operator()(const char *word, size_t len, uint64_t hash) { found(n, word, len, hash); }
+};
+template <class Policy>
+using ReadScan = scanning::ReadScan<Policy, Found>;
+
+template <class Policy>
+void add_scan_stats(int n, const ReadScan<Policy> &scan)
+{
+	thread_stats[n].blocks += scan.blocks;
+	thread_stats[n].bytes += scan.bytes;
+}
+
+template <class Policy>
+void scan_by_read(int n, const WorkItem &item, char *buffer)
+{
+	ReadScan<Policy> scan(Found{n}, item.fdesc, item.begin, item.end, item.size, BLOCKSIZE, buffer);
+	scanning::read_all(scan, buffer);
+	add_scan_stats(n, scan);
+}
+
+// With -m we memory map the whole file instead.  The kernel then doesn't copy anything into our buffer: the page cache pages are mapped
+// straight into our address space and we tokenize the file in one pass, so there is no such thing as a word split across two reads.  It
+// isn't worth it for tiny files (one read() is cheaper than setting up and tearing down a mapping), and pipes and other non-regular
+// files can't be mapped at all, so in those cases we return false and the caller uses scan_by_read instead.
+//
+// A chunk of a big file gets the same treatment, except that we only want the pages for our own chunk faulted in, so instead of
+// MAP_POPULATE (which would populate the whole file, once per chunk!) we ask for readahead of just our range.
+template <class Policy>
+bool scan_mapped(int n, const WorkItem &item)
+{
+	struct stat sb;
+	if (fstat(item.fdesc, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size <= BLOCKSIZE)
+	{
+		return false;
+	}
+	size_t len = sb.st_size;
+	bool whole_file = item.end == -1;
+	// MAP_POPULATE asks the kernel to fault in all the pages right away rather than one page fault at a time as we touch them,
+	// and MADV_SEQUENTIAL tells it to read ahead aggressively and drop pages behind us
+	void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE | (whole_file ? MAP_POPULATE : 0), item.fdesc, 0);
+	if (map == MAP_FAILED)
+	{
+		return false;
+	}
+	const char *data = (const char *)map;
+	size_t begin = 0, end = len;
+	// madvise wants a page-aligned start address
+	size_t aligned = whole_file ? 0 : item.begin & ~(sysconf(_SC_PAGESIZE) - 1);
+	madvise((char *)map + aligned, len - aligned, MADV_SEQUENTIAL);
+	if (!whole_file)
+	{
+		madvise((char *)map + aligned, item.end - aligned, MADV_WILLNEED);
+		begin = item.begin;
+		end = item.end;
+		// Skip a word that started in the chunk before ours, and finish one that runs past our end (see skip_split_word)
+		if (begin > 0)
 		{
-			opencount.release();
-			free_ptr++;
+			while (begin < len && tokenizer::is_token<Policy>(data[begin - 1]) && tokenizer::is_token<Policy>(data[begin]))
+			{
+				begin++;
+			}
+		}
+		while (end < len && tokenizer::is_token<Policy>(data[end - 1]) && tokenizer::is_token<Policy>(data[end]))
+		{
+			end++;
 		}
 	}
-	for (int n = 0; n < nthreads; n++)
+	thread_stats[n].blocks += (end - begin + BLOCKSIZE - 1) / BLOCKSIZE;
+	thread_stats[n].bytes += whole_file ? len : item.end - item.begin;
+	const char *chunk = data + begin;
+	size_t clen = end > begin ? end - begin : 0;
+	size_t tail = tokenizer::scan_hashed<Policy>(chunk, clen, [&](size_t start, size_t stop, uint64_t hash) { found(n, chunk + start, stop - start, hash); });
+	// Same special case as in scan_by_read: the file (or our chunk) can end in the middle of a word
+	if (tail < clen)
+	{
+		found(n, chunk + tail, clen - tail);
+	}
+	munmap(map, len);
+	return true;
+}
+
+// Bookkeeping for a work item we just took off the queue
+void start_item(int n, const WorkItem &item)
+{
+	// Chunks of one file only count once
+	if (item.begin == 0)
+	{
+		file_count++;
+		thread_stats[n].files++;
+	}
+	if (item.end != -1)
+	{
+		thread_stats[n].chunks++;
+	}
+}
+
+// A work item from the cache: just add the cached counts into our sub-count.  Returns false for an item that needs scanning.
+bool take_cached(int n, const WorkItem &item)
+{
+	if (item.cached == nullptr)
 	{
-		fcount.acquire();
-		fdescs[free_ptr++ % FDESCS] = -2;
+		return false;
 	}
-	opencount.release(nthreads);
+	cache->for_each_word(item.cached, [n](const char *word, size_t len, int count) { sub_count[n].add(word, len, count); });
+	cache->keep(n, item.cached);
+	thread_stats[n].cached++;
+	fcount.release();
+	return true;
 }
 
-// These two methods are used if a word is found.  The word is in the char[] buffer we read the file data into, and because that buffer will be
-// reused later for a new read on other data, we can't safely just leave it there.  This is why we turn each word into a std::string at this point.
-inline void found(int &tn, char *word)
+// With --cache, a file is counted into a table of its own (see counting), and once it's done that table is saved for the cache and
+// folded into our sub-count
+void scan_done_into(int n, const WorkItem &item, WordCount &counts)
 {
-	sub_count[tn][std::string(word)]++;
+	struct stat sb;
+	if (fstat(item.fdesc, &sb) == 0)
+	{
+		cache->record(n, CacheKey::of(sb, item.begin, item.end), counts);
+	}
+	sub_count[n].merge(counts);
+	counts.clear();
+}
+
+// When a work item has been scanned, it gives back its fcount slot.  Returns true if the caller should now close the file, which is
+// only when this was the last chunk of it to finish.
+bool release_item(const WorkItem &item)
+{
+	fcount.release();
+	if (item.chunks_left != nullptr)
+	{
+		if (--*item.chunks_left != 0)
+		{
+			return false;
+		}
+		delete item.chunks_left;
+	}
+	return true;
+}
+
+// With --mem-limit, a thread whose sub-count grows past its share of the budget writes it out to a temp file as one sorted run (in the
+// partial result format, see partial.hpp) and starts over with an empty table.  At the end the runs are merged back together in one
+// streaming pass, just like "fast-wc merge" does, so no table ever holds more than its share of the vocabulary and a huge vocabulary
+// ends up on disk rather than killing us.  A word can of course turn up in many runs; the merge adds those up.
+size_t mem_limit = 0;
+std::vector<std::vector<std::string>> spill_paths;
+std::atomic_bool spilled(false);
+
+void fold_hot(int n);
+
+void spill(int n)
+{
+	fold_hot(n);
+	std::vector<std::pair<std::string_view, uint64_t>> words;
+	words.reserve(sub_count[n].size());
+	for (auto [word, count] : sub_count[n])
+	{
+		words.emplace_back(word, count);
+	}
+	const char *dir = getenv("TMPDIR");
+	std::string path = std::string(dir != nullptr && *dir ? dir : "/tmp") + "/fast-wc-run-XXXXXX";
+	int fdesc = mkstemp(path.data());
+	if (fdesc == -1 || close(fdesc) == -1 || !partial::write(path.c_str(), words))
+	{
+		// Not much point going on: the counts we were about to throw away are gone either way
+		printf("Unable to write a spill file %s (errno %d)\n", path.c_str(), errno);
+		exit(1);
+	}
+	spill_paths[n].push_back(std::move(path));
+	thread_stats[n].spills++;
+	spilled = true;
+	// Assigning a fresh table gives its memory back, which clear() wouldn't
+	sub_count[n] = WordCount();
 }
 
-// This version is used if a word splits, with half in one chunk of a file, but the remainder in the next chunk.  For our std::string we need to
-// recombine them into a single word, which in this case will live in a char[] on the stack while this version of found is active.
-inline void found(int &tn, char *&prefix, char *&suffix)
+// Put the hot tokens counted so far into the thread's table or summary, and start their counts again from 0
+void fold_hot(int n)
 {
-	int plen = strlen(prefix);
-	int slen = strlen(suffix);
-	if (plen + slen >= 1023)
+	if (!use_hot)
 	{
-		// In fact this never happens, but it is wiser to check!  Otherwise we could overrun the stack and corrupt the program memory
-		printf("Word is unreasonably long! %s + %s (len %d)\n", prefix, suffix, plen + slen);
 		return;
 	}
-	/// If we get here, we know that the new combined word will definitely fit into 1024 bytes, including the null (0) to terminate the word
-	char word[1024];
-	char *wp = word;
-	memcpy(word, prefix, plen);
-	memcpy(word + plen, suffix, slen + 1);
-	found(tn, wp);
+	for (size_t t = 0; t < hot::count<HotSet>; t++)
+	{
+		int &c = hot_counts[n].count[t];
+		if (c == 0)
+		{
+			continue;
+		}
+		std::string_view word = HotSet::tokens[t];
+		if (approx_k > 0)
+		{
+			summaries[n].add(word.data(), word.size(), c);
+		}
+		else
+		{
+			sub_count[n].add(word.data(), word.size(), c);
+		}
+		c = 0;
+	}
+}
+
+// Called between blocks, whenever nobody is in the middle of adding to the table.  We stop at half our share so that there is still
+// room for the sort while spilling, and because a table grows by doubling.
+void maybe_spill(int n)
+{
+	if (mem_limit > 0 && sub_count[n].memory() > mem_limit / nthreads / 2)
+	{
+		spill(n);
+	}
+}
+
+// With -u we read through io_uring instead (see uring.hpp).  Each thread keeps up to uring_depth files in flight, each with its own
+// ReadScan and its own slice of the buffer.  Rather than one blocking read() at a time, we queue up a read for every file we have,
+// hand them to the kernel in a single system call, and scan whichever blocks come back first while the rest are still being read.
+// The files are closed through the ring as well.
+//
+// The slices are "registered" with the kernel up front if it will let us, which saves it from mapping our memory for every read.
+const uint64_t CLOSE_TAG = 1ull << 63;
+int uring_depth = 0;
+
+template <class Policy>
+void scan_uring(int n, Uring &ring)
+{
+	std::vector<char> buffer_store((size_t)scanning::BUFFER_SIZE * uring_depth);
+	std::vector<std::unique_ptr<ReadScan<Policy>>> scans(uring_depth);
+	// What each slot is reading
+	std::vector<WorkItem> items(uring_depth);
+	std::vector<iovec> iovs(uring_depth);
+	for (int i = 0; i < uring_depth; i++)
+	{
+		iovs[i].iov_base = buffer_store.data() + (size_t)scanning::BUFFER_SIZE * i;
+		iovs[i].iov_len = scanning::BUFFER_SIZE;
+	}
+	bool fixed = ring.register_buffers(iovs.data(), uring_depth);
+	// With --cache each slot counts into its own table, since its file's words have to be kept apart from the others in flight
+	std::vector<WordCount> file_counts(cache ? uring_depth : 0);
+	auto count_into = [&](int i) { counting[n] = cache ? &file_counts[i] : &sub_count[n]; };
+	int scanning = 0, closing = 0;
+	bool more = true;
+	auto sqe = [&ring] {
+		io_uring_sqe *e;
+		while ((e = ring.get_sqe()) == nullptr)
+		{
+			ring.submit_and_wait(0);
+		}
+		return e;
+	};
+	auto close_file = [&](int fdesc) {
+		io_uring_sqe *e = sqe();
+		e->opcode = IORING_OP_CLOSE;
+		e->fd = fdesc;
+		e->user_data = CLOSE_TAG | (uint32_t)fdesc;
+		closing++;
+	};
+	// Queue the next read for slot i, or, if its scan is finished, wrap it up and free the slot
+	auto next_read = [&](int i) {
+		ReadScan<Policy> &scan = *scans[i];
+		int len = scan.want();
+		if (len == 0)
+		{
+			count_into(i);
+			scan.finish();
+			add_scan_stats(n, scan);
+			if (cache)
+			{
+				scan_done_into(n, items[i], file_counts[i]);
+			}
+			if (release_item(items[i]))
+			{
+				close_file(items[i].fdesc);
+			}
+			scans[i].reset();
+			scanning--;
+			return;
+		}
+		io_uring_sqe *e = sqe();
+		e->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		e->fd = scan.fdesc;
+		e->addr = (uint64_t)iovs[i].iov_base;
+		e->len = len;
+		e->off = scan.pos;
+		e->buf_index = fixed ? i : 0;
+		e->user_data = i;
+	};
+	while (more || scanning > 0 || closing > 0)
+	{
+		// Words from the files still in flight land in the new table, which is fine: the merge adds the runs up anyway
+		maybe_spill(n);
+		// Fill the free slots.  We only let pop() put us to sleep if there is nothing at all in flight.
+		for (int i = 0; i < uring_depth && more; i++)
+		{
+			if (scans[i] != nullptr)
+			{
+				continue;
+			}
+			WorkItem item;
+			if (scanning == 0 && closing == 0)
+			{
+				if (!work_queues->pop(n, item))
+				{
+					more = false;
+					break;
+				}
+			}
+			else if (!work_queues->try_pop(n, item))
+			{
+				break;
+			}
+			start_item(n, item);
+			if (take_cached(n, item))
+			{
+				continue;
+			}
+			count_into(i);
+			if (use_mmap && scan_mapped<Policy>(n, item))
+			{
+				if (cache)
+				{
+					scan_done_into(n, item, file_counts[i]);
+				}
+				if (release_item(item))
+				{
+					close_file(item.fdesc);
+				}
+				continue;
+			}
+			items[i] = item;
+			scans[i] = std::make_unique<ReadScan<Policy>>(Found{n}, item.fdesc, item.begin, item.end, item.size, BLOCKSIZE, (char *)iovs[i].iov_base);
+			scanning++;
+			next_read(i);
+		}
+		if (scanning == 0 && closing == 0)
+		{
+			continue;
+		}
+		ring.submit_and_wait(1);
+		io_uring_cqe *cqe;
+		while ((cqe = ring.peek()) != nullptr)
+		{
+			uint64_t tag = cqe->user_data;
+			int res = cqe->res;
+			ring.seen();
+			if (tag & CLOSE_TAG)
+			{
+				closing--;
+				int fdesc = (int)(uint32_t)tag;
+				// Kernels before 5.6 don't know IORING_OP_CLOSE, and the file is still open in that case
+				if (res == -EINVAL)
+				{
+					res = close(fdesc) == -1 ? -errno : 0;
+				}
+				if (res < 0)
+				{
+					printf("Unable to close file: fdesc %d errno %d\n", fdesc, -res);
+				}
+				continue;
+			}
+			count_into(tag);
+			scans[tag]->consume((char *)iovs[tag].iov_base, res);
+			next_read(tag);
+		}
+	}
+}
+
+// The plain version: one blocking read() at a time
+template <class Policy>
+void scan_items(int n)
+{
+	WorkItem item;
+	std::vector<char> buffer_store(scanning::BUFFER_SIZE);
+	char *buffer = buffer_store.data();
+	WordCount file_counts;
+	counting[n] = cache ? &file_counts : &sub_count[n];
+	while (work_queues->pop(n, item))
+	{
+		start_item(n, item);
+		if (take_cached(n, item))
+		{
+			maybe_spill(n);
+			continue;
+		}
+		if (!use_mmap || !scan_mapped<Policy>(n, item))
+		{
+			scan_by_read<Policy>(n, item, buffer);
+		}
+		if (cache)
+		{
+			scan_done_into(n, item, file_counts);
+		}
+		if (release_item(item) && close(item.fdesc) == -1)
+		{
+			printf("Unable to close file: fdesc %d errno %d\n", item.fdesc, errno);
+		}
+		maybe_spill(n);
+	}
+}
+
+// With "-" as the directory we count whatever arrives on stdin instead (the output of git show, a preprocessor, a decompressor, ...).
+// A pipe can only be read in order, by one thread, so a reader thread does all the reading and hands the wcounter threads whole blocks
+// to scan.  Memory stays bounded: there are a fixed number of block buffers, the reader waits for a free one before it reads more, and
+// the wcounter threads give each one back as soon as they are done with it.
+//
+// With --prefetch the same pipeline reads files as well.  Then a few I/O threads (--io-threads) do all the read() calls and fill the
+// blocks, while the wcounter threads do nothing but scan blocks that are already full, so waiting on the disk overlaps with scanning
+// instead of taking turns with it.  --prefetch says how many full blocks can be waiting, which is how far ahead of the scanning the
+// reading is allowed to get.  Small files share blocks: an I/O thread just carries on filling the same block with the next file, with a
+// newline in between so no word runs from one into the other.  A big file is spread over many blocks, which any thread can scan, so
+// big files don't need cutting into chunks either.
+//
+// Every block a reader hands off ends on a delimiter.  Whatever word was still going at the end of the read is copied to the front
+// of the next buffer, which is the same job the prefix does in ReadScan, only done once by the reader rather than by whichever
+// thread happens to get the next block.  So the wcounter threads never see a split word, and can scan their blocks in any order.  A
+// word that fills its whole block isn't handed off in pieces: the block grows instead, until the word ends or the input does, so a word
+// counts as one word however long it is, just as it does in ReadScan.  The block goes back to TEXT_BLOCK once it is free again.
+const size_t TEXT_BLOCK = 1024 * 1024;
+struct TextBlock
+{
+	std::vector<char> data; // TEXT_BLOCK bytes, unless the block is holding a word longer than that
+	size_t len;
+	size_t bytes; // len, less the newlines we put between files
+};
+std::vector<TextBlock> text_blocks;
+// Indexes into text_blocks: full ones go to the wcounter threads, and they put them back on the free list when done
+std::unique_ptr<WorkQueues<int>> full_blocks;
+std::unique_ptr<WorkQueues<int>> free_blocks;
+bool from_stdin = false;
+std::atomic_int readers_left(0);
+
+// One reader's current block
+template <class Policy>
+class BlockFiller
+{
+public:
+	BlockFiller() { free_blocks->pop(0, b); }
+
+	// Read fdesc to the end.  Returns false if a read failed.
+	bool read_all(int fdesc)
+	{
+		while (true)
+		{
+			if (len == room())
+			{
+				hand_off(false);
+			}
+			// A pipe hands us at most 64 KB per read(), so we just keep going until the block is full
+			ssize_t got = read(fdesc, text_blocks[b].data.data() + len, room() - len);
+			if (got == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if (got <= 0)
+			{
+				return got == 0;
+			}
+			len += got;
+		}
+	}
+
+	// Copy in data we already have, such as a decompressed file from an archive
+	void append(const char *data, size_t n)
+	{
+		while (n > 0)
+		{
+			if (len == room())
+			{
+				hand_off(false);
+			}
+			size_t m = std::min(n, room() - len);
+			memcpy(text_blocks[b].data.data() + len, data, m);
+			len += m;
+			data += m;
+			n -= m;
+		}
+	}
+
+	// Between two files
+	void end_file()
+	{
+		if (len == room())
+		{
+			hand_off(false);
+		}
+		text_blocks[b].data[len++] = '\n';
+		separators++;
+	}
+
+	// Hand off whatever is left, all of it
+	void finish() { hand_off(true); }
+
+private:
+	size_t room() const { return text_blocks[b].data.size(); }
+
+	// Cut at the last delimiter, unless this is the end.  A full block with no delimiter in it at all is the start of a single word, so
+	// rather than cut that word in two, we make the block bigger and carry on filling it.
+	void hand_off(bool last)
+	{
+		std::vector<char> &data = text_blocks[b].data;
+		size_t cut = len;
+		if (!last)
+		{
+			while (cut > 0 && tokenizer::is_token<Policy>(data[cut - 1]))
+			{
+				cut--;
+			}
+			if (cut == 0)
+			{
+				data.resize(2 * data.size());
+				return;
+			}
+		}
+		int next = -1;
+		if (!last)
+		{
+			free_blocks->pop(0, next);
+			// A block that grew for a long word gets its usual size back, unless what we carry needs more than that
+			std::vector<char> &carry = text_blocks[next].data;
+			size_t want = std::max(TEXT_BLOCK, 2 * (len - cut));
+			if (carry.size() > want || carry.size() <= len - cut)
+			{
+				carry = std::vector<char>(want);
+			}
+			memcpy(carry.data(), data.data() + cut, len - cut);
+		}
+		// The carried part is the end of a word, so all the newlines we added are in the part we hand off
+		text_blocks[b].len = cut;
+		text_blocks[b].bytes = cut - separators;
+		if (cut > 0)
+		{
+			full_blocks->push(b);
+		}
+		else
+		{
+			free_blocks->push(b);
+		}
+		len -= cut;
+		separators = 0;
+		b = next;
+	}
+
+	int b;
+	size_t len = 0;
+	size_t separators = 0;
+};
+
+// The last reader to finish tells the wcounter threads there are no more blocks coming
+void reader_done()
+{
+	if (--readers_left == 0)
+	{
+		full_blocks->close();
+	}
+}
+
+template <class Policy>
+void stdin_reader()
+{
+	stats::Stopwatch sw;
+	BlockFiller<Policy> filler;
+	if (!filler.read_all(STDIN_FILENO))
+	{
+		printf("Unable to read stdin (errno %d)\n", errno);
+	}
+	filler.finish();
+	expected_file_count++;
+	file_count++;
+	discover_time.wall_ns = sw.elapsed().wall_ns;
+	reader_done();
+}
+
+// With a tarball (.tar, .tar.gz, .tar.zst) in place of the directory, the files come out of the decompressor and go straight into the
+// blocks, as stdin does, and nothing is ever unpacked to disk.  The entries' names go through the same -e filter as a directory walk.
+const char *archive_path = nullptr;
+
+template <class Policy>
+void archive_reader()
+{
+	stats::Stopwatch sw;
+	BlockFiller<Policy> filler;
+	try
+	{
+		archive::read_files(archive_path, extension_filter, io_threads, [&filler](const char *data, size_t len) {
+			if (len > 0)
+			{
+				filler.append(data, len);
+				return;
+			}
+			filler.end_file();
+			expected_file_count++;
+			file_count++;
+		});
+	}
+	catch (const std::exception &e)
+	{
+		// What we have counted so far still gets reported, but it can't be mistaken for a complete count
+		printf("Unable to read archive %s: %s\n", archive_path, e.what());
+		expected_file_count++;
+	}
+	filler.finish();
+	if (!silent)
+	{
+		printf("In %s found %d files to scan\n", archive_path, expected_file_count.load());
+	}
+	discover_time.wall_ns = sw.elapsed().wall_ns;
+	reader_done();
+}
+
+// A --prefetch I/O thread.  It takes opened files from the same queues the wcounter threads would, the fopener having already asked the
+// kernel to start reading them (see open_and_queue).
+template <class Policy>
+void prefetcher(int i)
+{
+	BlockFiller<Policy> filler;
+	WorkItem item;
+	while (work_queues->pop(i % nthreads, item))
+	{
+		file_count++;
+		if (!filler.read_all(item.fdesc))
+		{
+			printf("Unable to read file: fdesc %d errno %d\n", item.fdesc, errno);
+		}
+		filler.end_file();
+		if (close(item.fdesc) == -1)
+		{
+			printf("Unable to close file: fdesc %d errno %d\n", item.fdesc, errno);
+		}
+		fcount.release();
+	}
+	filler.finish();
+	reader_done();
+}
+
+template <class Policy>
+void scan_blocks(int n)
+{
+	counting[n] = &sub_count[n];
+	int b;
+	while (full_blocks->pop(n, b))
+	{
+		const char *data = text_blocks[b].data.data();
+		size_t len = text_blocks[b].len;
+		size_t tail = tokenizer::scan_hashed<Policy>(data, len, [&](size_t start, size_t stop, uint64_t hash) { found(n, data + start, stop - start, hash); });
+		// Only the last block can end in a word
+		if (tail < len)
+		{
+			found(n, data + tail, len - tail);
+		}
+		thread_stats[n].blocks++;
+		thread_stats[n].bytes += text_blocks[b].bytes;
+		free_blocks->push(b);
+		maybe_spill(n);
+	}
+}
+
+// This method is the "core" of the program.  It reads block by block through one file at a time, finding the words in the file and calling found
+// The design is intended by as fast as feasible.
+//
+// It is a template over the token policy (see tokenizer.hpp), and so is everything it calls that looks at bytes.  Each policy gets its
+// own copy of the whole scanning path, compiled with that policy's tables as constants; main() picks which copy the threads run.
+template <class Policy>
+void wcounter(int n)
+{
+	// With --perf-counters each thread opens its own counter group, since a group only counts the thread that opened it
+	std::unique_ptr<perf::Group> counters;
+	if (perf_counters)
+	{
+		counters = std::make_unique<perf::Group>();
+		counters->start();
+	}
+	if (!worker_cpus.empty())
+	{
+		affinity::pin_current(worker_cpus[n % worker_cpus.size()]);
+		if (numa_local)
+		{
+			sub_count[n] = WordCount();
+		}
+	}
+	stats::Stopwatch sw;
+	Uring ring;
+	if (!text_blocks.empty())
+	{
+		scan_blocks<Policy>(n);
+	}
+	else if (uring_depth > 0 && ring.init(2 * uring_depth))
+	{
+		scan_uring<Policy>(n, ring);
+	}
+	else
+	{
+		scan_items<Policy>(n);
+	}
+	fold_hot(n);
+	thread_stats[n].scan = sw.elapsed();
+	if (counters)
+	{
+		thread_stats[n].scan_counts = counters->stop();
+	}
+	// With --mem-limit, once anybody has spilled, everybody spills what they have left as well, and the runs are merged at the end
+	// instead.  We can only tell once every thread is done scanning.
+	bool spilling = false;
+	if (mem_limit > 0)
+	{
+		scan_done->arrive_and_wait();
+		spilling = spilled;
+	}
+	if (parallel_merge || spilling)
+	{
+		if (counters)
+		{
+			counters->start();
+		}
+		stats::Stopwatch msw;
+		if (approx_k > 0)
+		{
+			approx_merge(n);
+		}
+		else if (!spilling)
+		{
+			shard_merge(n);
+		}
+		else if (sub_count[n].size() > 0)
+		{
+			spill(n);
+		}
+		thread_stats[n].merge = msw.elapsed();
+		if (counters)
+		{
+			thread_stats[n].merge_counts = counters->stop();
+		}
+	}
+}
+
+// The sorting and the -p merge are in ranking.hpp, shared with the benchmarks and the library side
+using ranking::Ranked;
+using ranking::sort_run;
+std::unique_ptr<ranking::ShardedMerge> sharded;
+
+// The -p merge (see ShardedMerge): split our sub-count up by owner, and once everybody has, total up and sort the shard we own
+void shard_merge(int n)
+{
+	sharded->partition(n, sub_count[n]);
+	scan_done->arrive_and_wait();
+	sharded->reduce(n, top_k);
+}
+
+// With --approx the parallel merge is a tournament instead: in each round, every thread whose number is a multiple of 2 * step folds in
+// the summary of the thread step above it, so after log2(nthreads) rounds it has all been merged into summaries[0].  A summary is only
+// K counters, so there is no point sharding anything.  Everyone waits at the barrier before each round, so that nobody merges in a
+// summary that is still being merged into.
+void approx_merge(int n)
+{
+	for (int step = 1; step < nthreads; step *= 2)
+	{
+		scan_done->arrive_and_wait();
+		if (n % (2 * step) == 0 && n + step < nthreads)
+		{
+			summaries[n].merge(summaries[n + step]);
+		}
+	}
 }
 
-// This method is the "core" of the program.  It reads block by block through one file at a time, finding the words in the file and calling found
-// The design is intended by as fast as feasible.
-void wcounter(int n)
+// "fast-wc merge a.bin b.bin ..." combines partial results from --emit-partial runs, printing the usual table, or with -o writing another
+// partial file.  The inputs are streamed through partial::merge, so the memory we need is for the output only: with -o that is one
+// record at a time, and for the table it is one (count, word) pair per distinct word, with the words still living in the mapped inputs.
+int merge_main(int argc, char **argv)
 {
-	char prefix_copy[1024];
-	int fdesc;
-	char *buffer = buffers[n];
-	buffer[BLOCKSIZE] = 0;
-	while (true)
+	const char *out_path = nullptr;
+	while (--argc && **(++argv) == '-')
 	{
+		switch (argv[0][1])
 		{
-			opencount.acquire();
-			std::lock_guard<std::mutex> ltmp(lock);
-			int slot = next_ptr++ % FDESCS;
-			fdesc = fdescs[slot];
-			fdescs[slot] = 0;
-			file_count++;
-		}
-		if (fdesc == -2)
-		{
-			int bit = 1;
-			--file_count;
-			fcount.release();
-			if (parallel_merge)
+		case 't':
+			top_k = std::max(0, atoi(*argv + 2));
+			break;
+		case 'o':
+			if (argc > 1)
 			{
-				// 1 and 3 finish.
-				// Now 0 will merge with counts from 1, 2 will merge with counts from 3, ...
-				// Then 2 and 6 finish.
-				// Now 0 will merge with 2, 4 will merge with 6, ...
-				for (int partner = 1; n + partner < nthreads; partner <<= 1)
-				{
-					// Check to see if this thread should drop out
-					if ((n & bit) != 0)
-					{
-						ready_for_merge[n]->release();
-						return;
-					}
-					ready_for_merge[n + partner]->acquire();
-					bit <<= 1;
-					for (auto wc : sub_count[n + partner])
-					{
-						sub_count[n][wc.first] += wc.second;
-					}
-				}
+				out_path = *++argv;
+				--argc;
+				break;
 			}
-			ready_for_merge[n]->release();
-			return;
+			[[fallthrough]];
+		default:
+			printf("Usage: fast-wc merge [-o FILE] [-t#] partial...\n");
+			return 1;
 		}
-		int nbytes;
-		char *prefix = nullptr;
-		int sptr = -1;
-		// Most of the "user time" of the program is spent in this loop
-		while ((nbytes = read(fdesc, buffer, BLOCKSIZE)) > 0)
-		{
-			int cptr = 0;
-			int bef = blocks_scanned;
-			++blocks_scanned;
-			int aft = blocks_scanned;
-			buffer[nbytes] = 0;
-			bytes_scanned += nbytes;
-			while (cptr < nbytes)
-			{
-				// The pre-initialized array "token_chars" is the fastest way I could think of to check whether a character is in a-zA-Z0-9_
-				// Obviously it can be done with a macro like "isalnum", but that macro involves if statements, and anyhow wouldn't include _
-				// So I created a vector and each byte in it is true (included) or false (not included), using 1 for true and 0 for false.
-				// This is read only, so even though multiple threads share it, they won't suffer a performance issue: it will quickly be in
-				// every L2 cache and we'll get as good speed as if each had a local private copy!  I didn't use a vector of bits because
-				// array index would have been more complicated if I had done so (more machine instructions... hence higher cost)
-				if (token_chars[0xFF & (unsigned)buffer[cptr]] == 1)
-				{
-					if (sptr == -1)
-					{
-						// Found start of a new word
-						sptr = cptr;
-					}
-				}
-				else
-				{
-					// Because we will treat the buffer as if it contained a null-terminated C string, we need to null-terminate it!
-					buffer[cptr] = 0;
-					// We get here if we found a word but we need to check to see if it split over two file buffer reads, in which case
-					// we would need to combine the two parts.
-					found_something(n, buffer, prefix, sptr);
-					sptr = -1;
-				}
-				cptr++;
-			}
-			// This next test and code block are to make a copy of a word at the end of a buffer, for that split case
-			if (cptr == nbytes && sptr != -1)
+	}
+	if (argc == 0)
+	{
+		printf("No partial results specified.\n");
+		return 1;
+	}
+	std::vector<partial::Reader> inputs;
+	char **names = argv;
+	for (; argc > 0; argc--, argv++)
+	{
+		inputs.emplace_back(*argv);
+		if (!inputs.back().ok())
+		{
+			printf("Not a partial result file: %s\n", *argv);
+			return 1;
+		}
+	}
+	// A damaged input is an error, not a smaller count, since totals with part of a file missing from them look just like real ones
+	auto damaged = [&inputs, names] {
+		for (size_t i = 0; i < inputs.size(); i++)
+		{
+			if (inputs[i].damaged())
 			{
-				int len = nbytes - sptr;
-				prefix = prefix_copy;
-				memcpy(prefix, buffer + sptr, len);
-				prefix[len] = 0;
-				sptr = -1;
+				fprintf(stderr, "Damaged or truncated partial result file: %s\n", names[i]);
 			}
 		}
-		// This turned out to be unexpected: a surprising number of Linux .h and .c files "end" without a final newline character. They just end "in" a word, and
-		// So we have to duplicate our logic to handle that.
-		found_something(n, buffer, prefix, sptr);
-		fcount.release();
-		if (close(fdesc) == -1)
+		return 1;
+	};
+	if (out_path != nullptr)
+	{
+		partial::Writer out(out_path);
+		bool ok = partial::merge(inputs, [&out](std::string_view word, uint64_t count) { out.add(word, count); });
+		if (!out.finish())
 		{
-			printf("Unable to close file: fdesc %d errno %d\n", fdesc, errno);
+			printf("Unable to write %s (errno %d)\n", out_path, errno);
+			return 1;
 		}
+		return ok ? 0 : damaged();
+	}
+	std::vector<Ranked> ranked;
+	bool ok = partial::merge(inputs, [&ranked](std::string_view word, uint64_t count) {
+		// The table has room for an int, which a single word could in principle outgrow once enough partials are added up
+		ranked.emplace_back((int)std::min<uint64_t>(count, INT_MAX), word);
+	});
+	if (!ok)
+	{
+		return damaged();
+	}
+	sort_run(ranked, top_k);
+	if (!output::write_counts(STDOUT_FILENO, ranked, std::max(1u, std::thread::hardware_concurrency())))
+	{
+		fprintf(stderr, "Unable to write the counts (errno %d)\n", errno);
+		return 1;
 	}
+	return 0;
 }
 
-// Notice how the buffer, which is of type char[], has been changed into a pointer to the buffer for this call.  This is an oddity of the way that
-// C handled arrays that was inherited into C++.  To me, it feels unnatural, but if C++ did the more obvious thing and just let me declare this as
-// a character array "object" by reference, that would break back-compatibility with C.  A shame...
-inline void found_something(int &n, char *&buffer, char *&prefix, int &sptr)
+// "fast-wc query SOCKET top 10" asks a --serve server a question.  The words after the socket make up the request, "all" if there are none.
+int query_main(int argc, char **argv)
 {
-	// There are basically two cases: a word "entirely" in the buffer, or one "split" between the prior buffer and this one.
-	// prefix is null if the word is entirely in the buffer, and we just can call found.  But if prefix is non-null, we
-	// need to call our "split word" version of found to glue them together first.  One strange special case is if the prefix
-	// actually was the full word after all: in that case we had a prefix copy waiting, but the first character of our buffer
-	// wasn't a token-char, hence we can call the non-split case of found (this is cheaper than asking the split version to
-	// make a copy, again, with a suffix that would actually be an empty string.
-	if (prefix != nullptr)
+	if (argc < 2)
 	{
-		if (sptr != -1)
-		{
-			char *sbptr = buffer + sptr;
-			found(n, prefix, sbptr);
-		}
-		else
-		{
-			// Special case: it actually ended on the very last character of the prior buffer!
-			found(n, prefix);
-		}
-		prefix = nullptr;
+		printf("Usage: fast-wc query SOCKET [top K|all|stats|quit]\n");
+		return 1;
 	}
-	else if (sptr != -1)
+	std::string request;
+	for (int i = 2; i < argc; i++)
 	{
-		found(n, buffer + sptr);
+		request += (i > 2 ? " " : "");
+		request += argv[i];
 	}
-	sptr = -1;
+	return serve::query(argv[1], request.empty() ? "all" : request);
 }
 
-struct DefineSortOrder : public std::binary_function<std::pair<int, std::string>, std::pair<int, std::string>, bool>
+// With --serve, the first count is all we do here; after that the work is in answering questions.  Only the -n, -e, -k and -s options
+// mean anything to the server.
+int serve_main(const char *dir, serve::Scanner scan)
 {
-	// In C++ this is one of the ways to define a non-standard sort order,  Given two objects that both have a (count, word) pair,
-	// if the counts differ, put the bigger count first (so bigger counts print out first).  But for a tie, put the smaller word first,
-	// using the standard alphabetic order.
-	bool operator()(const std::pair<int, std::string> &lhs, const std::pair<int, std::string> &rhs) const
+	serve::Server server(dir, serve::Options{nthreads, extension_filter, scan});
+	try
 	{
-		return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+		server.start();
 	}
-};
-
-// Now we can define a new map sorted in this way.  The new type is called "SortOrder".
-using SortOrder = std::map<std::pair<int, std::string>, std::pair<std::string, int>, DefineSortOrder>;
+	catch (const std::exception &e)
+	{
+		printf("File scanner unable to access folder %s\n", dir);
+		return 1;
+	}
+	if (!silent)
+	{
+		printf("Serving the counts of %zu files in %s on %s\n", server.file_count(), dir, serve_path);
+		fflush(stdout);
+	}
+	return server.run(serve_path) ? 0 : 1;
+}
 
 int main(int argc, char **argv)
 {
-
-	while (--argc && **(++argv) == '-')
+	stats::Stopwatch total_time(CLOCK_PROCESS_CPUTIME_ID);
+	if (argc > 1 && strcmp(argv[1], "merge") == 0)
+	{
+		return merge_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && strcmp(argv[1], "query") == 0)
+	{
+		return query_main(argc - 1, argv + 1);
+	}
+	// A lone "-" isn't an option, it is stdin
+	while (--argc && **(++argv) == '-' && argv[0][1] != '\0')
 	{
 		switch (argv[0][1])
 		{
 		case 'n':
-			nthreads = atoi(*argv + 2);
+			nthreads = std::max(1, atoi(*argv + 2));
 			break;
 		case 'b':
-			nblocks = std::min(atoi(*argv + 2), 127);
+			nblocks = std::clamp(atoi(*argv + 2), 0, 127);
 			break;
 		case 'p':
 			parallel_merge = true;
 			break;
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'd':
+			ndiscovery = std::max(1, atoi(*argv + 2));
+			break;
+		case 'c':
+			chunk_size = (off_t)atoi(*argv + 2) * BASICBLOCK;
+			break;
 		case 's':
 			silent = true;
 			break;
+		case 't':
+			top_k = std::max(0, atoi(*argv + 2));
+			break;
+		case 'u':
+			// -u alone means 4 files in flight per thread
+			uring_depth = argv[0][2] ? std::clamp(atoi(*argv + 2), 1, 32) : 4;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'k':
+			token_set = *argv + 2;
+			break;
+		case 'e':
+			extension_set = *argv + 2;
+			break;
+		case '-':
+			// The long options
+			if (strcmp(*argv, "--json") == 0 && argc > 1)
+			{
+				json_path = *++argv;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--emit-partial") == 0 && argc > 1)
+			{
+				partial_path = *++argv;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--serve") == 0 && argc > 1)
+			{
+				serve_path = *++argv;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--files-from") == 0 && argc > 1)
+			{
+				files_from = *++argv;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--cache") == 0 && argc > 1)
+			{
+				cache_path = *++argv;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--prefetch") == 0 && argc > 1)
+			{
+				prefetch_depth = std::max(1, atoi(*++argv));
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--io-threads") == 0 && argc > 1)
+			{
+				io_threads = std::max(1, atoi(*++argv));
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--approx") == 0 && argc > 1)
+			{
+				approx_k = std::max(1, atoi(*++argv));
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--mem-limit") == 0 && argc > 1)
+			{
+				// A plain number of bytes, or with a K, M or G after it
+				char *unit;
+				mem_limit = strtoull(*++argv, &unit, 10);
+				mem_limit <<= *unit == 'K' ? 10 : *unit == 'M' ? 20 : *unit == 'G' ? 30 : 0;
+				--argc;
+				break;
+			}
+			if (strcmp(*argv, "--perf-counters") == 0)
+			{
+				perf_counters = true;
+				break;
+			}
+			if (strcmp(*argv, "--hot-tokens") == 0)
+			{
+				use_hot = true;
+				break;
+			}
+			if (strcmp(*argv, "--pin") == 0 || strcmp(*argv, "--numa") == 0)
+			{
+				numa_local = numa_local || strcmp(*argv, "--numa") == 0;
+				worker_cpus = affinity::worker_cpus(numa_local);
+				break;
+			}
+			[[fallthrough]];
 		default:
-			printf("Usage: fast-wc [-n#] dir...\n");
+			printf("Usage: fast-wc [-n#] [-b#] [-p] [-m] [-c#] [-d#] [-t#] [-u[#]] [-k(ident|hyphen|utf8)] [-e(c|cpp|rust)] [-s] [-v] [--json FILE] [--perf-counters] [--cache FILE] [--emit-partial FILE] [--mem-limit SIZE] [--approx K] [--prefetch DEPTH] [--io-threads N] [--files-from FILE|-] [--serve SOCKET] [--pin] [--numa] [--hot-tokens] dir...|archive|-\n       fast-wc merge [-o FILE] [-t#] partial...\n       fast-wc query SOCKET [top K|all|stats|quit]\n");
 			return 1;
 		}
 	}
-	if (argc == 0)
+	if (argc == 0 && files_from == nullptr)
 	{
 		printf("No directory specified.\n");
 		return 1;
 	}
-	BLOCKSIZE = nblocks * BASICBLOCK;
+	if (argc > 0 && files_from != nullptr)
+	{
+		printf("--files-from takes the place of a directory, so give one or the other.\n");
+		return 1;
+	}
+	if (approx_k > 0 && partial_path != nullptr)
+	{
+		// Adding up estimates from several runs would quietly add up their errors too
+		printf("--emit-partial needs exact counts, so it can't be used with --approx\n");
+		return 1;
+	}
+	// With no -b, reads are as big as the read buffers (see scan_items and scan_uring), and small files get exact-size reads
+	BLOCKSIZE = nblocks > 0 ? nblocks * BASICBLOCK : scanning::BUFFER_SIZE;
+	void (*counter)(int);
+	void (*reader)();
+	void (*unpacker)();
+	void (*prefetch)(int);
+	serve::Scanner serve_scan;
+	if (strcmp(token_set, tokenizer::Ident::name) == 0)
+	{
+		counter = wcounter<tokenizer::Ident>;
+		reader = stdin_reader<tokenizer::Ident>;
+		unpacker = archive_reader<tokenizer::Ident>;
+		prefetch = prefetcher<tokenizer::Ident>;
+		serve_scan = serve::scan_file<tokenizer::Ident>;
+	}
+	else if (strcmp(token_set, tokenizer::Hyphen::name) == 0)
+	{
+		counter = wcounter<tokenizer::Hyphen>;
+		reader = stdin_reader<tokenizer::Hyphen>;
+		unpacker = archive_reader<tokenizer::Hyphen>;
+		prefetch = prefetcher<tokenizer::Hyphen>;
+		serve_scan = serve::scan_file<tokenizer::Hyphen>;
+	}
+	else if (strcmp(token_set, tokenizer::Utf8::name) == 0)
+	{
+		counter = wcounter<tokenizer::Utf8>;
+		reader = stdin_reader<tokenizer::Utf8>;
+		unpacker = archive_reader<tokenizer::Utf8>;
+		prefetch = prefetcher<tokenizer::Utf8>;
+		serve_scan = serve::scan_file<tokenizer::Utf8>;
+	}
+	else
+	{
+		printf("Unknown token set %s (want ident, hyphen or utf8)\n", token_set);
+		return 1;
+	}
+	if (strcmp(extension_set, utils::CSources::name) == 0)
+	{
+		extension_filter = utils::has_extension<utils::CSources>;
+	}
+	else if (strcmp(extension_set, utils::CppSources::name) == 0)
+	{
+		extension_filter = utils::has_extension<utils::CppSources>;
+	}
+	else if (strcmp(extension_set, utils::RustSources::name) == 0)
+	{
+		extension_filter = utils::has_extension<utils::RustSources>;
+	}
+	else
+	{
+		printf("Unknown extension set %s (want c, cpp or rust)\n", extension_set);
+		return 1;
+	}
+	tokenizer::init();
+	if (serve_path != nullptr)
+	{
+		if (files_from != nullptr || strcmp(*argv, "-") == 0)
+		{
+			printf("--serve watches a directory, so it needs one\n");
+			return 1;
+		}
+		return serve_main(*argv, serve_scan);
+	}
+	from_stdin = files_from == nullptr && strcmp(*argv, "-") == 0;
+	if (files_from == nullptr && !from_stdin && archive::is_archive(*argv))
+	{
+		archive_path = *argv;
+		if (const char *missing = archive::missing_support(archive_path))
+		{
+			printf("Unable to read archive %s: %s support not built in (formats: %s)\n", archive_path, missing, archive::formats());
+			return 1;
+		}
+	}
+	if (cache_path != nullptr)
+	{
+		// stdin has no inode or mtime to key a cache entry on (nor does a file in an archive), so --cache only applies to files on
+		// disk.  It keeps exact counts, too, and needs the counts of each file on their own, which --prefetch mixes together in its
+		// blocks.
+		if (from_stdin || archive_path != nullptr)
+		{
+			printf("--cache keys its entries on each file's inode and mtime, so it can't be used with %s\n", from_stdin ? "stdin" : "an archive");
+			return 1;
+		}
+		if (approx_k > 0)
+		{
+			printf("--cache needs exact counts, so it can't be used with --approx\n");
+			return 1;
+		}
+		if (prefetch_depth > 0)
+		{
+			printf("--cache needs each file's counts on their own, which --prefetch mixes together, so it can't be used with --prefetch\n");
+			return 1;
+		}
+		cache = std::make_unique<CountCache>(cache_path, token_set, nthreads);
+		use_hot = false;
+	}
+	if (uring_depth > 0 && !Uring().init(2))
+	{
+		// No io_uring on this kernel (or it's switched off), so each wcounter thread will fall back to plain reads
+		uring_depth = 0;
+	}
 	if (!silent)
 	{
-		printf("fast-wc with %d cores, %d blocks per read, parallel merge %s\n", nthreads, nblocks, parallel_merge ? "ON" : "OFF");
+		char reads[32];
+		snprintf(reads, sizeof reads, nblocks > 0 ? "%d blocks per read" : "adaptive reads", nblocks);
+		char pinned[64] = "";
+		if (!worker_cpus.empty())
+		{
+			snprintf(pinned, sizeof pinned, ", %s to %zu CPUs on %d nodes", numa_local ? "numa-pinned" : "pinned",
+			         std::min(worker_cpus.size(), (size_t)nthreads), affinity::node_count());
+		}
+		printf("fast-wc with %d cores, %s, parallel merge %s, mmap %s, io_uring %s, %s %s tokenizer%s\n", nthreads, reads,
+		       parallel_merge ? "ON" : "OFF", use_mmap ? "ON" : "OFF", uring_depth > 0 ? "ON" : "OFF", tokenizer::kernel_name(), token_set, pinned);
+	}
+	std::vector<std::thread> my_threads(nthreads);
+	sub_count.resize(nthreads);
+	counting.resize(nthreads);
+	thread_stats.resize(nthreads);
+	spill_paths.resize(nthreads);
+	if (approx_k > 0)
+	{
+		summaries.assign(nthreads, SpaceSaving(approx_k));
+	}
+	hot_counts.resize(nthreads);
+	work_queues = std::make_unique<WorkQueues<WorkItem>>(nthreads, FDESCS);
+	std::thread fot;
+	std::vector<std::thread> io;
+	if (from_stdin || archive_path != nullptr || prefetch_depth > 0)
+	{
+		// The full blocks that can be waiting (by default two per thread, so each one has the next block waiting while it scans), plus
+		// the two each reader fills and carries from
+		readers_left = from_stdin || archive_path != nullptr ? 1 : io_threads;
+		int depth = prefetch_depth > 0 ? prefetch_depth : 2 * nthreads;
+		int nbuffers = depth + 2 * readers_left;
+		text_blocks.resize(nbuffers);
+		// (the rings want a power of two for their capacity)
+		full_blocks = std::make_unique<WorkQueues<int>>(nthreads, std::bit_ceil((size_t)nbuffers));
+		free_blocks = std::make_unique<WorkQueues<int>>(1, std::bit_ceil((size_t)nbuffers));
+		for (int b = 0; b < nbuffers; b++)
+		{
+			text_blocks[b].data.resize(TEXT_BLOCK);
+			free_blocks->push(b);
+		}
+	}
+	if (from_stdin)
+	{
+		fot = std::thread(reader);
+	}
+	else if (archive_path != nullptr)
+	{
+		fot = std::thread(unpacker);
 	}
-	auto str = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-	while (*str)
+	else
 	{
-		token_chars[(int)*str++] = 1;
+		fot = std::thread(fopener, files_from != nullptr ? (char *)files_from : *argv);
+		for (int i = 0; i < (prefetch_depth > 0 ? io_threads : 0); i++)
+		{
+			io.emplace_back(prefetch, i);
+		}
 	}
-	std::thread my_threads[MAXTHREADS];
-	auto fot = std::thread(fopener, *argv);
+	scan_done = std::make_unique<std::barrier<>>(nthreads);
+	sharded = std::make_unique<ranking::ShardedMerge>(nthreads);
 	for (int n = 0; n < nthreads; n++)
 	{
-		ready_for_merge[n] = new std::counting_semaphore<1>(0);
-		my_threads[n] = std::thread(wcounter, n);
+		my_threads[n] = std::thread(counter, n);
 	}
 	// At this point, the file opener is running, opening files, and the n threads are scanning them.  Each one grabs the "next" open
 	// file, reads blocks of bytes into a big char[] array, breaks out the words, then adds them to its own private "sub-count".
-	// When the file opener is done it signals this (using a magic number: -2, which is never a legitimate file descriptor).  The
-	// scanner threads running wcounter ("word counter") then shut down.
+	// When the file opener is done it closes the work queues, and once they are empty the scanner threads running wcounter
+	// ("word counter") shut down.
 	for (int n = 0; n < nthreads; n++)
 	{
 		my_threads[n].join();
 	}
 	fot.join();
+	for (auto &t : io)
+	{
+		t.join();
+	}
+	if (cache && !cache->save())
+	{
+		printf("Unable to write the cache file %s (errno %d)\n", cache_path, errno);
+	}
 
 	
 	if(file_count != expected_file_count) 
@@ -339,50 +1549,306 @@ int main(int argc, char **argv)
 		printf("Expected to scan %d files, but in fact scanned %d!\n", expected_file_count.load(), file_count.load());
 		exit(0);
 	}
+	// Add up the per-thread counters, and the per-thread scan and merge times (see add_parallel)
+	int64_t blocks_scanned = 0, bytes_scanned = 0, items_cached = 0;
+	stats::PhaseTime scan_time{0, 0}, merge_time{0, 0};
+	perf::Counts scan_counts, merge_counts, sort_counts;
+	for (const stats::ThreadStats &t : thread_stats)
+	{
+		scan_counts += t.scan_counts;
+		merge_counts += t.merge_counts;
+		blocks_scanned += t.blocks;
+		items_cached += t.cached;
+		bytes_scanned += t.bytes;
+		stats::add_parallel(scan_time, t.scan);
+		stats::add_parallel(merge_time, t.merge);
+	}
 	if(!silent)
 	{
-		printf("Blocks scanned: %d, bytes %d\n", blocks_scanned.load(), bytes_scanned.load());
-		if(blocks_scanned.load() == 0 || bytes_scanned.load() == 0)
+		printf("Blocks scanned: %lld, bytes %lld\n", (long long)blocks_scanned, (long long)bytes_scanned);
+		// Nothing to scan means nothing to count, unless it all came from the cache
+		if((blocks_scanned == 0 || bytes_scanned == 0) && items_cached == 0)
 			exit(0);
 	}
 
-	SortOrder sorted_totals;
-	if (!parallel_merge)
+	WordCount totals;
+	std::vector<Ranked> sorted_totals;
+	int64_t distinct = 0;
+	stats::PhaseTime sort_time;
+	// The main thread's own counters, for the merge (without -p) and the sort.  parallel_sort's helper threads aren't included.
+	std::unique_ptr<perf::Group> counters;
+	if (perf_counters)
+	{
+		counters = std::make_unique<perf::Group>();
+	}
+	// With --mem-limit the spilled runs are mapped, and the words we sort and print point straight into them
+	std::vector<partial::Reader> runs;
+	// With --approx, how many of the words at the top are certain, and how far off any count can be
+	size_t approx_certain = 0;
+	uint64_t approx_error = 0;
+	if (approx_k > 0)
+	{
+		stats::Stopwatch msw(CLOCK_PROCESS_CPUTIME_ID);
+		if (counters)
+		{
+			counters->start();
+		}
+		// With -p the wcounter threads already merged them (see approx_merge)
+		for (int n = 1; n < nthreads && !parallel_merge; n++)
+		{
+			summaries[0].merge(summaries[n]);
+		}
+		if (counters)
+		{
+			merge_counts += counters->stop();
+			counters->start();
+		}
+		stats::add_sequential(merge_time, msw.elapsed());
+		stats::Stopwatch sw(CLOCK_PROCESS_CPUTIME_ID);
+		const SpaceSaving &summary = summaries[0];
+		std::vector<const SpaceSaving::Counter *> order;
+		for (const SpaceSaving::Counter &c : summary.entries())
+		{
+			order.push_back(&c);
+		}
+		std::sort(order.begin(), order.end(), [](const SpaceSaving::Counter *a, const SpaceSaving::Counter *b) {
+			return ranking::sorts_before(a->count, a->word, b->count, b->word);
+		});
+		// The first j words are certainly the j most common if even the smallest of their lower bounds (count - error) is at least the
+		// count of the next word, which is as often as any word after them could possibly have occurred
+		uint64_t lowest = UINT64_MAX;
+		for (size_t j = 0; j < order.size(); j++)
+		{
+			uint64_t next = j + 1 < order.size() ? order[j + 1]->count : summary.min_count();
+			lowest = std::min(lowest, order[j]->count - order[j]->error);
+			approx_certain = lowest >= next ? j + 1 : approx_certain;
+			approx_error = std::max(approx_error, order[j]->error);
+		}
+		for (const SpaceSaving::Counter *c : order)
+		{
+			sorted_totals.emplace_back((int)std::min<uint64_t>(c->count, INT_MAX), c->word);
+		}
+		distinct = sorted_totals.size();
+		if (top_k > 0 && top_k < sorted_totals.size())
+		{
+			sorted_totals.resize(top_k);
+		}
+		if (counters)
+		{
+			sort_counts = counters->stop();
+		}
+		sort_time = sw.elapsed();
+	}
+	else if (spilled)
+	{
+		for (auto &paths : spill_paths)
+		{
+			for (const std::string &path : paths)
+			{
+				runs.emplace_back(path.c_str());
+				// The mapping keeps the file around for as long as we need it, and it goes away by itself when we exit
+				unlink(path.c_str());
+				if (!runs.back().ok())
+				{
+					printf("Unable to read back the spill file %s\n", path.c_str());
+					return 1;
+				}
+			}
+		}
+		std::unique_ptr<partial::Writer> out;
+		if (partial_path != nullptr)
+		{
+			out = std::make_unique<partial::Writer>(partial_path);
+		}
+		stats::Stopwatch msw(CLOCK_PROCESS_CPUTIME_ID);
+		if (counters)
+		{
+			counters->start();
+		}
+		// With -t we never need more than the top k so far, so the list is cut back down to k whenever it has doubled
+		size_t keep = top_k > 0 ? std::max<size_t>(2 * top_k, 4096) : SIZE_MAX;
+		bool runs_ok = partial::merge(runs, [&](std::string_view word, uint64_t count) {
+			if (out)
+			{
+				out->add(word, count);
+			}
+			distinct++;
+			sorted_totals.emplace_back((int)std::min<uint64_t>(count, INT_MAX), word);
+			if (sorted_totals.size() >= keep)
+			{
+				sort_run(sorted_totals, top_k);
+			}
+		});
+		if (counters)
+		{
+			merge_counts += counters->stop();
+			counters->start();
+		}
+		stats::add_sequential(merge_time, msw.elapsed());
+		if (!runs_ok)
+		{
+			// We wrote the spills ourselves, so this is a full disk or the like, and the counts would be short
+			printf("A spill file was damaged or cut short on its way back, so the counts would be incomplete\n");
+			return 1;
+		}
+		if (out && !out->finish())
+		{
+			printf("Unable to write %s (errno %d)\n", partial_path, errno);
+			return 1;
+		}
+		stats::Stopwatch sw(CLOCK_PROCESS_CPUTIME_ID);
+		sort_run(sorted_totals, top_k);
+		if (counters)
+		{
+			sort_counts = counters->stop();
+		}
+		sort_time = sw.elapsed();
+	}
+	else if (parallel_merge)
+	{
+		distinct = sharded->distinct();
+		// In this case the merge was done in parallel, and each thread sorted its own shard too, so we have only the final k-way merge left
+		stats::Stopwatch sw(CLOCK_PROCESS_CPUTIME_ID);
+		if (counters)
+		{
+			counters->start();
+		}
+		sorted_totals = ranking::merge_runs(sharded->runs());
+		if (top_k > 0 && top_k < sorted_totals.size())
+		{
+			sorted_totals.resize(top_k);
+		}
+		if (counters)
+		{
+			sort_counts = counters->stop();
+		}
+		sort_time = sw.elapsed();
+	}
+	else
 	{
 		// So now all our threads are done, and we total the sub-counts.  In fact it would make some sense to just take one of the
 		// subcounts as our running total, and this would let us scan one less of the sub-count trees.  But I didn't want to make things
 		// more complicated (if I did that, the one we "pick" should ideally be on the same core as the main thread is on, but this
 		// is a tiny bit fancier than we want to be in Lecture 1!), so we actually merge all n counts "into" a new total.
-		WordCount totals;
+		stats::Stopwatch msw(CLOCK_PROCESS_CPUTIME_ID);
+		if (counters)
+		{
+			counters->start();
+		}
 		for (int n = 0; n < nthreads; n++)
 		{
-			for (auto [word, count] : sub_count[n])
+			totals.merge(sub_count[n]);
+		}
+		if (counters)
+		{
+			merge_counts = counters->stop();
+			counters->start();
+		}
+		merge_time = msw.elapsed();
+		distinct = totals.size();
+		// The table isn't in any useful order (it is a hash table, after all).  But we want a fancy sort: first by total count, then
+		// sub-sorted by increasing alphabetic order, which is what DefineSortOrder defines.
+		stats::Stopwatch sw(CLOCK_PROCESS_CPUTIME_ID);
+		sorted_totals = ranking::rank(totals, top_k, nthreads);
+		if (counters)
+		{
+			sort_counts = counters->stop();
+		}
+		sort_time = sw.elapsed();
+	}
+	if (partial_path != nullptr && !spilled)
+	{
+		// The whole count, never just the top k: a word that misses the cut here could still make it once the partials are merged
+		std::vector<std::pair<std::string_view, uint64_t>> words;
+		words.reserve(distinct);
+		auto add = [&words](const WordCount &counts) {
+			for (auto [word, count] : counts)
 			{
-				totals[word] += count;
+				words.emplace_back(word, count);
 			}
+		};
+		if (parallel_merge)
+		{
+			std::for_each(sharded->shards().begin(), sharded->shards().end(), add);
+		}
+		else
+		{
+			add(totals);
 		}
-		// Total will be sorted by a default, namely the alphabetic sort on the keys (the words we found, including any numbers).  But we want
-		// a fancy sort: first by total count, then sub-sorted by increasing alphabetic order.  So we defined a new map that sorts in this
-		// fancy way.  THis sort adds about 3 seconds to total wall-clock elapsed time, on Ken's home computer (almost 20% of the total!)
-		for (auto [word, count] : totals)
+		if (!partial::write(partial_path, words))
 		{
-			sorted_totals[{count, word}] = {word, count};
+			printf("Unable to write %s (errno %d)\n", partial_path, errno);
+			return 1;
 		}
 	}
-	else
+	stats::Stopwatch print_sw(CLOCK_PROCESS_CPUTIME_ID);
+	// Everything printed so far went through stdout's buffer, and has to come out before the counts are written around it
+	fflush(stdout);
+	if (!silent)
 	{
-		// In this case, the merge was done in parallel and we just pull the merged data from thread 0 into the sort order
-		for (auto [word, count] : sub_count[0])
+		// Each line is the word, in a field 32 characters long (or longer, for very long words), then an or-symbol, then the count.
+		// See output.cpp for why this no longer uses printf.
+		if (!output::write_counts(STDOUT_FILENO, sorted_totals, nthreads))
 		{
-			sorted_totals[{count, word}] = {word, count};
+			fprintf(stderr, "Unable to write the counts (errno %d)\n", errno);
+			return 1;
 		}
 	}
-	if (!silent)
+	stats::PhaseTime print_time = print_sw.elapsed();
+	if (approx_k > 0)
+	{
+		// Until the counters run out nothing is ever evicted, and every count is exact
+		const SpaceSaving &summary = summaries[0];
+		fprintf(stderr,
+		        "Approximate counts from %" PRIu64 " words with %zu counters: each count is at most %" PRIu64 " too high, no word that is left "
+		        "out occurs more than %" PRIu64 " times, and the first %zu words are certainly the %zu most common\n",
+		        summary.total(), summary.capacity(), approx_error, summary.min_count() == 0 ? 0 : summary.total() / summary.capacity(), approx_certain,
+		        approx_certain);
+	}
+	if (verbose || json_path != nullptr || perf_counters)
 	{
-		for (auto w : sorted_totals)
+		// With -p, "merge" is the sharded merge in the wcounter threads (which also sorts each shard), and "sort" is just the final
+		// k-way merge of the shards
+		stats::Report report{nthreads, file_count.load(), distinct, total_time.elapsed(),
+		                     {{"discover", discover_time},
+		                      {"open", stats::PhaseTime{open_wall_ns.load(), open_cpu_ns.load()}},
+		                      {"scan", scan_time},
+		                      {"merge", merge_time},
+		                      {"sort", sort_time},
+		                      {"print", print_time}},
+		                     thread_stats,
+		                     {},
+		                     stats::peak_rss_kb()};
+		if (perf_counters)
+		{
+			if (scan_counts.any() || merge_counts.any() || sort_counts.any())
+			{
+				report.counters = {{"scan", scan_counts}, {"merge", merge_counts}, {"sort", sort_counts}};
+			}
+			else
+			{
+				// Not an error: VMs and containers often have no PMU, or perf_event_paranoid forbids it
+				fprintf(stderr, "Performance counters are not available here\n");
+			}
+		}
+		if (verbose)
+		{
+			stats::print_report(stderr, report);
+		}
+		if (!report.counters.empty())
 		{
-			// Print the string part of the key, using a field 32 characters long (or longer, for very long words), then an or-symbol, then the count
-			printf("%32s   | %8d\n", w.second.first.c_str(), w.second.second);
+			stats::print_counters(stderr, report);
+		}
+		if (json_path != nullptr)
+		{
+			FILE *out = fopen(json_path, "w");
+			if (out == nullptr)
+			{
+				printf("Unable to write %s (errno %d)\n", json_path, errno);
+				return 1;
+			}
+			stats::write_json(out, report);
+			fclose(out);
 		}
 	}
 	return 0;
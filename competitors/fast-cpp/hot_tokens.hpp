@@ -0,0 +1,126 @@
+#pragma once
+
+/*
+ * The tokens that make up a big share of all the words in C source, found with a perfect hash and counted in a plain array.
+ */
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include "word_table.hpp"
+
+namespace hot {
+
+// The lists.  As with the extension sets in utils.hpp, a list is a struct with a constexpr array of strings, and everything else is
+// worked out from it at compile time, so trying another list is just a matter of another struct.  This one is the C keywords, the
+// preprocessor's, and the other words that top the counts of the kernel and /usr/include: short names, small numbers, and English.
+struct CTokens
+{
+	static constexpr const char *name = "c";
+	static constexpr std::string_view tokens[] = {
+	    "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum", "extern", "float", "for", "goto",
+	    "if", "inline", "int", "long", "register", "return", "short", "signed", "sizeof", "static", "struct", "switch", "typedef",
+	    "union", "unsigned", "void", "volatile", "while", "define", "include", "ifdef", "ifndef", "endif", "NULL", "size_t", "bool",
+	    "uint8_t", "uint32_t", "int64_t", "0", "1", "2", "i", "j", "k", "n", "x", "s", "b", "p", "a", "h", "the", "to", "of", "is",
+	    "in", "and", "ptr", "len", "size", "data", "value", "type", "name", "this"};
+};
+
+// hash_word, worked out at compile time.  memcpy isn't allowed in a constant expression, so each 8-byte chunk is put together a byte at
+// a time, low byte first, which is what hash_word's memcpy makes of it on a little endian machine.  (On a big endian one the two
+// don't agree, and find() never finds anything.)
+constexpr uint64_t hash_constant(std::string_view w)
+{
+	uint64_t h = hash_start(w.size());
+	size_t i = 0;
+	for (; i + 8 <= w.size(); i += 8)
+	{
+		uint64_t c = 0;
+		for (size_t b = 0; b < 8; b++)
+		{
+			c |= (uint64_t)(unsigned char)w[i + b] << (8 * b);
+		}
+		h = hash_chunk(h, c);
+		h ^= h >> 29;
+	}
+	if (i < w.size())
+	{
+		uint64_t c = 0;
+		for (size_t b = 0; i + b < w.size(); b++)
+		{
+			c |= (uint64_t)(unsigned char)w[i + b] << (8 * b);
+		}
+		h = hash_chunk(h, c);
+	}
+	return hash_finish(h);
+}
+
+template <class Set>
+constexpr size_t count = std::size(Set::tokens);
+
+namespace detail {
+
+// A slot is the top bits of the word's hash times a multiplier.  We try multipliers until one puts every token in a slot of its own,
+// which is what makes the hash "perfect": a lookup is one multiply, one load, and a compare against the one token that could be
+// there, with no probing.  With eight slots per token a random multiplier does that about one time in fifty.
+template <class Set>
+constexpr int BITS = std::bit_width(8 * count<Set> - 1);
+constexpr uint8_t EMPTY = 0xFF;
+
+constexpr size_t slot_of(uint64_t hash, uint64_t multiplier, int bits) { return (hash * multiplier) >> (64 - bits); }
+
+template <class Set>
+struct Layout
+{
+	uint64_t multiplier = 0; // 0 if there isn't one, which can only be for a list with the same token in it twice
+	std::array<uint64_t, count<Set>> hashes{};
+	std::array<uint8_t, (size_t)1 << BITS<Set>> slots{};
+};
+
+template <class Set>
+constexpr Layout<Set> make_layout()
+{
+	Layout<Set> l;
+	for (size_t t = 0; t < count<Set>; t++)
+	{
+		l.hashes[t] = hash_constant(Set::tokens[t]);
+	}
+	uint64_t m = 0x9E3779B97F4A7C15ull;
+	for (int attempt = 0; attempt < 10000 && l.multiplier == 0; attempt++, m += 0xD6E8FEB86659FD94ull)
+	{
+		l.slots.fill(EMPTY);
+		bool clash = false;
+		for (size_t t = 0; t < count<Set> && !clash; t++)
+		{
+			uint8_t &s = l.slots[slot_of(l.hashes[t], m | 1, BITS<Set>)];
+			clash = s != EMPTY;
+			s = t;
+		}
+		l.multiplier = clash ? 0 : m | 1;
+	}
+	return l;
+}
+
+template <class Set>
+constexpr Layout<Set> layout = make_layout<Set>();
+
+} // namespace detail
+
+// The number of the token word is in Set, or -1 if it isn't one of them.  hash is its hash_word.
+template <class Set>
+inline int find(const char *word, size_t len, uint64_t hash)
+{
+	static_assert(count<Set> < detail::EMPTY, "a hot token list has room for 254 tokens");
+	static_assert(detail::layout<Set>.multiplier != 0, "every hot token must be different");
+	constexpr const detail::Layout<Set> &l = detail::layout<Set>;
+	uint8_t t = l.slots[detail::slot_of(hash, l.multiplier, detail::BITS<Set>)];
+	if (t == detail::EMPTY || l.hashes[t] != hash || Set::tokens[t].size() != len || memcmp(Set::tokens[t].data(), word, len) != 0)
+	{
+		return -1;
+	}
+	return t;
+}
+
+} // namespace hot
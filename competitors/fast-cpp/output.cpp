@@ -0,0 +1,141 @@
+#include "output.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace output {
+
+// Below this many lines a single thread formats everything faster than we could start the others
+const size_t PARALLEL_LINES = 64 * 1024;
+
+// Flush each thread's text in slices of about this size, so no one buffer grows to the size of the whole report
+const size_t SLICE = 1024 * 1024;
+
+// Printing one line per word with printf is surprisingly slow when there are millions of words: every call takes the stdout lock and
+// parses the format string all over again, only to produce the same simple layout each time.  So we format the lines ourselves, with
+// memcpy for the word and the padding and a little loop for the digits, into big buffers that go out with one writev() per batch.
+static void format_line(std::vector<char> &out, int count, std::string_view word)
+{
+	size_t pad = word.size() < 32 ? 32 - word.size() : 0;
+	char digits[16];
+	char *d = digits + sizeof(digits);
+	// Counts are never negative, but we format them exactly as %d would anyway
+	unsigned v = count < 0 ? 0u - (unsigned)count : (unsigned)count;
+	do
+	{
+		*--d = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	if (count < 0)
+	{
+		*--d = '-';
+	}
+	size_t ndigits = digits + sizeof(digits) - d;
+	size_t cpad = ndigits < 8 ? 8 - ndigits : 0;
+	size_t at = out.size();
+	out.resize(at + pad + word.size() + 5 + cpad + ndigits + 1);
+	char *p = out.data() + at;
+	memset(p, ' ', pad);
+	p += pad;
+	memcpy(p, word.data(), word.size());
+	p += word.size();
+	memcpy(p, "   | ", 5);
+	p += 5;
+	memset(p, ' ', cpad);
+	p += cpad;
+	memcpy(p, d, ndigits);
+	p[ndigits] = '\n';
+}
+
+// Format lines [begin, end) into slices of roughly SLICE bytes each
+static void format_range(const std::vector<std::pair<int, std::string_view>> &counts, size_t begin, size_t end,
+                         std::vector<std::vector<char>> &slices)
+{
+	slices.emplace_back();
+	slices.back().reserve(SLICE + 1024);
+	for (size_t i = begin; i < end; i++)
+	{
+		if (slices.back().size() >= SLICE)
+		{
+			slices.emplace_back();
+			slices.back().reserve(SLICE + 1024);
+		}
+		format_line(slices.back(), counts[i].first, counts[i].second);
+	}
+}
+
+// writev can write less than we asked for (into a pipe, say), so keep going until every slice is out
+static bool write_all(int fd, std::vector<iovec> &iov)
+{
+	size_t first = 0;
+	while (first < iov.size())
+	{
+		ssize_t n = writev(fd, iov.data() + first, std::min(iov.size() - first, (size_t)IOV_MAX));
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		while (first < iov.size() && (size_t)n >= iov[first].iov_len)
+		{
+			n -= iov[first++].iov_len;
+		}
+		if (n > 0)
+		{
+			iov[first].iov_base = (char *)iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+	return true;
+}
+
+bool write_counts(int fd, const std::vector<std::pair<int, std::string_view>> &counts, int nthreads)
+{
+	// A big report gets cut into one range of lines per thread.  Each thread formats its own range, and since the ranges are in order,
+	// writing out all the slices in order gives exactly the same text as formatting the lines one by one.
+	size_t nparts = counts.size() < PARALLEL_LINES ? 1 : std::max(1, nthreads);
+	size_t per_part = (counts.size() + nparts - 1) / std::max<size_t>(nparts, 1);
+	std::vector<std::vector<std::vector<char>>> parts(nparts);
+	std::vector<std::thread> formatters;
+	for (size_t t = 1; t < nparts; t++)
+	{
+		formatters.emplace_back([&, t] {
+			format_range(counts, std::min(t * per_part, counts.size()), std::min((t + 1) * per_part, counts.size()), parts[t]);
+		});
+	}
+	format_range(counts, 0, std::min(per_part, counts.size()), parts[0]);
+	for (auto &f : formatters)
+	{
+		f.join();
+	}
+	std::vector<iovec> iov;
+	for (auto &part : parts)
+	{
+		for (auto &slice : part)
+		{
+			if (!slice.empty())
+			{
+				iov.push_back(iovec{slice.data(), slice.size()});
+			}
+		}
+	}
+	return write_all(fd, iov);
+}
+
+void format_counts(const std::vector<std::pair<int, std::string_view>> &counts, std::vector<char> &out)
+{
+	for (auto [count, word] : counts)
+	{
+		format_line(out, count, word);
+	}
+}
+
+} // namespace output
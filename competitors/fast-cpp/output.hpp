@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * The final report: one "word | count" line per distinct word, written without stdio.
+ */
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace output {
+
+// Writes each (count, word) as printf("%32.*s   | %8d\n") would, to fd, using up to nthreads threads to do the formatting.  Anything
+// already printed through stdio must be flushed first, since this bypasses stdout's buffer.  Returns false if a write fails.
+bool write_counts(int fd, const std::vector<std::pair<int, std::string_view>> &counts, int nthreads);
+
+// The same lines, appended to out rather than written anywhere, for a caller that sends them at its own pace
+void format_counts(const std::vector<std::pair<int, std::string_view>> &counts, std::vector<char> &out);
+
+} // namespace output
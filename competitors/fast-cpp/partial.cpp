@@ -0,0 +1,171 @@
+#include "partial.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace partial {
+
+static const char MAGIC[8] = {'F', 'W', 'C', 'P', 'A', 'R', 'T', '1'};
+static const size_t HEADER = sizeof(MAGIC) + sizeof(uint64_t);
+
+Writer::Writer(const char *path) : out(fopen(path, "wb"))
+{
+	if (out != nullptr)
+	{
+		// 1 MB of stdio buffer, so the small records turn into a few big writes
+		setvbuf(out, nullptr, _IOFBF, 1 << 20);
+		uint64_t zero = 0;
+		failed = fwrite(MAGIC, sizeof(MAGIC), 1, out) != 1 || fwrite(&zero, sizeof(zero), 1, out) != 1;
+	}
+}
+
+Writer::~Writer()
+{
+	if (out != nullptr)
+	{
+		fclose(out);
+	}
+}
+
+void Writer::add(std::string_view word, uint64_t count)
+{
+	char buf[32];
+	size_t n = 0;
+	auto put = [&](uint64_t v) {
+		while (v >= 0x80)
+		{
+			buf[n++] = (char)(v | 0x80);
+			v >>= 7;
+		}
+		buf[n++] = (char)v;
+	};
+	put(word.size());
+	failed = failed || fwrite(buf, 1, n, out) != n || fwrite(word.data(), 1, word.size(), out) != word.size();
+	n = 0;
+	put(count);
+	failed = failed || fwrite(buf, 1, n, out) != n;
+	nwords++;
+}
+
+bool Writer::finish()
+{
+	if (out == nullptr)
+	{
+		return false;
+	}
+	bool ok = !failed && fseek(out, sizeof(MAGIC), SEEK_SET) == 0 && fwrite(&nwords, sizeof(nwords), 1, out) == 1;
+	ok = (fclose(out) == 0) && ok;
+	out = nullptr;
+	return ok;
+}
+
+bool write(const char *path, std::vector<std::pair<std::string_view, uint64_t>> &words)
+{
+	std::sort(words.begin(), words.end());
+	Writer w(path);
+	if (!w.ok())
+	{
+		return false;
+	}
+	for (const auto &[word, count] : words)
+	{
+		w.add(word, count);
+	}
+	return w.finish();
+}
+
+Reader::Reader(const char *path)
+{
+	int fdesc = open(path, O_RDONLY | O_CLOEXEC);
+	if (fdesc == -1)
+	{
+		return;
+	}
+	struct stat sb;
+	if (fstat(fdesc, &sb) == 0 && (size_t)sb.st_size >= HEADER)
+	{
+		void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fdesc, 0);
+		if (map != MAP_FAILED)
+		{
+			// We only ever go forward through the file
+			madvise(map, sb.st_size, MADV_SEQUENTIAL);
+			data = (const char *)map;
+			len = sb.st_size;
+		}
+	}
+	close(fdesc);
+	if (data != nullptr && memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		munmap((void *)data, len);
+		data = nullptr;
+	}
+	if (data != nullptr)
+	{
+		memcpy(&nwords, data + sizeof(MAGIC), sizeof(nwords));
+		pos = HEADER;
+	}
+}
+
+Reader::Reader(Reader &&other) noexcept
+    : data(other.data), len(other.len), pos(other.pos), nwords(other.nwords), nread(other.nread), bad(other.bad)
+{
+	other.data = nullptr;
+}
+
+Reader::~Reader()
+{
+	if (data != nullptr)
+	{
+		munmap((void *)data, len);
+	}
+}
+
+bool Reader::varint(uint64_t &v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64 && pos < len; shift += 7)
+	{
+		uint8_t b = data[pos++];
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if ((b & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Reader::next(std::string_view &word, uint64_t &count)
+{
+	if (data == nullptr || bad)
+	{
+		return false;
+	}
+	// The header's word count is where a good file ends, and it has to end right there
+	if (nread == nwords)
+	{
+		bad = pos != len;
+		return false;
+	}
+	uint64_t wlen;
+	if (!varint(wlen) || wlen > len - pos)
+	{
+		bad = true;
+		return false;
+	}
+	word = std::string_view(data + pos, wlen);
+	pos += wlen;
+	if (!varint(count))
+	{
+		bad = true;
+		return false;
+	}
+	nread++;
+	return true;
+}
+
+} // namespace partial
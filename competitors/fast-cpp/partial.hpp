@@ -0,0 +1,130 @@
+#pragma once
+
+/*
+ * Partial results (--emit-partial, and "fast-wc merge"): word counts in a compact binary file, so that the counts from several
+ * machines can be combined without parsing the text table.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace partial {
+
+// The layout is a small header followed by one record per word, in byte order of the words:
+//
+//   "FWCPART1", then the number of words as a little endian uint64
+//   per word: varint length, the characters, varint count
+//
+// A varint is the usual LEB128: 7 bits per byte, low bits first, with the top bit set on every byte but the last.  Most words are
+// short and most counts are small, so nearly every record is just the word plus two bytes.  Because the words are sorted, any number
+// of these files can be merged in one streaming pass, and a reader can walk a file in place through mmap without unpacking it.
+
+// Writes the records one at a time, so the caller never needs to hold the whole output.  Words must arrive in sorted order.
+class Writer
+{
+public:
+	explicit Writer(const char *path);
+	~Writer();
+	Writer(const Writer &) = delete;
+	Writer &operator=(const Writer &) = delete;
+
+	bool ok() const { return out != nullptr; }
+	void add(std::string_view word, uint64_t count);
+
+	// Fill in the word count in the header and close the file.  Returns false if anything went wrong along the way.
+	bool finish();
+
+private:
+	FILE *out = nullptr;
+	uint64_t nwords = 0;
+	bool failed = false;
+};
+
+// Sort (word, count) pairs by word and write them out
+bool write(const char *path, std::vector<std::pair<std::string_view, uint64_t>> &words);
+
+// Walks one file in place
+class Reader
+{
+public:
+	explicit Reader(const char *path);
+	~Reader();
+	Reader(Reader &&other) noexcept;
+	Reader(const Reader &) = delete;
+	Reader &operator=(const Reader &) = delete;
+
+	// False if the file couldn't be opened or isn't a partial result file
+	bool ok() const { return data != nullptr; }
+	uint64_t size() const { return nwords; }
+
+	// The next record, or false at the end (or at a damaged record).  The word points into the mapping, so it stays valid for as
+	// long as this Reader does.
+	bool next(std::string_view &word, uint64_t &count);
+	// Whether next() stopped short of the end it promised: a record cut off or overrunning the file, fewer records than the header
+	// says there are, or bytes left over after the last of them
+	bool damaged() const { return bad; }
+
+private:
+	bool varint(uint64_t &v);
+	const char *data = nullptr;
+	size_t len = 0;
+	size_t pos = 0;
+	uint64_t nwords = 0;
+	uint64_t nread = 0;
+	bool bad = false;
+};
+
+// Merge sorted partial files into one sorted stream, calling on_word(word, total) once per distinct word.  This keeps only one
+// record per input in hand at a time, so memory doesn't grow with the inputs at all: a heap holds the current head of each file, and
+// equal words from different files meet at the top of it and get added up.
+//
+// Returns false if any input turned out to be damaged (see Reader::damaged, which says which), in which case the totals are only
+// those of what could be read, and must not be taken for the real ones.
+template <class OnWord>
+bool merge(std::vector<Reader> &inputs, OnWord &&on_word)
+{
+	struct Head
+	{
+		std::string_view word;
+		uint64_t count;
+		size_t input;
+	};
+	// std::*_heap keeps the largest element on top, so "later" words compare as smaller
+	auto later = [](const Head &a, const Head &b) { return a.word > b.word; };
+	std::vector<Head> heads;
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		Head h{{}, 0, i};
+		if (inputs[i].next(h.word, h.count))
+		{
+			heads.push_back(h);
+		}
+	}
+	std::make_heap(heads.begin(), heads.end(), later);
+	while (!heads.empty())
+	{
+		std::string_view word = heads.front().word;
+		uint64_t total = 0;
+		while (!heads.empty() && heads.front().word == word)
+		{
+			std::pop_heap(heads.begin(), heads.end(), later);
+			Head &h = heads.back();
+			total += h.count;
+			if (inputs[h.input].next(h.word, h.count))
+			{
+				std::push_heap(heads.begin(), heads.end(), later);
+			}
+			else
+			{
+				heads.pop_back();
+			}
+		}
+		on_word(word, total);
+	}
+	return std::none_of(inputs.begin(), inputs.end(), [](const Reader &r) { return r.damaged(); });
+}
+
+} // namespace partial
@@ -0,0 +1,103 @@
+#include "perf.hpp"
+
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf {
+
+struct EventSpec
+{
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+static const EventSpec specs[NEVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+const char *event_name(int e)
+{
+	return specs[e].name;
+}
+
+Group::Group()
+{
+	for (int e = 0; e < NEVENTS; e++)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = specs[e].type;
+		attr.config = specs[e].config;
+		attr.disabled = leader == -1; // the members follow the leader
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		// pid 0 and cpu -1 mean "this thread, on whichever CPU it runs"
+		fds[e] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+		if (fds[e] < 0)
+		{
+			fds[e] = -1;
+		}
+		else if (leader == -1)
+		{
+			leader = fds[e];
+		}
+	}
+}
+
+Group::~Group()
+{
+	for (int e = 0; e < NEVENTS; e++)
+	{
+		if (fds[e] != -1)
+		{
+			close(fds[e]);
+		}
+	}
+}
+
+void Group::start()
+{
+	if (ok())
+	{
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+Counts Group::stop()
+{
+	Counts counts;
+	if (!ok())
+	{
+		return counts;
+	}
+	ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	// With PERF_FORMAT_GROUP the kernel hands back the number of events, then one value per event in the order they joined the group
+	uint64_t buf[1 + NEVENTS];
+	if (read(leader, buf, sizeof(buf)) <= 0)
+	{
+		return counts;
+	}
+	uint64_t i = 0;
+	for (int e = 0; e < NEVENTS && i < buf[0]; e++)
+	{
+		if (fds[e] != -1)
+		{
+			counts.value[e] = buf[1 + i++];
+			counts.valid[e] = true;
+		}
+	}
+	return counts;
+}
+
+} // namespace perf
@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+ * Hardware performance counters for --perf-counters, read straight from the kernel with perf_event_open.
+ */
+#include <cstdint>
+
+namespace perf {
+
+enum Event
+{
+	CYCLES,
+	INSTRUCTIONS,
+	BRANCH_MISSES,
+	LLC_MISSES,
+	PAGE_FAULTS,
+	NEVENTS
+};
+
+const char *event_name(int e);
+
+// One reading of every counter.  A counter the kernel wouldn't give us (no PMU in a VM, say, or perf_event_paranoid set too high) is
+// marked invalid rather than reported as zero.
+struct Counts
+{
+	int64_t value[NEVENTS] = {};
+	bool valid[NEVENTS] = {};
+
+	Counts &operator+=(const Counts &o)
+	{
+		for (int e = 0; e < NEVENTS; e++)
+		{
+			value[e] += o.value[e];
+			valid[e] = valid[e] || o.valid[e];
+		}
+		return *this;
+	}
+	bool any() const
+	{
+		for (int e = 0; e < NEVENTS; e++)
+		{
+			if (valid[e])
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// A group of counters for the calling thread.  The kernel schedules the events of a group onto the PMU together, so cycles and
+// instructions are always counted over exactly the same stretch of code, and one read() returns all of them.  We only count user
+// space, which is all that perf_event_paranoid = 2 (the usual default) allows an unprivileged process to see.
+//
+// Every event that fails to open is simply left out, so on a machine with no counters at all this quietly measures nothing.
+class Group
+{
+public:
+	Group();
+	~Group();
+	Group(const Group &) = delete;
+	Group &operator=(const Group &) = delete;
+
+	bool ok() const { return leader != -1; }
+
+	// Zero the counters and start counting
+	void start();
+
+	// Stop counting and return what was counted since start()
+	Counts stop();
+
+private:
+	int leader = -1;
+	int fds[NEVENTS];
+};
+
+} // namespace perf
@@ -0,0 +1,166 @@
+#include "ranking.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace ranking {
+
+namespace {
+
+// job(0) .. job(nthreads - 1), through run if there is one, otherwise on threads started just for this
+void run_each(int nthreads, const RunEach &run, const std::function<void(int)> &job)
+{
+	if (run)
+	{
+		run(job);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (int n = 0; n < nthreads; n++)
+	{
+		threads.emplace_back(job, n);
+	}
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+}
+
+} // namespace
+
+void sort_run(std::vector<Ranked> &run, size_t k)
+{
+	if (k > 0 && k < run.size())
+	{
+		std::partial_sort(run.begin(), run.begin() + k, run.end(), DefineSortOrder());
+		run.resize(k);
+	}
+	else
+	{
+		std::sort(run.begin(), run.end(), DefineSortOrder());
+	}
+}
+
+// We used to sort by inserting everything into a std::map ordered by DefineSortOrder, which was almost 20% of the total run time, all
+// of it on one core.  Now we sort in two steps instead: each thread sorts its own "run" of (count, word) pairs, all in parallel, and
+// then a k-way merge stitches those sorted runs into one.  The merge keeps a small heap holding the head of each run, so each output
+// element costs O(log k) for k runs.
+void sort_runs(std::vector<std::vector<Ranked>> &runs, const RunEach &run)
+{
+	run_each(runs.size(), run, [&runs](int n) { sort_run(runs[n], 0); });
+}
+
+std::vector<Ranked> merge_runs(const std::vector<std::vector<Ranked>> &runs)
+{
+	size_t total = 0;
+	// (run, position in run), ordered so that the heap's top is the run whose head sorts first
+	std::vector<std::pair<size_t, size_t>> heads;
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		total += runs[r].size();
+		if (!runs[r].empty())
+		{
+			heads.emplace_back(r, 0);
+		}
+	}
+	auto later = [&runs](const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b) {
+		return DefineSortOrder()(runs[b.first][b.second], runs[a.first][a.second]);
+	};
+	std::make_heap(heads.begin(), heads.end(), later);
+	std::vector<Ranked> sorted;
+	sorted.reserve(total);
+	while (!heads.empty())
+	{
+		std::pop_heap(heads.begin(), heads.end(), later);
+		auto &head = heads.back();
+		sorted.push_back(runs[head.first][head.second]);
+		if (++head.second < runs[head.first].size())
+		{
+			std::push_heap(heads.begin(), heads.end(), later);
+		}
+		else
+		{
+			heads.pop_back();
+		}
+	}
+	return sorted;
+}
+
+// Cut the table's slots into nthreads equal ranges, and turn each range into one run
+std::vector<Ranked> parallel_sort(const WordTable &counts, int nthreads, const RunEach &run)
+{
+	std::vector<std::vector<Ranked>> runs(nthreads);
+	size_t per_run = (counts.capacity() + nthreads - 1) / nthreads;
+	run_each(nthreads, run, [&](int n) {
+		auto end = counts.begin_at((n + 1) * per_run);
+		for (auto it = counts.begin_at(n * per_run); it != end; ++it)
+		{
+			runs[n].emplace_back((*it).second, (*it).first);
+		}
+	});
+	sort_runs(runs, run);
+	return merge_runs(runs);
+}
+
+// With -t we only want the k most common words.  Sorting everything for that would be a waste: the whole vocabulary gets sorted, only
+// to throw nearly all of it away.  Instead we make a flat array of (count, word) pairs that point into the table, and partial_sort pulls
+// out just the top k in order, which costs O(n log k) rather than O(n log n).
+std::vector<Ranked> top_k_sort(const WordTable &counts, size_t k)
+{
+	std::vector<Ranked> ranked;
+	ranked.reserve(counts.size());
+	for (auto [word, count] : counts)
+	{
+		ranked.emplace_back(count, word);
+	}
+	sort_run(ranked, k);
+	return ranked;
+}
+
+ShardedMerge::ShardedMerge(int nshards) : nshards(nshards), partitions(nshards), shard_count(nshards), shard_runs(nshards) {}
+
+void ShardedMerge::partition(int n, const WordTable &counts)
+{
+	auto &mine = partitions[n];
+	mine.assign(nshards, {});
+	for (auto it = counts.begin(); it != counts.end(); ++it)
+	{
+		auto [word, count] = *it;
+		uint64_t hash = it.slot().hash;
+		// The table uses the low bits of the hash as its index, so we pick the shard from the high bits
+		size_t shard = ((hash >> 32) * nshards) >> 32;
+		mine[shard].push_back(Partitioned{hash, word, count});
+	}
+}
+
+void ShardedMerge::reduce(int n, size_t k)
+{
+	WordTable &shard = shard_count[n];
+	for (int from = 0; from < nshards; from++)
+	{
+		for (const Partitioned &p : partitions[from][n])
+		{
+			shard.add_hashed(p.word.data(), p.word.size(), p.hash, p.count);
+		}
+	}
+	auto &run = shard_runs[n];
+	run.clear();
+	run.reserve(shard.size());
+	for (auto [word, count] : shard)
+	{
+		run.emplace_back(count, word);
+	}
+	sort_run(run, k);
+}
+
+size_t ShardedMerge::distinct() const
+{
+	size_t distinct = 0;
+	for (const WordTable &shard : shard_count)
+	{
+		distinct += shard.size();
+	}
+	return distinct;
+}
+
+} // namespace ranking
@@ -0,0 +1,96 @@
+#pragma once
+
+/*
+ * Putting the counts in order: the order fast-wc prints them in, and the sorts and merges that get them there.
+ */
+#include <cstddef>
+#include <functional>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "word_table.hpp"
+
+namespace ranking {
+
+// A (count, word) pair for sorting.  The word still lives in a WordTable's arena (or a mapped file), so we can sort without copying any
+// strings.
+using Ranked = std::pair<int, std::string_view>;
+
+// The one order every list of counts comes out in: if the counts differ, the bigger count first (so bigger counts print out first),
+// but for a tie, the smaller word first, using the standard alphabetic order.  A template, so that counts of any width can use it.
+template <class Count>
+inline bool sorts_before(Count lcount, std::string_view lword, Count rcount, std::string_view rword)
+{
+	return lcount > rcount || (lcount == rcount && lword < rword);
+}
+
+struct DefineSortOrder
+{
+	// In C++ this is one of the ways to define a non-standard sort order, for std::sort and friends
+	bool operator()(const Ranked &lhs, const Ranked &rhs) const { return sorts_before(lhs.first, lhs.second, rhs.first, rhs.second); }
+};
+
+// How the parallel steps below get their threads: run(job) calls job(0) .. job(nthreads - 1) all at once, and returns when they have all
+// returned.  Left empty, a step starts nthreads threads of its own and joins them; a WordCounter hands in its pool instead, so that it
+// doesn't start fresh threads on every results() call.
+using RunEach = std::function<void(const std::function<void(int)> &job)>;
+
+// Sort one run.  For k > 0 only the first k elements are wanted, so the rest are dropped.
+void sort_run(std::vector<Ranked> &run, size_t k);
+
+// Sort every run, each on a thread of its own (with run, there must be one run per thread it runs on)
+void sort_runs(std::vector<std::vector<Ranked>> &runs, const RunEach &run = {});
+
+// Stitch sorted runs together into one sorted list
+std::vector<Ranked> merge_runs(const std::vector<std::vector<Ranked>> &runs);
+
+// Every word in the table, sorted, with nthreads threads doing the work
+std::vector<Ranked> parallel_sort(const WordTable &counts, int nthreads, const RunEach &run = {});
+
+// Just the k most common words in the table, sorted
+std::vector<Ranked> top_k_sort(const WordTable &counts, size_t k);
+
+// The counts as they are printed: the top k (or for k = 0, all of them) in order
+inline std::vector<Ranked> rank(const WordTable &counts, size_t k, int nthreads, const RunEach &run = {})
+{
+	return k > 0 ? top_k_sort(counts, k) : parallel_sort(counts, nthreads, run);
+}
+
+// This is the parallel merge (-p).  Rather than pairing threads up into a tree of merges, where the last round is always one thread
+// folding in half the vocabulary while everybody else waits, every word is given an "owner" thread based on its hash.  Each thread first
+// splits its own sub-count into one partition per owner, then (once every thread has done that) owns one shard and reduces all the
+// partitions belonging to it.  No two shards share a word, so everyone merges at once, and then sorts their shard into one of the runs
+// that merge_runs stitches together.
+//
+// Thread n calls partition(n, its table), waits until every thread has done the same, and then calls reduce(n, k).  The tables have to
+// stay as they are until every reduce() is done, since the partitions point into them.
+class ShardedMerge
+{
+public:
+	explicit ShardedMerge(int nshards);
+
+	void partition(int n, const WordTable &counts);
+	// Total up shard n, and sort it into runs()[n].  For k > 0 only the top k of the shard are kept (the top k overall are all among
+	// the shards' top k).
+	void reduce(int n, size_t k);
+
+	const std::vector<WordTable> &shards() const { return shard_count; }
+	const std::vector<std::vector<Ranked>> &runs() const { return shard_runs; }
+	// The number of different words, over all the shards
+	size_t distinct() const;
+
+private:
+	struct Partitioned
+	{
+		uint64_t hash;
+		std::string_view word;
+		int count;
+	};
+	int nshards;
+	// partitions[from][to]: the words in thread from's table that belong to shard to
+	std::vector<std::vector<std::vector<Partitioned>>> partitions;
+	std::vector<WordTable> shard_count;
+	std::vector<std::vector<Ranked>> shard_runs;
+};
+
+} // namespace ranking
@@ -0,0 +1,241 @@
+#pragma once
+
+/*
+ * Reading files block by block and handing every word in them to a sink: the read() path of fast-wc, and all of WordCounter's reading.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tokenizer.hpp"
+#include "word_table.hpp"
+
+namespace scanning {
+
+// The most files (or chunks of files) that can be open and waiting to be scanned at any one time
+constexpr int FDESCS = 64;
+constexpr int BASICBLOCK = 1024;
+// Each scanning thread's read buffer, which is also the biggest read
+constexpr int BUFFER_SIZE = 128 * BASICBLOCK;
+
+// A sink is anything that can be called as sink(word, len, hash).  This one just counts into a table.
+struct CountInto
+{
+	WordTable *counts;
+	void operator()(const char *word, size_t len, uint64_t hash) const { counts->add_hashed(word, len, hash); }
+};
+
+// A whole text that is already in memory, so no word in it is split: every word goes to the sink, including one the text ends in
+template <class Policy, class Sink>
+void scan_text(const char *text, size_t len, Sink &sink)
+{
+	size_t tail = tokenizer::scan_hashed<Policy>(text, len, [&](size_t start, size_t end, uint64_t hash) { sink(text + start, end - start, hash); });
+	if (tail < len)
+	{
+		sink(text + tail, len - tail, hash_word(text + tail, len - tail));
+	}
+}
+
+// When we are handed a chunk that doesn't start at the beginning of the file, the chunk might start in the middle of a word.  That word
+// belongs to the chunk before ours (which keeps reading past its own end to finish it), so we skip over it.  This returns the offset where
+// our chunk really starts: the first byte at or after begin that isn't the continuation of a word that started before begin.
+template <class Policy>
+off_t skip_split_word(int fdesc, off_t begin, char *buffer)
+{
+	off_t pos = begin - 1;
+	int nbytes;
+	while ((nbytes = pread(fdesc, buffer, BASICBLOCK, pos)) > 0)
+	{
+		for (int i = 0; i < nbytes; i++)
+		{
+			if (!tokenizer::is_token<Policy>(buffer[i]))
+			{
+				return std::max(pos + i, begin);
+			}
+		}
+		pos += nbytes;
+	}
+	return pos;
+}
+
+// The read() based scanner.  It reads block by block through the file, and so it has to deal with words that split across two reads.
+// For a chunk of a file (begin..end) it reads at offsets over that range instead, and then keeps reading past end, a little at a time,
+// until it has finished the word it was in (the next chunk skips that same word, in skip_split_word).  end = -1 means the whole file.
+//
+// The state lives in an object rather than in local variables, because with -u (io_uring) one thread keeps several files in flight at
+// once, each needing its own position and its own split-word prefix.  want() says how much to read next, at offset pos, and returns 0
+// once we are done; consume() scans a block that has been read; finish() hands over a word the file ended in.
+//
+// For a whole file we go by its size.  Most source files are only a few KB, so one read() of exactly that size gets all of it, and then
+// there is no second read() just to be told we are at the end, and no word left over to carry into a block that never comes.  Bigger
+// files get reads of blocksize (at most the BUFFER_SIZE of the buffer), always at multiples of that into the file, with an exact-size
+// read for whatever is left at the end.  It used to be one read size for everything, set by -b, and which -b was best depended on the
+// mix of files; this way the small ones and the big ones each get what suits them.
+template <class Policy, class Sink>
+struct ReadScan
+{
+	Sink sink;
+	int fdesc;
+	off_t end;
+	int blocksize;
+	bool whole_file;
+	off_t pos;
+	// The size of a whole regular file, or -1 if we don't know it (a pipe, say), in which case we read until read() says there is no more
+	off_t size;
+	bool past_end = false;
+	bool done = false;
+	// The start of a word that ran up to the end of the last block, if split is set.  A string, so that it can grow: a word can run on
+	// over any number of blocks (minified code, a long run of digits, or a binary file that slipped through the filter), and we count it
+	// whole however long it is.  It used to be a char[1024], which cut such a word off at 1023 bytes and counted the stump.
+	std::string prefix;
+	bool split = false;
+	// Reads scanned, and bytes of the file (or chunk) covered, for the stats
+	int64_t blocks = 0;
+	int64_t bytes = 0;
+
+	// size is the file's size if the caller already knows it, otherwise -1.  buffer is only used here to skip a split word.
+	ReadScan(Sink sink, int fdesc, off_t begin, off_t end, off_t known_size, int blocksize, char *buffer)
+	    : sink(sink), fdesc(fdesc), end(end), blocksize(blocksize), whole_file(end == -1),
+	      pos((begin > 0) ? skip_split_word<Policy>(fdesc, begin, buffer) : 0), size(known_size)
+	{
+		struct stat sb;
+		if (whole_file && size == -1 && fstat(fdesc, &sb) == 0 && S_ISREG(sb.st_mode))
+		{
+			size = sb.st_size;
+		}
+		// Files in /proc and the like say they are empty, but aren't
+		if (size == 0)
+		{
+			size = -1;
+		}
+		if (!whole_file)
+		{
+			bytes = end - begin;
+		}
+	}
+
+	int want()
+	{
+		if (done)
+		{
+			return 0;
+		}
+		if (whole_file)
+		{
+			if (size == -1)
+			{
+				return blocksize;
+			}
+			// (A file that grew since we looked just gets counted as it was; one that shrank ends with a short read, as usual)
+			if (pos >= size)
+			{
+				return 0;
+			}
+			return std::min((off_t)blocksize, size - pos);
+		}
+		past_end = pos >= end;
+		if (past_end && !split)
+		{
+			return 0;
+		}
+		return past_end ? BASICBLOCK : std::min((off_t)blocksize, end - pos);
+	}
+
+	void consume(char *buffer, int nbytes)
+	{
+		if (nbytes <= 0)
+		{
+			done = true;
+			return;
+		}
+		pos += nbytes;
+		blocks++;
+		if (past_end)
+		{
+			// Only the rest of our last word is of interest now
+			for (int i = 0; i < nbytes; i++)
+			{
+				if (!tokenizer::is_token<Policy>(buffer[i]))
+				{
+					nbytes = i;
+					done = true;
+					break;
+				}
+			}
+		}
+		else if (whole_file)
+		{
+			bytes += nbytes;
+		}
+		// The token policy tells us which characters make up a word (a-zA-Z0-9_, unless -k picked another).  We used to test each byte
+		// against a table in turn, with an if statement per byte, but now the tokenizer kernel (see tokenizer.hpp) classifies 64 bytes at a time with
+		// vector instructions and hands us each word as a (start, end, hash) triple.  The split-word logic is still ours, though: if the prior
+		// block ended in a word and this one starts with a delimiter, that prefix was a whole word after all.
+		if (split && !tokenizer::is_token<Policy>(buffer[0]))
+		{
+			flush();
+		}
+		int tail = tokenizer::scan_hashed<Policy>(buffer, nbytes, [&](size_t start, size_t end, uint64_t hash) {
+			// If there is still a prefix, this word starts the block and is the rest of it, so the two have to be glued together
+			if (split)
+			{
+				prefix.append(buffer, end);
+				flush();
+				return;
+			}
+			sink(buffer + start, end - start, hash);
+		});
+		// A word at the very end of the file is just a word, and there is no next block for it to continue into
+		if (tail < nbytes && !split && whole_file && pos == size)
+		{
+			sink(buffer + tail, nbytes - tail, hash_word(buffer + tail, nbytes - tail));
+			return;
+		}
+		// This next test and code block are to make a copy of a word at the end of a buffer, for that split case.  If the word
+		// filled the entire buffer we glue it onto the prefix we already had, rather than losing the prefix.
+		if (tail < nbytes)
+		{
+			if (!split)
+			{
+				prefix.clear();
+			}
+			prefix.append(buffer + tail, nbytes - tail);
+			split = true;
+		}
+	}
+
+	void finish()
+	{
+		// This turned out to be unexpected: a surprising number of Linux .h and .c files "end" without a final newline character. They just end "in" a word, and
+		// So we have to duplicate our logic to handle that.
+		if (split)
+		{
+			flush();
+		}
+	}
+
+private:
+	// The prefix is a whole word now.  It is rare enough that we hash it ourselves.
+	void flush()
+	{
+		sink(prefix.data(), prefix.size(), hash_word(prefix.data(), prefix.size()));
+		split = false;
+	}
+};
+
+// Scan it all, one blocking read at a time into buffer, which has room for blocksize bytes
+template <class Policy, class Sink>
+void read_all(ReadScan<Policy, Sink> &scan, char *buffer)
+{
+	int len;
+	// Most of the "user time" of the program is spent in this loop
+	while ((len = scan.want()) > 0)
+	{
+		scan.consume(buffer, scan.whole_file ? read(scan.fdesc, buffer, len) : pread(scan.fdesc, buffer, len, scan.pos));
+	}
+	scan.finish();
+}
+
+} // namespace scanning
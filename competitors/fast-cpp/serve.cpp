@@ -0,0 +1,614 @@
+#include "serve.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "output.hpp"
+#include "ranking.hpp"
+
+namespace serve {
+
+// Everything that can change what a directory holds.  A file that is being written is only recounted once it is closed, and an editor
+// that saves by writing a new file and renaming it over the old one shows up as a move.
+static const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR;
+
+// A client has this long to send its request, and then, each time it stops reading its answer, this long before it reads more
+using Clock = std::chrono::steady_clock;
+static const auto REQUEST_TIMEOUT = std::chrono::seconds(1);
+static const auto REPLY_TIMEOUT = std::chrono::seconds(10);
+// The longest request line, and the most connections we have going at once (the rest wait in the listen backlog)
+static const size_t MAX_REQUEST = 256;
+static const size_t MAX_CLIENTS = 64;
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int) { stop_signal = 1; }
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+Server::Server(const char *dir, const Options &opts) : root(dir), options(opts), buffer(scanning::BUFFER_SIZE)
+{
+	// So that the paths we make up from the events match the ones the first walk found
+	while (root.size() > 1 && root.back() == '/')
+	{
+		root.pop_back();
+	}
+}
+
+Server::~Server()
+{
+	if (inotify != -1)
+	{
+		close(inotify);
+	}
+}
+
+bool Server::wanted(const std::string &path) const
+{
+	return options.filter(fs::path(path).extension().native());
+}
+
+// Watch dir and every directory under it, and add the files we want to found.  The watch on each directory goes in before we list it,
+// so a file that turns up while we are listing is either listed, or is reported by the watch (or both, which does no harm).  Like
+// walk_files, we follow symlinks to files but not to directories.
+void Server::watch_tree(const std::string &top, std::vector<std::string> &found)
+{
+	static bool warned = false;
+	std::vector<std::string> dirs{top};
+	while (!dirs.empty())
+	{
+		std::string dir = std::move(dirs.back());
+		dirs.pop_back();
+		int wd = inotify_add_watch(inotify, dir.c_str(), WATCH_MASK);
+		if (wd != -1)
+		{
+			watches[wd] = dir;
+		}
+		else if (!warned && errno == ENOSPC)
+		{
+			printf("Out of inotify watches at %s (see /proc/sys/fs/inotify/max_user_watches); changes there will be missed\n", dir.c_str());
+			warned = true;
+		}
+		std::error_code ec;
+		fs::directory_iterator it(dir, ec);
+		if (ec)
+		{
+			if (dir == root)
+			{
+				throw fs::filesystem_error("unable to open directory", dir, ec);
+			}
+			continue;
+		}
+		for (; it != fs::directory_iterator(); it.increment(ec))
+		{
+			if (ec)
+			{
+				break;
+			}
+			const fs::directory_entry &entry = *it;
+			if (entry.is_directory(ec) && !entry.is_symlink(ec))
+			{
+				dirs.push_back(entry.path().string());
+			}
+			else if (entry.is_regular_file(ec) && wanted(entry.path().string()))
+			{
+				found.push_back(entry.path().string());
+			}
+		}
+	}
+}
+
+// Count the file, reading it as fast-wc and WordCounter do, then pack its table down to just the words and their counts
+bool Server::count_file(const std::string &path, std::vector<char> &buf, WordTable &table, FileCounts &out) const
+{
+	int fdesc = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fdesc == -1)
+	{
+		return false;
+	}
+	table.clear();
+	options.scan(fdesc, buf.data(), table);
+	close(fdesc);
+	out.words.clear();
+	out.counts.clear();
+	out.counts.reserve(table.size());
+	for (auto [word, count] : table)
+	{
+		out.words.append(word);
+		out.counts.emplace_back(word.size(), count);
+	}
+	return true;
+}
+
+// Add a file's counts to the totals (sign 1), or take them off again (sign -1)
+void Server::apply(const FileCounts &fc, int sign)
+{
+	const char *word = fc.words.data();
+	for (auto [len, count] : fc.counts)
+	{
+		int &total = totals[std::string_view(word, len)];
+		total += sign * count;
+		// Otherwise the table would only ever grow, with every word that was ever in any version of any file
+		if (total == 0)
+		{
+			totals.erase(word, len);
+		}
+		word += len;
+	}
+}
+
+void Server::start()
+{
+	if (inotify == -1 && (inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+	{
+		throw fs::filesystem_error("unable to start inotify", root, std::error_code(errno, std::generic_category()));
+	}
+	std::vector<std::string> found;
+	watch_tree(root, found);
+	// The first count is the one big job, so it gets all the threads; after that it is a file or two at a time
+	std::vector<FileCounts> counted(found.size());
+	std::vector<char> ok(found.size());
+	std::atomic<size_t> next(0);
+	auto count_some = [&] {
+		std::vector<char> buf(scanning::BUFFER_SIZE);
+		WordTable table;
+		for (size_t i; (i = next++) < found.size();)
+		{
+			ok[i] = count_file(found[i], buf, table, counted[i]);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int n = 1; n < options.nthreads; n++)
+	{
+		threads.emplace_back(count_some);
+	}
+	count_some();
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		if (ok[i])
+		{
+			apply(counted[i], 1);
+			files[found[i]] = std::move(counted[i]);
+		}
+	}
+}
+
+// Recount a file that has changed, or forget it if it is gone (or is no longer a file at all)
+void Server::update_file(const std::string &path)
+{
+	if (!wanted(path))
+	{
+		return;
+	}
+	struct stat sb;
+	FileCounts fc;
+	if (stat(path.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode) || !count_file(path, buffer, scratch, fc))
+	{
+		remove_file(path);
+		return;
+	}
+	apply(fc, 1);
+	auto old = files.find(path);
+	if (old != files.end())
+	{
+		apply(old->second, -1);
+		old->second = std::move(fc);
+	}
+	else
+	{
+		files.emplace(path, std::move(fc));
+	}
+	updates++;
+}
+
+void Server::remove_file(const std::string &path)
+{
+	auto old = files.find(path);
+	if (old != files.end())
+	{
+		apply(old->second, -1);
+		files.erase(old);
+		updates++;
+	}
+}
+
+// A directory that was deleted or moved away takes all its files with it.  A moved one is still being watched (a watch follows the
+// directory, not its name), so those watches go too; if it moved somewhere else in the tree, it gets watched again under its new name.
+void Server::remove_tree(const std::string &dir)
+{
+	std::string prefix = dir + "/";
+	for (auto f = files.begin(); f != files.end();)
+	{
+		if (f->first.compare(0, prefix.size(), prefix) == 0)
+		{
+			apply(f->second, -1);
+			f = files.erase(f);
+			updates++;
+		}
+		else
+		{
+			++f;
+		}
+	}
+	for (auto w = watches.begin(); w != watches.end();)
+	{
+		if (w->second == dir || w->second.compare(0, prefix.size(), prefix) == 0)
+		{
+			inotify_rm_watch(inotify, w->first);
+			w = watches.erase(w);
+		}
+		else
+		{
+			++w;
+		}
+	}
+}
+
+// Apply every change that has been reported so far.  A file that was written to several times since we last looked is only recounted
+// once.
+void Server::drain_events()
+{
+	alignas(inotify_event) char buf[64 * 1024];
+	std::vector<std::string> changed;
+	bool overflow = false;
+	ssize_t n;
+	while ((n = read(inotify, buf, sizeof buf)) > 0)
+	{
+		for (char *p = buf; p < buf + n;)
+		{
+			auto *ev = reinterpret_cast<inotify_event *>(p);
+			p += sizeof(inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				overflow = true;
+				continue;
+			}
+			if (ev->mask & IN_IGNORED)
+			{
+				watches.erase(ev->wd);
+				continue;
+			}
+			auto w = watches.find(ev->wd);
+			if (w == watches.end() || ev->len == 0)
+			{
+				continue;
+			}
+			std::string path = (fs::path(w->second) / ev->name).string();
+			if (!(ev->mask & IN_ISDIR))
+			{
+				changed.push_back(std::move(path));
+			}
+			else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			{
+				watch_tree(path, changed);
+			}
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			{
+				remove_tree(path);
+			}
+		}
+	}
+	// The kernel had to drop events, so we no longer know what changed, or we have had no counts since the last time that happened
+	if (overflow || !failure.empty())
+	{
+		recount();
+		return;
+	}
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+	for (const std::string &path : changed)
+	{
+		update_file(path);
+	}
+}
+
+// Forget everything and start again from scratch.  start() throws if the tree can't be read any more (it was deleted or moved away,
+// say, or its permissions changed), and then we say so, answer every request with the error, and try again on the next event or
+// request, rather than the error taking the server down.
+void Server::recount()
+{
+	for (auto &w : watches)
+	{
+		inotify_rm_watch(inotify, w.first);
+	}
+	watches.clear();
+	files.clear();
+	totals.clear();
+	updates++;
+	try
+	{
+		start();
+		failure.clear();
+	}
+	catch (const std::exception &e)
+	{
+		if (failure.empty())
+		{
+			printf("Unable to count %s again: %s\n", root.c_str(), e.what());
+			fflush(stdout);
+		}
+		failure = e.what();
+	}
+}
+
+static std::vector<char> text(const char *data, size_t len)
+{
+	return std::vector<char>(data, data + len);
+}
+
+std::vector<char> Server::answer(std::string_view r)
+{
+	r = r.substr(0, r.find('\n'));
+	while (!r.empty() && (r.back() == '\r' || r.back() == ' '))
+	{
+		r.remove_suffix(1);
+	}
+	drain_events();
+	char line[512];
+	if (r == "quit")
+	{
+		quitting = true;
+		return text("bye\n", 4);
+	}
+	if (!failure.empty())
+	{
+		int n = snprintf(line, sizeof line, "Unable to count %s: %s\n", root.c_str(), failure.c_str());
+		return text(line, std::min<size_t>(n, sizeof line - 1));
+	}
+	if (r == "stats")
+	{
+		int64_t words = 0;
+		for (auto [word, count] : totals)
+		{
+			words += count;
+		}
+		int n = snprintf(line, sizeof line, "files %zu\ndistinct %zu\nwords %lld\nupdates %llu\n", files.size(), totals.size(),
+		                 (long long)words, (unsigned long long)updates);
+		return text(line, n);
+	}
+	size_t k = 0;
+	if (r.substr(0, 4) == "top ")
+	{
+		k = strtoul(std::string(r.substr(4)).c_str(), nullptr, 10);
+	}
+	if (r != "all" && k == 0)
+	{
+		int n = snprintf(line, sizeof line, "Unknown request: %.*s (want top K, all, stats or quit)\n", (int)std::min<size_t>(r.size(), 100), r.data());
+		return text(line, n);
+	}
+	// The same order as fast-wc: most common first, then alphabetical
+	std::vector<char> reply;
+	output::format_counts(ranking::top_k_sort(totals, k), reply);
+	return reply;
+}
+
+// Take a connection as far as it will go without blocking.  Returns false once we are done with it, one way or the other.
+bool Server::step(Client &c, short revents)
+{
+	auto now = Clock::now();
+	if (!c.replying)
+	{
+		bool eof = false;
+		if (revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			char buf[MAX_REQUEST];
+			while (c.request.size() < MAX_REQUEST && c.request.find('\n') == std::string::npos)
+			{
+				ssize_t got = read(c.fd, buf, MAX_REQUEST - c.request.size());
+				if (got == -1 && errno == EINTR)
+				{
+					continue;
+				}
+				if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				{
+					break;
+				}
+				if (got <= 0)
+				{
+					eof = true;
+					break;
+				}
+				c.request.append(buf, got);
+			}
+		}
+		// Answer a whole line, or whatever the client has sent by the time it stops sending or runs out of time
+		if (!eof && c.request.size() < MAX_REQUEST && c.request.find('\n') == std::string::npos && now < c.deadline)
+		{
+			return true;
+		}
+		c.reply = answer(c.request);
+		c.replying = true;
+		c.deadline = now + REPLY_TIMEOUT;
+	}
+	while (c.sent < c.reply.size())
+	{
+		ssize_t n = write(c.fd, c.reply.data() + c.sent, c.reply.size() - c.sent);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return now < c.deadline;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		c.sent += n;
+		c.deadline = now + REPLY_TIMEOUT;
+	}
+	return false;
+}
+
+bool Server::run(const char *socket_path)
+{
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof addr.sun_path)
+	{
+		printf("Socket path too long: %s\n", socket_path);
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path);
+	// A socket left behind by a server that didn't get to clean up would make bind() fail.  Anything other than a socket we leave be.
+	struct stat sb;
+	if (lstat(socket_path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+	{
+		unlink(socket_path);
+	}
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listener == -1 || bind(listener, (sockaddr *)&addr, sizeof addr) == -1 || listen(listener, 16) == -1)
+	{
+		printf("Unable to listen on %s (errno %d)\n", socket_path, errno);
+		if (listener != -1)
+		{
+			close(listener);
+		}
+		return false;
+	}
+	// A client that hangs up before reading its answer shouldn't take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa{};
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	std::vector<Client> clients;
+	std::vector<pollfd> fds;
+	// After quit, we stop taking new connections, but the ones we have still get their answers
+	while (!stop_signal && !(quitting && clients.empty()))
+	{
+		bool accepting = !quitting && clients.size() < MAX_CLIENTS;
+		fds.assign({{listener, (short)(accepting ? POLLIN : 0), 0}, {inotify, POLLIN, 0}});
+		// Wake up in time for the first client to run out of time
+		auto now = Clock::now();
+		int timeout = -1;
+		for (const Client &c : clients)
+		{
+			fds.push_back({c.fd, (short)(c.replying ? POLLOUT : POLLIN), 0});
+			int left = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(c.deadline - now).count() + 1);
+			timeout = timeout == -1 ? left : std::min(timeout, left);
+		}
+		if (poll(fds.data(), fds.size(), timeout) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			printf("Unable to wait for requests (errno %d)\n", errno);
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			drain_events();
+		}
+		size_t kept = 0;
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			if (step(clients[i], fds[2 + i].revents))
+			{
+				if (kept != i)
+				{
+					clients[kept] = std::move(clients[i]);
+				}
+				kept++;
+			}
+			else
+			{
+				close(clients[i].fd);
+			}
+		}
+		clients.resize(kept);
+		while ((fds[0].revents & POLLIN) && clients.size() < MAX_CLIENTS)
+		{
+			int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (client == -1)
+			{
+				break;
+			}
+			clients.push_back(Client{client, {}, {}, 0, false, Clock::now() + REQUEST_TIMEOUT});
+		}
+	}
+	for (const Client &c : clients)
+	{
+		close(c.fd);
+	}
+	close(listener);
+	unlink(socket_path);
+	return true;
+}
+
+int query(const char *socket_path, const std::string &request)
+{
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof addr.sun_path)
+	{
+		printf("Socket path too long: %s\n", socket_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof addr) == -1)
+	{
+		printf("Unable to reach a server on %s (errno %d)\n", socket_path, errno);
+		return 1;
+	}
+	std::string line = request + "\n";
+	if (!write_all(fd, line.data(), line.size()))
+	{
+		printf("Unable to send the request (errno %d)\n", errno);
+		close(fd);
+		return 1;
+	}
+	shutdown(fd, SHUT_WR);
+	char buf[64 * 1024];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof buf)) > 0)
+	{
+		if (!write_all(STDOUT_FILENO, buf, n))
+		{
+			break;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+} // namespace serve
@@ -0,0 +1,119 @@
+#pragma once
+
+/*
+ * --serve: keep the counts of one tree resident, keep them up to date as files change, and answer queries over a Unix socket.
+ */
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "scanning.hpp"
+#include "tokenizer.hpp"
+#include "utils.hpp"
+#include "word_table.hpp"
+
+namespace serve {
+
+// Counts the words in one open file, reading it through buffer (scanning::BUFFER_SIZE bytes) just as fast-wc reads it.  fast-wc hands
+// us the instance for its -k policy.
+using Scanner = void (*)(int fdesc, char *buffer, WordTable &counts);
+
+template <class Policy>
+void scan_file(int fdesc, char *buffer, WordTable &counts)
+{
+	scanning::ReadScan<Policy, scanning::CountInto> scan({&counts}, fdesc, 0, -1, -1, scanning::BUFFER_SIZE, buffer);
+	scanning::read_all(scan, buffer);
+}
+
+struct Options
+{
+	int nthreads = 1;                                                    // for the first, full count
+	utils::ExtensionPred filter = utils::has_extension<utils::CSources>; // which files count
+	Scanner scan = scan_file<tokenizer::Ident>;
+};
+
+// A pre-commit hook or an editor asks about the same tree again and again, and nearly all of it is the same as last time.  So rather
+// than count it all over again for every question, the server counts it once, then watches every directory in it with inotify, and
+// when a file changes it recounts just that file.  It remembers what each file added to the totals, so a change is a matter of taking
+// the old counts off and putting the new ones on, and a deleted file just has its counts taken off.
+//
+// Each connection to the socket is one request, a line of text, and the answer is written back before the connection is closed.  The
+// sockets never block, and every connection has its own buffers, so the server goes on answering everybody else while one client is
+// slow to send its request or to read its answer; one that stalls for too long is dropped.  The requests are:
+//   top K    the K most common words, in fast-wc's usual "word | count" format
+//   all      every word, the same way
+//   stats    how many files, distinct words and words in all there are, and how many updates have been applied
+//   quit     stop serving
+// Any file changes that are already waiting are applied before a request is answered, so an answer is never older than the request.
+// If the tree can't be counted again after the kernel drops change events (see drain_events), every answer says so until it can.
+class Server
+{
+public:
+	Server(const char *dir, const Options &options);
+	~Server();
+	Server(const Server &) = delete;
+	Server &operator=(const Server &) = delete;
+
+	// Count the whole tree, and start watching it.  Throws fs::filesystem_error if dir can't be read.
+	void start();
+
+	// Answer requests on socket_path until told to quit, or until SIGINT or SIGTERM.  Returns false if the socket couldn't be set up.
+	bool run(const char *socket_path);
+
+	size_t file_count() const { return files.size(); }
+
+private:
+	// What one file adds to the totals: its distinct words back to back, and the length and count of each in turn
+	struct FileCounts
+	{
+		std::string words;
+		std::vector<std::pair<uint32_t, int>> counts;
+	};
+
+	// One connection: the request as it comes in, then the answer as it goes out.  deadline is when we give up on the client if it
+	// hasn't sent the whole request, or (once we are replying) hasn't read any more of the answer.
+	struct Client
+	{
+		int fd;
+		std::string request;
+		std::vector<char> reply;
+		size_t sent = 0;
+		bool replying = false;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	bool wanted(const std::string &name) const;
+	void watch_tree(const std::string &dir, std::vector<std::string> &found);
+	bool count_file(const std::string &path, std::vector<char> &buffer, WordTable &scratch, FileCounts &out) const;
+	void apply(const FileCounts &fc, int sign);
+	void update_file(const std::string &path);
+	void remove_file(const std::string &path);
+	void remove_tree(const std::string &dir);
+	void drain_events();
+	void recount();
+	std::vector<char> answer(std::string_view request);
+	bool step(Client &client, short revents);
+
+	std::string root;
+	Options options;
+	int inotify = -1;
+	std::unordered_map<int, std::string> watches; // inotify watch -> the directory it watches
+	std::unordered_map<std::string, FileCounts> files;
+	// A word whose files have all gone is erased, so every word in here is in some file
+	WordTable totals;
+	WordTable scratch;
+	std::vector<char> buffer;
+	uint64_t updates = 0;
+	bool quitting = false;
+	// Why the last recount failed, or empty
+	std::string failure;
+};
+
+// "fast-wc query SOCKET request...": send one request to a server and copy its answer to stdout.  Returns the exit status.
+int query(const char *socket_path, const std::string &request);
+
+} // namespace serve
@@ -0,0 +1,174 @@
+#include "space_saving.hpp"
+
+#include <algorithm>
+#include <bit>
+
+SpaceSaving::SpaceSaving(size_t capacity) : limit(std::max<size_t>(capacity, 1))
+{
+	// At most half full, like WordTable, so the probes stay short
+	index.assign(std::bit_ceil(2 * limit), EMPTY);
+	mask = index.size() - 1;
+	counters.reserve(limit);
+	heap.reserve(limit);
+	pos.reserve(limit);
+}
+
+// The miss path.  slot is the empty index slot where the probe for this word ended.
+void SpaceSaving::take_over(size_t slot, const char *word, size_t len, uint64_t hash, uint64_t n)
+{
+	if (counters.size() < limit)
+	{
+		uint32_t c = counters.size();
+		counters.push_back(Counter{std::string(word, len), hash, n, 0});
+		index[slot] = c;
+		heap.push_back(c);
+		pos.push_back(heap.size() - 1);
+		sift_up(heap.size() - 1);
+		return;
+	}
+	uint32_t c = heap[0];
+	unindex(c);
+	// Taking the victim's slot out of the index may have moved other words back into the slot we were given, so probe again
+	slot = hash & mask;
+	while (index[slot] != EMPTY)
+	{
+		slot = (slot + 1) & mask;
+	}
+	Counter &victim = counters[c];
+	victim.error = victim.count;
+	victim.count += n;
+	victim.word.assign(word, len);
+	victim.hash = hash;
+	index[slot] = c;
+	sift_down(0);
+}
+
+// Remove counter c from the index.  With linear probing we can't just empty its slot, since that would cut short the probe sequence of
+// any word that was placed after it.  Instead the words after it move back to fill the hole ("backward shift deletion"), which leaves
+// the index exactly as if c had never been in it.
+void SpaceSaving::unindex(uint32_t c)
+{
+	size_t i = counters[c].hash & mask;
+	while (index[i] != c)
+	{
+		i = (i + 1) & mask;
+	}
+	for (size_t j = (i + 1) & mask; index[j] != EMPTY; j = (j + 1) & mask)
+	{
+		size_t home = counters[index[j]].hash & mask;
+		// The word at j can move back to the hole at i unless its home slot lies cyclically in (i, j]
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			index[i] = index[j];
+			i = j;
+		}
+	}
+	index[i] = EMPTY;
+}
+
+void SpaceSaving::merge(const SpaceSaving &other)
+{
+	uint64_t mine_min = min_count();
+	uint64_t theirs_min = other.min_count();
+	std::vector<Counter> all;
+	all.reserve(counters.size() + other.counters.size());
+	std::vector<bool> matched(other.counters.size());
+	for (Counter &c : counters)
+	{
+		// Look the word up in the other summary the same way add() would
+		const Counter *match = nullptr;
+		for (size_t i = c.hash & other.mask; other.index[i] != EMPTY; i = (i + 1) & other.mask)
+		{
+			const Counter &o = other.counters[other.index[i]];
+			if (o.hash == c.hash && o.word == c.word)
+			{
+				match = &o;
+				matched[other.index[i]] = true;
+				break;
+			}
+		}
+		uint64_t count = match ? match->count : theirs_min;
+		uint64_t error = match ? match->error : theirs_min;
+		all.push_back(Counter{std::move(c.word), c.hash, c.count + count, c.error + error});
+	}
+	for (size_t i = 0; i < other.counters.size(); i++)
+	{
+		if (!matched[i])
+		{
+			const Counter &o = other.counters[i];
+			all.push_back(Counter{o.word, o.hash, o.count + mine_min, o.error + mine_min});
+		}
+	}
+	if (all.size() > limit)
+	{
+		std::nth_element(all.begin(), all.begin() + limit, all.end(), [](const Counter &a, const Counter &b) { return a.count > b.count; });
+		all.resize(limit);
+	}
+	counters = std::move(all);
+	added += other.added;
+	rebuild();
+}
+
+void SpaceSaving::rebuild()
+{
+	std::fill(index.begin(), index.end(), EMPTY);
+	heap.resize(counters.size());
+	pos.resize(counters.size());
+	for (uint32_t c = 0; c < counters.size(); c++)
+	{
+		size_t i = counters[c].hash & mask;
+		while (index[i] != EMPTY)
+		{
+			i = (i + 1) & mask;
+		}
+		index[i] = c;
+		heap[c] = c;
+		pos[c] = c;
+	}
+	for (size_t h = heap.size() / 2; h-- > 0;)
+	{
+		sift_down(h);
+	}
+}
+
+void SpaceSaving::sift_down(size_t h)
+{
+	uint32_t c = heap[h];
+	uint64_t count = counters[c].count;
+	size_t n = heap.size();
+	while (true)
+	{
+		size_t child = 2 * h + 1;
+		if (child >= n)
+		{
+			break;
+		}
+		if (child + 1 < n && counters[heap[child + 1]].count < counters[heap[child]].count)
+		{
+			child++;
+		}
+		if (counters[heap[child]].count >= count)
+		{
+			break;
+		}
+		heap[h] = heap[child];
+		pos[heap[h]] = h;
+		h = child;
+	}
+	heap[h] = c;
+	pos[c] = h;
+}
+
+void SpaceSaving::sift_up(size_t h)
+{
+	uint32_t c = heap[h];
+	uint64_t count = counters[c].count;
+	while (h > 0 && counters[heap[(h - 1) / 2]].count > count)
+	{
+		heap[h] = heap[(h - 1) / 2];
+		pos[heap[h]] = h;
+		h = (h - 1) / 2;
+	}
+	heap[h] = c;
+	pos[c] = h;
+}
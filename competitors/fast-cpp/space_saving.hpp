@@ -0,0 +1,93 @@
+#pragma once
+
+/*
+ * A fixed-size summary of the most common words (--approx), for inputs whose full vocabulary is too big to be worth keeping.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "word_table.hpp"
+
+// This is the Space-Saving algorithm of Metwally, Agrawal and El Abbadi.  We keep exactly "capacity" counters, and never more: a
+// word we are already counting just gets its counter bumped, and a word we aren't counting takes over the counter with the smallest
+// count, starting from that count plus one.  That over-counts the newcomer by at most the count it inherited, which is remembered as
+// the counter's error.  So for every word we report, the true count lies in [count - error, count], no error is ever bigger than
+// total() / capacity, and any word that really occurs more often than that is sure to be in the summary.
+//
+// Memory is O(capacity) however big the input is.  Finding the smallest counter is what a min-heap is for, and a word that is already
+// counted is found through a small open-addressing index, as in WordTable.  The expensive part of a WordTable miss (growing the arena,
+// rehashing) can't happen here: a miss reuses the victim's counter, and very nearly always its string's storage as well.
+class SpaceSaving
+{
+public:
+	struct Counter
+	{
+		std::string word;
+		uint64_t hash;
+		uint64_t count;
+		uint64_t error; // how much of count may have been inherited from the words this counter used to hold
+	};
+
+	explicit SpaceSaving(size_t capacity = 1);
+
+	inline void add(const char *word, size_t len, uint64_t n = 1)
+	{
+		add_hashed(word, len, hash_word(word, len), n);
+	}
+
+	// The same, for a caller that already knows the word's hash
+	inline void add_hashed(const char *word, size_t len, uint64_t hash, uint64_t n = 1)
+	{
+		added += n;
+		size_t i = hash & mask;
+		while (index[i] != EMPTY)
+		{
+			Counter &c = counters[index[i]];
+			if (c.hash == hash && c.word.size() == len && memcmp(c.word.data(), word, len) == 0)
+			{
+				c.count += n;
+				// A bigger count only ever moves a counter away from the top of a min-heap
+				sift_down(pos[index[i]]);
+				return;
+			}
+			i = (i + 1) & mask;
+		}
+		take_over(i, word, len, hash, n);
+	}
+
+	// Fold another summary into this one, keeping the same number of counters.  This is the merge from the "Mergeable Summaries" paper
+	// by Agarwal et al: a word missing from one side might still have occurred there up to that side's minimum count, so it is charged
+	// that much (as count and as error), and then the biggest counters survive.  The error bound stays total() / capacity for the
+	// combined total.
+	void merge(const SpaceSaving &other);
+
+	// Every word added, counting repeats
+	uint64_t total() const { return added; }
+	size_t capacity() const { return limit; }
+	// The counters in no particular order
+	const std::vector<Counter> &entries() const { return counters; }
+
+	// Once every counter is in use, the smallest count: the most any word not in the summary can have occurred, and the most any
+	// counter has inherited.  Before that, nothing has been evicted yet, and every count is exact.
+	uint64_t min_count() const { return counters.size() < limit ? 0 : counters[heap[0]].count; }
+
+private:
+	static constexpr uint32_t EMPTY = UINT32_MAX;
+
+	void take_over(size_t slot, const char *word, size_t len, uint64_t hash, uint64_t n);
+	void unindex(uint32_t c);
+	void rebuild();
+	void sift_down(size_t h);
+	void sift_up(size_t h);
+
+	size_t limit;
+	uint64_t added = 0;
+	std::vector<Counter> counters;
+	std::vector<uint32_t> heap; // counter numbers, smallest count on top
+	std::vector<uint32_t> pos;  // where each counter is in the heap
+	std::vector<uint32_t> index;
+	size_t mask;
+};
@@ -0,0 +1,187 @@
+#include "stats.hpp"
+
+#include <cinttypes>
+#include <sys/resource.h>
+
+namespace stats {
+
+static double ms(int64_t ns)
+{
+	return ns / 1e6;
+}
+
+static int64_t total_bytes(const Report &report)
+{
+	int64_t bytes = 0;
+	for (const ThreadStats &t : report.threads)
+	{
+		bytes += t.bytes;
+	}
+	return bytes;
+}
+
+int64_t peak_rss_kb()
+{
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return -1;
+	}
+	// Linux gives ru_maxrss in KB
+	return usage.ru_maxrss;
+}
+
+void print_report(FILE *out, const Report &report)
+{
+	int64_t bytes = total_bytes(report);
+	fprintf(out, "%-10s %12s %12s\n", "phase", "wall ms", "cpu ms");
+	for (const auto &[name, t] : report.phases)
+	{
+		if (t.cpu_ns < 0)
+		{
+			fprintf(out, "%-10s %12.3f %12s\n", name, ms(t.wall_ns), "-");
+		}
+		else
+		{
+			fprintf(out, "%-10s %12.3f %12.3f\n", name, ms(t.wall_ns), ms(t.cpu_ns));
+		}
+	}
+	fprintf(out, "%-10s %12.3f %12.3f\n", "total", ms(report.total.wall_ns), ms(report.total.cpu_ns));
+	fprintf(out, "\n%-6s %8s %8s %8s %8s %10s %14s %12s %12s %12s\n", "thread", "files", "chunks", "cached", "spills", "blocks", "bytes",
+	        "scan ms", "scan cpu ms", "merge ms");
+	for (size_t n = 0; n < report.threads.size(); n++)
+	{
+		const ThreadStats &t = report.threads[n];
+		fprintf(out, "%-6zu %8" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64 " %10" PRId64 " %14" PRId64 " %12.3f %12.3f %12.3f\n", n,
+		        t.files, t.chunks, t.cached, t.spills, t.blocks, t.bytes, ms(t.scan.wall_ns), ms(t.scan.cpu_ns), ms(t.merge.wall_ns));
+	}
+	double secs = report.total.wall_ns / 1e9;
+	fprintf(out, "\n%" PRId64 " files, %" PRId64 " bytes, %" PRId64 " distinct words, %.1f MB/s", report.files, bytes, report.words,
+	        secs > 0 ? bytes / secs / 1e6 : 0.0);
+	if (report.peak_rss_kb >= 0)
+	{
+		fprintf(out, ", peak RSS %.1f MB", report.peak_rss_kb / 1024.0);
+	}
+	fprintf(out, "\n");
+}
+
+void print_counters(FILE *out, const Report &report)
+{
+	int64_t bytes = total_bytes(report);
+	fprintf(out, "%-10s", "counters");
+	for (int e = 0; e < perf::NEVENTS; e++)
+	{
+		fprintf(out, " %14s", perf::event_name(e));
+	}
+	fprintf(out, " %8s %14s %14s\n", "IPC", "br-miss/KB", "LLC-miss/KB");
+	for (const auto &[name, c] : report.counters)
+	{
+		fprintf(out, "%-10s", name);
+		for (int e = 0; e < perf::NEVENTS; e++)
+		{
+			if (c.valid[e])
+			{
+				fprintf(out, " %14" PRId64, c.value[e]);
+			}
+			else
+			{
+				fprintf(out, " %14s", "-");
+			}
+		}
+		if (c.valid[perf::CYCLES] && c.valid[perf::INSTRUCTIONS] && c.value[perf::CYCLES] > 0)
+		{
+			fprintf(out, " %8.2f", (double)c.value[perf::INSTRUCTIONS] / c.value[perf::CYCLES]);
+		}
+		else
+		{
+			fprintf(out, " %8s", "-");
+		}
+		// Per kilobyte rather than per byte, or the numbers are all tiny fractions
+		for (int e : {perf::BRANCH_MISSES, perf::LLC_MISSES})
+		{
+			if (c.valid[e] && bytes > 0)
+			{
+				fprintf(out, " %14.3f", c.value[e] * 1024.0 / bytes);
+			}
+			else
+			{
+				fprintf(out, " %14s", "-");
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
+
+static void json_counts(FILE *out, const perf::Counts &c)
+{
+	fprintf(out, "{");
+	for (int e = 0; e < perf::NEVENTS; e++)
+	{
+		fprintf(out, "%s\"%s\": ", e > 0 ? ", " : "", perf::event_name(e));
+		if (c.valid[e])
+		{
+			fprintf(out, "%" PRId64, c.value[e]);
+		}
+		else
+		{
+			fprintf(out, "null");
+		}
+	}
+	fprintf(out, "}");
+}
+
+static void json_phase(FILE *out, const PhaseTime &t)
+{
+	fprintf(out, "{\"wall_ms\": %.3f, \"cpu_ms\": ", ms(t.wall_ns));
+	if (t.cpu_ns < 0)
+	{
+		fprintf(out, "null}");
+	}
+	else
+	{
+		fprintf(out, "%.3f}", ms(t.cpu_ns));
+	}
+}
+
+void write_json(FILE *out, const Report &report)
+{
+	fprintf(out, "{\"threads\": %d, \"files\": %" PRId64 ", \"bytes\": %" PRId64 ", \"words\": %" PRId64 ", \"total\": ", report.nthreads,
+	        report.files, total_bytes(report), report.words);
+	json_phase(out, report.total);
+	fprintf(out, ", \"phases\": {");
+	for (size_t i = 0; i < report.phases.size(); i++)
+	{
+		fprintf(out, "%s\"%s\": ", i > 0 ? ", " : "", report.phases[i].first);
+		json_phase(out, report.phases[i].second);
+	}
+	fprintf(out, "}, \"per_thread\": [");
+	for (size_t n = 0; n < report.threads.size(); n++)
+	{
+		const ThreadStats &t = report.threads[n];
+		fprintf(out, "%s{\"files\": %" PRId64 ", \"chunks\": %" PRId64 ", \"cached\": %" PRId64 ", \"spills\": %" PRId64
+		        ", \"blocks\": %" PRId64 ", \"bytes\": %" PRId64 ", \"scan\": ",
+		        n > 0 ? ", " : "", t.files, t.chunks, t.cached, t.spills, t.blocks, t.bytes);
+		json_phase(out, t.scan);
+		fprintf(out, ", \"merge\": ");
+		json_phase(out, t.merge);
+		fprintf(out, "}");
+	}
+	fprintf(out, "]");
+	if (report.peak_rss_kb >= 0)
+	{
+		fprintf(out, ", \"peak_rss_kb\": %" PRId64, report.peak_rss_kb);
+	}
+	if (!report.counters.empty())
+	{
+		fprintf(out, ", \"perf_counters\": {");
+		for (size_t i = 0; i < report.counters.size(); i++)
+		{
+			fprintf(out, "%s\"%s\": ", i > 0 ? ", " : "", report.counters[i].first);
+			json_counts(out, report.counters[i].second);
+		}
+		fprintf(out, "}");
+	}
+	fprintf(out, "}\n");
+}
+
+} // namespace stats
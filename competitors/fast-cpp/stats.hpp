@@ -0,0 +1,114 @@
+#pragma once
+
+/*
+ * Counters and phase timings for the -v report and --json.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <utility>
+#include <vector>
+#include "perf.hpp"
+
+namespace stats {
+
+inline int64_t now_ns(clockid_t clock)
+{
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// How long one phase took.  Wall time is what you'd see on a stopwatch.  CPU time adds up every thread that worked on the phase, so
+// when it's well above the wall time the phase ran in parallel.  -1 means we can't measure it: for example directory discovery runs
+// inside the walker's own threads.
+struct PhaseTime
+{
+	int64_t wall_ns = 0;
+	int64_t cpu_ns = -1;
+};
+
+// Fold one thread's time for a phase into the total.  A phase that ran on every thread at once took as long as its slowest thread,
+// and used as much CPU as all of them together.  A thread that never ran the phase (only some threads merge, say) still has the
+// default -1, which means "not measured" rather than being a time, so it is left out of the sum.
+inline void add_parallel(PhaseTime &total, const PhaseTime &t)
+{
+	total.wall_ns = std::max(total.wall_ns, t.wall_ns);
+	if (t.cpu_ns >= 0)
+	{
+		total.cpu_ns = std::max<int64_t>(total.cpu_ns, 0) + t.cpu_ns;
+	}
+}
+
+// The same for a part of a phase that ran after the rest of it: the wall times add up as well
+inline void add_sequential(PhaseTime &total, const PhaseTime &t)
+{
+	total.wall_ns += std::max<int64_t>(t.wall_ns, 0);
+	if (t.cpu_ns >= 0)
+	{
+		total.cpu_ns = std::max<int64_t>(total.cpu_ns, 0) + t.cpu_ns;
+	}
+}
+
+// Starts timing when it is created.  The CPU clock is either CLOCK_THREAD_CPUTIME_ID, for work done by the calling thread, or
+// CLOCK_PROCESS_CPUTIME_ID, for a phase in main() that starts helper threads of its own (the parallel sort, say).
+class Stopwatch
+{
+public:
+	explicit Stopwatch(clockid_t cpu_clock = CLOCK_THREAD_CPUTIME_ID)
+	    : cpu_clock(cpu_clock), wall0(now_ns(CLOCK_MONOTONIC)), cpu0(now_ns(cpu_clock))
+	{
+	}
+	PhaseTime elapsed() const { return PhaseTime{now_ns(CLOCK_MONOTONIC) - wall0, now_ns(cpu_clock) - cpu0}; }
+
+private:
+	clockid_t cpu_clock;
+	int64_t wall0, cpu0;
+};
+
+// The counters of one wcounter thread.  These used to be shared atomics that every thread bumped for every block, so the cache line
+// holding them bounced from core to core all through the scan.  Now each thread has its own, and alignas(64) makes sure no two
+// threads' counters share a cache line either.  We only add them up at the end.
+struct alignas(64) ThreadStats
+{
+	int64_t files = 0;
+	int64_t chunks = 0;
+	int64_t cached = 0; // files or chunks taken from --cache instead of being scanned
+	int64_t spills = 0; // sorted runs written out under --mem-limit
+	int64_t blocks = 0;
+	int64_t bytes = 0;
+	PhaseTime scan;
+	PhaseTime merge;
+	perf::Counts scan_counts;
+	perf::Counts merge_counts;
+};
+
+struct Report
+{
+	int nthreads;
+	int64_t files;
+	int64_t words;
+	PhaseTime total;
+	std::vector<std::pair<const char *, PhaseTime>> phases;
+	std::vector<ThreadStats> threads;
+	// Only filled in with --perf-counters
+	std::vector<std::pair<const char *, perf::Counts>> counters;
+	// The most memory the process has had resident at once, from peak_rss_kb()
+	int64_t peak_rss_kb = -1;
+};
+
+// The high-water mark of the process's resident memory so far, in KB, or -1 if the kernel won't say.  This is what the perf gate in
+// compare/ holds fast-wc to, alongside throughput.
+int64_t peak_rss_kb();
+
+// The human readable version, for -v
+void print_report(FILE *out, const Report &report);
+
+// The --perf-counters table: the raw counts for each phase, plus IPC and the misses per byte scanned
+void print_counters(FILE *out, const Report &report);
+
+// The same, as a single JSON object
+void write_json(FILE *out, const Report &report);
+
+} // namespace stats
@@ -0,0 +1,148 @@
+// Tests for CountCache (cache.hpp): entries come back from a saved file as they were recorded, and an entry whose word records are
+// damaged is treated as missing, so its file gets scanned again, rather than being read past its end.  Run by ctest; exits non-zero if
+// any check fails.
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "../cache.hpp"
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+CacheKey key(uint64_t ino)
+{
+	return CacheKey{1, ino, 100, 12345, 0, -1};
+}
+
+std::map<std::string, int> words_of(const CountCache &cache, const CacheEntry *e)
+{
+	std::map<std::string, int> words;
+	cache.for_each_word(e, [&](const char *word, size_t len, int count) { words[std::string(word, len)] += count; });
+	return words;
+}
+
+std::vector<char> read_file(const std::string &path)
+{
+	std::vector<char> bytes;
+	FILE *f = fopen(path.c_str(), "rb");
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+	{
+		bytes.insert(bytes.end(), buf, buf + n);
+	}
+	fclose(f);
+	return bytes;
+}
+
+void write_file(const std::string &path, const std::vector<char> &bytes)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	fwrite(bytes.data(), 1, bytes.size(), f);
+	fclose(f);
+}
+
+// The entry for ino in a cache file's bytes
+CacheEntry *entry_in(std::vector<char> &bytes, uint64_t ino)
+{
+	CacheHeader h;
+	memcpy(&h, bytes.data(), sizeof h);
+	auto *entries = (CacheEntry *)(bytes.data() + sizeof(CacheHeader));
+	for (uint64_t i = 0; i < h.nentries; i++)
+	{
+		if (entries[i].key.ino == ino)
+		{
+			return &entries[i];
+		}
+	}
+	return nullptr;
+}
+
+int main()
+{
+	std::string path = "/tmp/cache_test." + std::to_string(getpid());
+	std::map<std::string, int> want[3] = {{{"alpha", 3}, {"beta", 1}}, {{"gamma", 7}, {std::string(70000, 'l'), 2}}, {{"delta", 1}}};
+	{
+		CountCache cache(path.c_str(), "ident", 1);
+		for (int i = 0; i < 3; i++)
+		{
+			WordTable counts;
+			for (auto &[word, count] : want[i])
+			{
+				counts.add(word.data(), word.size(), count);
+			}
+			cache.record(0, key(i + 1), counts);
+		}
+		CHECK(cache.save());
+	}
+	{
+		CountCache cache(path.c_str(), "ident", 1);
+		for (int i = 0; i < 3; i++)
+		{
+			const CacheEntry *e = cache.find(key(i + 1));
+			CHECK(e != nullptr && words_of(cache, e) == want[i]);
+		}
+		CHECK(cache.find(key(9)) == nullptr);
+		// A different token set's counts mean something else
+		CountCache other(path.c_str(), "hyphen", 1);
+		CHECK(other.find(key(1)) == nullptr);
+	}
+	const std::vector<char> good = read_file(path);
+
+	// Each kind of damage to entry 2, which must then be missing while the others are still there.  (A memcpy at each offset, since the
+	// records aren't aligned.)
+	auto set32 = [](std::vector<char> &bytes, uint64_t at, uint32_t v) { memcpy(bytes.data() + at, &v, 4); };
+	auto damaged = [&](const char *what, auto &&damage) {
+		std::vector<char> bytes = good;
+		damage(bytes, *entry_in(bytes, 2));
+		write_file(path, bytes);
+		CountCache cache(path.c_str(), "ident", 1);
+		if (cache.find(key(2)) != nullptr)
+		{
+			printf("  damaged entry was used: %s\n", what);
+			failures++;
+		}
+		CHECK(cache.find(key(1)) != nullptr && words_of(cache, cache.find(key(1))) == want[0]);
+		CHECK(cache.find(key(3)) != nullptr && words_of(cache, cache.find(key(3))) == want[2]);
+	};
+	damaged("a length past the end", [&](std::vector<char> &bytes, CacheEntry &e) { set32(bytes, e.words_offset + 4, 0xfffffff0u); });
+	damaged("a length one too long", [&](std::vector<char> &bytes, CacheEntry &e) {
+		uint32_t len;
+		memcpy(&len, bytes.data() + e.words_offset + 4, 4);
+		set32(bytes, e.words_offset + 4, len + 1);
+	});
+	damaged("a zero length", [&](std::vector<char> &bytes, CacheEntry &e) { set32(bytes, e.words_offset + 4, 0); });
+	damaged("more words than there are", [](std::vector<char> &, CacheEntry &e) { e.nwords++; });
+	damaged("fewer words than there are", [](std::vector<char> &, CacheEntry &e) { e.nwords--; });
+	damaged("a huge word count", [](std::vector<char> &, CacheEntry &e) { e.nwords = ~0ull; });
+	damaged("a short byte count", [](std::vector<char> &, CacheEntry &e) { e.words_bytes -= 3; });
+
+	// A file cut short: the entries whose words are gone can't be trusted at all
+	std::vector<char> truncated(good.begin(), good.end() - 10);
+	write_file(path, truncated);
+	{
+		CountCache cache(path.c_str(), "ident", 1);
+		CHECK(cache.find(key(3)) == nullptr);
+	}
+
+	unlink(path.c_str());
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# With more than one thread, a file bigger than the chunk size (-c, in KB) is cut into chunks that different threads scan, and each
+# chunk has to give up a word it starts in the middle of and finish one it ends in the middle of.  Here the chunks are 1 KB, on files
+# built so that a word straddles a boundary, a boundary falls right on a delimiter and right before a word, a word runs across the last
+# boundary to the very last byte of the file, plus random files that put boundaries everywhere else.  Every way of scanning chunks
+# must count the same as one thread reading each file whole.  Run by ctest as
+#   chunk_boundaries_test.sh path/to/fast-wc
+set -euo pipefail
+export LC_ALL=C
+
+FASTWC=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/src"
+
+# Pad text with short words out to offset $1, so that the byte just before it is a delimiter
+text=""
+fill_to() {
+	while [ "${#text}" -lt "$1" ]; do
+		text+="fi "
+	done
+	text="${text:0:$1 - 1} "
+}
+
+# 5 KB, so with -c1 the boundaries are at 1024, 2048, 3072 and 4096
+fill_to 1017
+text+="straddles_1024 "
+fill_to 2048
+text+="starts_chunk_3 "
+fill_to 3066
+text+="before"$'\n'" ends_chunk_3 "
+fill_to 4000
+while [ "${#text}" -lt 5120 ]; do
+	text+="z"
+done
+printf '%s' "$text" > "$DIR/src/crafted.c"
+if [ "$(wc -c < "$DIR/src/crafted.c")" -ne 5120 ] || [ "${text:1023:2}" != "le" ] || [ "${text:2047:2}" != " s" ] || [ "${text:3071:2}" != $'e\n' ]; then
+	echo "FAIL: crafted.c isn't laid out as intended"
+	exit 1
+fi
+
+# Random words and delimiters, a few KB of them, ending on a word or a delimiter, and a run of files one byte apart in size around
+# 2 KB, so that the chunk length (the size over the number of chunks, rounded up) shifts the boundaries a byte at a time
+RANDOM=1
+for f in $(seq 1 12); do
+	text=""
+	size=$((1025 + RANDOM % 8000))
+	while [ "${#text}" -lt "$size" ]; do
+		case $((RANDOM % 4)) in
+		0) text+=" " ;;
+		1) text+=$'\n\t' ;;
+		*) text+="w$((RANDOM % 50))" ;;
+		esac
+	done
+	printf '%s' "${text:0:$size}" > "$DIR/src/random_$f.c"
+done
+for size in $(seq 2040 2060); do
+	text=""
+	while [ "${#text}" -lt "$size" ]; do
+		text+="ab$((size % 7))c;"
+	done
+	printf '%s' "${text:0:$size}" > "$DIR/src/size_$size.c"
+done
+
+counts() { awk '$2 == "|"' | sort; }
+
+"$FASTWC" -n1 "$DIR/src" | counts > "$DIR/want"
+
+failed=0
+check() {
+	local name=$1
+	shift
+	if ! diff <("$@" | counts) "$DIR/want" > "$DIR/diff"; then
+		echo "FAIL: $name"
+		head -20 "$DIR/diff"
+		failed=1
+	fi
+}
+for n in 2 3 4; do
+	check "read(), $n threads" "$FASTWC" -n$n -c1 "$DIR/src"
+	check "read() in 1 KB blocks, $n threads" "$FASTWC" -n$n -c1 -b1 "$DIR/src"
+	check "mmap, $n threads" "$FASTWC" -n$n -c1 -b1 -m "$DIR/src"
+	check "io_uring, $n threads" "$FASTWC" -n$n -c1 -u "$DIR/src"
+done
+[ "$failed" -eq 0 ] && echo "All checks passed"
+exit "$failed"
@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# Words longer than a whole read block (1 MB for stdin, --prefetch and archives, 128 KB for read()) must still count as one word each,
+# on every input path.  Each path's counts are compared with -m, which maps the file and never splits anything.  Run by ctest as
+#   long_words_test.sh path/to/fast-wc
+set -euo pipefail
+
+FASTWC=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+word() { head -c "$2" /dev/zero | tr '\0' "$1"; }
+
+mkdir "$DIR/src"
+{
+	printf 'a b '
+	word w 2500000
+	printf ' c '
+	word v 1048576
+	printf '\nd '
+	word x 1048575
+	printf ' e\n'
+	word q 3000000
+} > "$DIR/src/long.c"
+tar -cf "$DIR/src.tar" -C "$DIR" src
+
+# Each word as its first letter, its length and its count, sorted, since the order of a tie isn't what is being tested (and a
+# diff of megabyte-long words is no use to anyone)
+counts() { awk '$2 == "|" { print substr($1, 1, 1), length($1), $3 }' | sort; }
+
+"$FASTWC" -n2 -m "$DIR/src" | counts > "$DIR/want"
+if [ "$(wc -l < "$DIR/want")" -ne 9 ]; then
+	echo "FAIL: expected 9 distinct words with -m, got:"
+	cat "$DIR/want"
+	exit 1
+fi
+
+failed=0
+check() {
+	local name=$1
+	shift
+	if ! diff <("$@" | counts) "$DIR/want" > "$DIR/diff"; then
+		echo "FAIL: $name"
+		cat "$DIR/diff"
+		failed=1
+	fi
+}
+check "stdin" "$FASTWC" -n2 - < "$DIR/src/long.c"
+check "stdin, one thread" "$FASTWC" -n1 - < "$DIR/src/long.c"
+check "--prefetch" "$FASTWC" -n2 --prefetch 2 "$DIR/src"
+check "archive" "$FASTWC" -n2 "$DIR/src.tar"
+check "read()" "$FASTWC" -n1 "$DIR/src"
+check "read(), small blocks and chunks" "$FASTWC" -n3 -b1 -c64 "$DIR/src"
+check "io_uring" "$FASTWC" -n2 -u "$DIR/src"
+[ "$failed" -eq 0 ] && echo "All checks passed"
+exit "$failed"
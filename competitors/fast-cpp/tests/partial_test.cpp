@@ -0,0 +1,170 @@
+// Tests for partial result files (partial.hpp): what Writer writes, merge() reads back and adds up, across several files that share
+// words, and a file that is damaged or cut short makes merge() fail rather than quietly return the totals of the part it could read.
+// Run by ctest; exits non-zero if any check fails.
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "../partial.hpp"
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+using Counts = std::map<std::string, uint64_t>;
+
+std::vector<char> read_file(const std::string &path)
+{
+	std::vector<char> bytes;
+	FILE *f = fopen(path.c_str(), "rb");
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+	{
+		bytes.insert(bytes.end(), buf, buf + n);
+	}
+	fclose(f);
+	return bytes;
+}
+
+void write_file(const std::string &path, const std::vector<char> &bytes)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	fwrite(bytes.data(), 1, bytes.size(), f);
+	fclose(f);
+}
+
+// Merge the files, and whether merge() said they were all good
+bool merge_files(const std::vector<std::string> &paths, Counts &merged)
+{
+	std::vector<partial::Reader> inputs;
+	for (const std::string &path : paths)
+	{
+		inputs.emplace_back(path.c_str());
+		CHECK(inputs.back().ok());
+	}
+	uint64_t last_words = 0;
+	bool in_order = true;
+	std::string last;
+	bool ok = partial::merge(inputs, [&](std::string_view word, uint64_t count) {
+		in_order = in_order && (last_words == 0 || std::string(word) > last);
+		last = word;
+		last_words++;
+		merged[std::string(word)] += count;
+	});
+	// Each word comes out once, in byte order
+	CHECK(in_order);
+	return ok;
+}
+
+int main()
+{
+	std::string dir = "/tmp/partial_test." + std::to_string(getpid());
+	std::mt19937 rng(1);
+
+	// Four files drawing on one vocabulary, so most words are in several of them, with counts that need multi-byte varints (and one
+	// past 32 bits), a long word, and an empty file among them
+	std::vector<std::string> vocabulary = {"a", "b", "main", "int", std::string(300, 'l'), "zeta_9", "_x"};
+	for (int i = 0; i < 2000; i++)
+	{
+		vocabulary.push_back("w" + std::to_string(i));
+	}
+	Counts want;
+	std::vector<std::string> paths;
+	for (int f = 0; f < 4; f++)
+	{
+		Counts file;
+		for (int i = 0; f < 3 && i < 3000; i++)
+		{
+			file[vocabulary[rng() % vocabulary.size()]] += 1 + rng() % (i % 10 == 0 ? 100000 : 3);
+		}
+		if (f == 1)
+		{
+			file["a"] += 5000000000ull;
+		}
+		std::vector<std::pair<std::string_view, uint64_t>> words;
+		for (auto &[word, count] : file)
+		{
+			words.emplace_back(word, count);
+			want[word] += count;
+		}
+		paths.push_back(dir + "." + std::to_string(f));
+		CHECK(partial::write(paths.back().c_str(), words));
+	}
+	Counts merged;
+	CHECK(merge_files(paths, merged));
+	CHECK(merged == want);
+
+	// A merged file written back out is a partial file like any other
+	{
+		std::vector<partial::Reader> inputs;
+		for (const std::string &path : paths)
+		{
+			inputs.emplace_back(path.c_str());
+		}
+		partial::Writer out((dir + ".all").c_str());
+		CHECK(partial::merge(inputs, [&out](std::string_view word, uint64_t count) { out.add(word, count); }));
+		CHECK(out.finish());
+		Counts again;
+		CHECK(merge_files({dir + ".all"}, again));
+		CHECK(again == want);
+	}
+
+	// Each kind of damage to file 0: merge() must say so, whatever it made of the rest
+	const std::vector<char> good = read_file(paths[0]);
+	auto damaged = [&](const char *what, std::vector<char> bytes) {
+		write_file(paths[0], bytes);
+		Counts ignored;
+		if (merge_files(paths, ignored))
+		{
+			printf("  damaged file was taken as good: %s\n", what);
+			failures++;
+		}
+	};
+	auto set_nwords = [&](uint64_t n) {
+		std::vector<char> bytes = good;
+		memcpy(bytes.data() + 8, &n, 8);
+		return bytes;
+	};
+	uint64_t nwords;
+	memcpy(&nwords, good.data() + 8, 8);
+	damaged("cut off in the last count", std::vector<char>(good.begin(), good.end() - 1));
+	damaged("cut off halfway", std::vector<char>(good.begin(), good.begin() + good.size() / 2));
+	damaged("more words in the header than in the file", set_nwords(nwords + 1));
+	damaged("fewer words in the header than in the file", set_nwords(nwords - 1));
+	damaged("a header never filled in", set_nwords(0));
+	std::vector<char> trailing = good;
+	trailing.push_back('x');
+	damaged("bytes after the last record", trailing);
+	std::vector<char> endless = good;
+	memset(endless.data() + endless.size() - 20, 0xff, 20);
+	damaged("a varint that never ends", endless);
+	std::vector<char> overrun(good.begin(), good.begin() + 16);
+	overrun.push_back(100);
+	overrun.insert(overrun.end(), {'a', 'b', 'c'});
+	damaged("a word longer than the rest of the file", overrun);
+
+	for (const std::string &path : paths)
+	{
+		unlink(path.c_str());
+	}
+	unlink((dir + ".all").c_str());
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+// Tests for SpaceSaving (space_saving.hpp): on a skewed stream whose true counts we know, every reported count brackets the true one
+// (count - error <= true count <= count), and every word that occurs more than total / capacity times is reported, both for one
+// summary and for summaries of parts of the stream merged together.  Run by ctest; exits non-zero if any check fails.
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "../space_saving.hpp"
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+using Counts = std::map<std::string, uint64_t>;
+
+// Everything Space-Saving promises about summary, given the true counts of what went into it
+bool keeps_its_promises(const SpaceSaving &summary, const Counts &truth)
+{
+	uint64_t total = 0;
+	for (auto &[word, count] : truth)
+	{
+		total += count;
+	}
+	if (summary.total() != total || summary.entries().size() > summary.capacity())
+	{
+		printf("  total %llu, expected %llu, with %zu counters\n", (unsigned long long)summary.total(), (unsigned long long)total,
+		       summary.entries().size());
+		return false;
+	}
+	uint64_t bound = total / summary.capacity();
+	std::map<std::string, const SpaceSaving::Counter *> reported;
+	for (const SpaceSaving::Counter &c : summary.entries())
+	{
+		auto it = truth.find(c.word);
+		uint64_t real = it == truth.end() ? 0 : it->second;
+		if (c.error > c.count || c.count - c.error > real || real > c.count || c.error > bound)
+		{
+			printf("  %s reported %llu with error %llu, really %llu\n", c.word.c_str(), (unsigned long long)c.count, (unsigned long long)c.error,
+			       (unsigned long long)real);
+			return false;
+		}
+		reported[c.word] = &c;
+	}
+	for (auto &[word, count] : truth)
+	{
+		// A word left out can't have occurred more often than the smallest counter, and so not more than total / capacity
+		if (reported.count(word) == 0 && (count > bound || count > summary.min_count()))
+		{
+			printf("  %s occurs %llu times (bound %llu, min %llu), but isn't reported\n", word.c_str(), (unsigned long long)count,
+			       (unsigned long long)bound, (unsigned long long)summary.min_count());
+			return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	// A Zipf-like stream: word i occurs about 200000 / (i + 1) times, over a long tail, in random order
+	std::mt19937 rng(1);
+	std::vector<std::string> stream;
+	Counts truth;
+	for (int i = 0; i < 5000; i++)
+	{
+		std::string word = "w" + std::to_string(i);
+		int n = std::max(1, 200000 / (i + 1));
+		truth[word] = n;
+		stream.insert(stream.end(), n, word);
+	}
+	std::shuffle(stream.begin(), stream.end(), rng);
+
+	for (size_t capacity : {1, 10, 100, 1000})
+	{
+		SpaceSaving summary(capacity);
+		for (const std::string &word : stream)
+		{
+			summary.add(word.data(), word.size());
+		}
+		CHECK(summary.entries().size() == capacity);
+		CHECK(keeps_its_promises(summary, truth));
+	}
+
+	// Three summaries of three parts of the stream, merged, promise the same of the whole; and so do weighted adds
+	{
+		SpaceSaving parts[3] = {SpaceSaving(100), SpaceSaving(100), SpaceSaving(100)};
+		for (size_t i = 0; i < stream.size(); i++)
+		{
+			parts[i * 3 / stream.size()].add(stream[i].data(), stream[i].size());
+		}
+		parts[0].merge(parts[1]);
+		parts[0].merge(parts[2]);
+		CHECK(parts[0].entries().size() == 100);
+		CHECK(keeps_its_promises(parts[0], truth));
+
+		SpaceSaving weighted(100);
+		for (auto &[word, count] : truth)
+		{
+			// Half at once and the rest one at a time, so a weighted add can take over a counter as well as bump one
+			weighted.add(word.data(), word.size(), count / 2);
+		}
+		for (auto &[word, count] : truth)
+		{
+			for (uint64_t i = count / 2; i < count; i++)
+			{
+				weighted.add(word.data(), word.size());
+			}
+		}
+		CHECK(keeps_its_promises(weighted, truth));
+	}
+
+	// Until the counters run out nothing is evicted, and every count is exact
+	{
+		SpaceSaving summary(64);
+		Counts few;
+		for (int i = 0; i < 10000; i++)
+		{
+			std::string word = "x" + std::to_string(rng() % 50);
+			summary.add(word.data(), word.size());
+			few[word]++;
+		}
+		CHECK(summary.min_count() == 0);
+		CHECK(summary.entries().size() == few.size());
+		for (const SpaceSaving::Counter &c : summary.entries())
+		{
+			CHECK(c.error == 0 && c.count == few[c.word]);
+		}
+	}
+
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,159 @@
+// Tests for the tokenizer kernels (tokenizer.hpp): every classifier this machine can run, vector or scalar, for every policy, must
+// classify each of the 256 byte values the way the policy says, and must find the same words as a plain byte-at-a-time walk, in
+// buffers whose lengths are not a multiple of the vector width, without reading past their end.  Run by ctest; exits non-zero if any
+// check fails.
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../tokenizer.hpp"
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+using Words = std::vector<std::pair<size_t, size_t>>;
+
+// The words of text, found one byte at a time, and where a word the text ends in starts (or len)
+template <class Policy>
+size_t reference_words(const char *text, size_t len, Words &words)
+{
+	size_t i = 0;
+	while (i < len)
+	{
+		if (!Policy::is_token(text[i]))
+		{
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while (i < len && Policy::is_token(text[i]))
+		{
+			i++;
+		}
+		if (i == len)
+		{
+			return start;
+		}
+		words.emplace_back(start, i);
+	}
+	return len;
+}
+
+// Room for len bytes that end right where an unreadable page begins, so a classifier that reads past the end crashes the test
+struct Guarded
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t room;
+	char *map;
+	explicit Guarded(size_t len) : room((len + page - 1) / page * page + page)
+	{
+		map = (char *)mmap(nullptr, room + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		mprotect(map + room, page, PROT_NONE);
+	}
+	~Guarded() { munmap(map, room + page); }
+	char *place(const std::string &bytes)
+	{
+		char *p = map + room - bytes.size();
+		std::copy(bytes.begin(), bytes.end(), p);
+		return p;
+	}
+};
+
+template <class Policy>
+void check_policy(std::mt19937 &rng)
+{
+	// Every byte value, in several orders, and then texts that are mostly words of every policy's alphabet with all sorts of bytes
+	// between them.  The lengths straddle the 16, 32 and 64 byte vector widths and the BATCH boundary.
+	std::vector<std::string> texts;
+	std::string every;
+	for (int c = 0; c < 256; c++)
+	{
+		every += (char)c;
+	}
+	texts.push_back(every);
+	for (int i = 0; i < 4; i++)
+	{
+		std::shuffle(every.begin(), every.end(), rng);
+		texts.push_back(every);
+	}
+	const std::string wordy = "abcxyzABCXYZ0189_-\xc3\xa9\x80\xff";
+	for (size_t len : std::vector<size_t>{1, 15, 17, 31, 33, 63, 65, 100, 127, 129, 1000, tokenizer::BATCH - 1, tokenizer::BATCH + 37, 3 * tokenizer::BATCH + 5})
+	{
+		std::string text;
+		while (text.size() < len)
+		{
+			text += rng() % 3 == 0 ? (char)(rng() % 256) : wordy[rng() % wordy.size()];
+		}
+		texts.push_back(text);
+	}
+
+	const tokenizer::Classifier picked = tokenizer::Kernel<Policy>::classify;
+	for (const tokenizer::NamedClassifier &c : tokenizer::classifiers<Policy>())
+	{
+		int before = failures;
+		for (const std::string &text : texts)
+		{
+			// Each text in full, and cut short at every length up to 130, so every ragged end gets classified
+			for (size_t len = text.size(); len > 0; len = len > 130 ? 130 : len - 1)
+			{
+				Guarded room(len);
+				const char *p = room.place(text.substr(0, len));
+				std::vector<uint64_t> masks((len + 63) / 64);
+				c.classify(p, len, masks.data());
+				for (size_t i = 0; i < len; i++)
+				{
+					if ((bool)(masks[i / 64] >> (i % 64) & 1) != Policy::is_token(p[i]))
+					{
+						printf("  %s %s: byte 0x%02x at %zu of %zu classified wrong\n", Policy::name, c.name, (unsigned char)p[i], i, len);
+						failures++;
+						break;
+					}
+				}
+
+				// The same words as the reference walk, through the scan loop that fast-wc uses
+				tokenizer::Kernel<Policy>::classify = c.classify;
+				Words got, want;
+				size_t tail = tokenizer::scan_words<Policy>(p, len, [&](size_t start, size_t end) { got.emplace_back(start, end); });
+				tokenizer::Kernel<Policy>::classify = picked;
+				size_t want_tail = reference_words<Policy>(p, len, want);
+				if (tail != want_tail || got != want)
+				{
+					printf("  %s %s: %zu words and a tail at %zu in %zu bytes, expected %zu words and a tail at %zu\n", Policy::name, c.name,
+					       got.size(), tail, len, want.size(), want_tail);
+					failures++;
+				}
+			}
+		}
+		printf("%s %s: %s\n", Policy::name, c.name, failures == before ? "ok" : "FAILED");
+	}
+}
+
+int main()
+{
+	tokenizer::init();
+	std::mt19937 rng(1);
+	check_policy<tokenizer::Ident>(rng);
+	check_policy<tokenizer::Hyphen>(rng);
+	check_policy<tokenizer::Utf8>(rng);
+
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,192 @@
+// Tests for WordCounter (word_counter.hpp): counting a directory tree and buffers, ranking, and reusing one counter for call after call.
+// Every count is checked against a plain byte-at-a-time count of the same text.  Run by ctest; exits non-zero if any check fails.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+#include "../tokenizer.hpp"
+#include "../word_counter.hpp"
+
+namespace fs = std::filesystem;
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+using Counts = std::map<std::string, int>;
+
+// The words of text, found one byte at a time, with nothing clever about it
+void reference_count(std::string_view text, Counts &counts, int times = 1)
+{
+	size_t i = 0;
+	while (i < text.size())
+	{
+		if (!tokenizer::Ident::is_token(text[i]))
+		{
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while (i < text.size() && tokenizer::Ident::is_token(text[i]))
+		{
+			i++;
+		}
+		counts[std::string(text.substr(start, i - start))] += times;
+	}
+}
+
+// The reference counts in results() order, most common first and then alphabetical
+std::vector<std::pair<int, std::string>> ranked(const Counts &counts)
+{
+	std::vector<std::pair<int, std::string>> out;
+	for (auto &[word, count] : counts)
+	{
+		out.emplace_back(count, word);
+	}
+	std::stable_sort(out.begin(), out.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+	return out;
+}
+
+bool same(const std::vector<WordCounter::Result> &got, const std::vector<std::pair<int, std::string>> &want)
+{
+	if (got.size() != want.size())
+	{
+		printf("  %zu words, expected %zu\n", got.size(), want.size());
+		return false;
+	}
+	for (size_t i = 0; i < got.size(); i++)
+	{
+		if (got[i].first != want[i].first || got[i].second != want[i].second)
+		{
+			printf("  #%zu is %.*s %d, expected %.*s %d\n", i, (int)std::min<size_t>(got[i].second.size(), 40), got[i].second.data(), got[i].first,
+			       (int)std::min<size_t>(want[i].second.size(), 40), want[i].second.data(), want[i].first);
+			return false;
+		}
+	}
+	return true;
+}
+
+void write_file(const fs::path &path, const std::string &text)
+{
+	fs::create_directories(path.parent_path());
+	std::ofstream(path, std::ios::binary) << text;
+}
+
+// A little tree of sources.  big.c is several read buffers long, with words that straddle the block boundaries, a word longer than a
+// whole block, and no newline at the end.  notes.txt isn't a C source, so it must not be counted.
+Counts make_tree(const fs::path &root)
+{
+	std::string small = "int main(void)\n{\n\treturn 0;\n}\n";
+	std::string header = "#define MAX_LEN 1024\ntypedef int word_t;";
+	std::string big;
+	for (int i = 0; big.size() < 600 * 1024; i++)
+	{
+		big += "alpha beta_" + std::to_string(i % 97) + " gamma;\n";
+		if (i % 5000 == 0)
+		{
+			big += std::string(200 * 1024, 'w') + "\n";
+		}
+	}
+	big += "last_word";
+	write_file(root / "small.c", small);
+	write_file(root / "include" / "header.h", header);
+	write_file(root / "src" / "deep" / "big.c", big);
+	write_file(root / "notes.txt", "not counted at all");
+	Counts counts;
+	reference_count(small, counts);
+	reference_count(header, counts);
+	reference_count(big, counts);
+	return counts;
+}
+
+int main()
+{
+	fs::path root = fs::temp_directory_path() / ("word_counter_test." + std::to_string(getpid()));
+	fs::remove_all(root);
+	Counts tree = make_tree(root);
+
+	WordCounter::Options options;
+	options.nthreads = 3;
+	options.ndiscovery = 2;
+	// Small enough that the buffers below get split between the threads
+	options.parallel_buffer = 64;
+	WordCounter counter(options);
+
+	// One directory
+	CHECK(counter.add_directory(root.c_str()) == 3);
+	auto all = counter.results();
+	CHECK(same(all, ranked(tree)));
+
+	// The top k are the first k of the full list
+	auto top = counter.results(5);
+	CHECK(top.size() == 5);
+	CHECK(std::equal(top.begin(), top.end(), all.begin()));
+
+	// The counts accumulate: the same directory again doubles them, and a buffer adds its words on top
+	std::string text = "alpha alpha zeta_" + std::string(70000, 'z') + " gamma\nmain";
+	CHECK(counter.add_directory(root.c_str()) == 3);
+	counter.add_buffer(text);
+	Counts twice;
+	for (auto &[word, count] : tree)
+	{
+		twice[word] = 2 * count;
+	}
+	reference_count(text, twice);
+	CHECK(same(counter.results(), ranked(twice)));
+
+	// clear() forgets everything, and the same counter counts just as well afterwards
+	counter.clear();
+	CHECK(counter.results().empty());
+	CHECK(counter.add_directory(root.c_str()) == 3);
+	CHECK(same(counter.results(), ranked(tree)));
+
+	// Buffers on their own, small (scanned on the calling thread) and big (split between the pool threads)
+	counter.clear();
+	Counts buffers;
+	counter.add_buffer("x");
+	reference_count("x", buffers);
+	std::string big_text;
+	for (int i = 0; i < 2000; i++)
+	{
+		big_text += "w" + std::to_string(i % 13) + " " + std::string(i % 7 + 1, 'a') + "\t";
+	}
+	counter.add_buffer(big_text);
+	reference_count(big_text, buffers);
+	CHECK(same(counter.results(), ranked(buffers)));
+
+	// A directory that isn't there is an error, and the counter is still usable after it
+	bool threw = false;
+	try
+	{
+		counter.add_directory((root / "missing").c_str());
+	}
+	catch (const fs::filesystem_error &)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+	CHECK(same(counter.results(), ranked(buffers)));
+
+	fs::remove_all(root);
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
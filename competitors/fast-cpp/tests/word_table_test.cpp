@@ -0,0 +1,97 @@
+// Tests for WordTable::erase (word_table.hpp): a long random run of adds and erases, checked against a std::map after every step of it.
+// The vocabulary is small next to the table, so the probe runs are long and crowded, which is where erasing goes wrong if it is going
+// to.  Run by ctest; exits non-zero if any check fails.
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "../word_table.hpp"
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                                                        \
+	do                                                                                                                                     \
+	{                                                                                                                                      \
+		if (!(cond))                                                                                                                       \
+		{                                                                                                                                  \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                                                                \
+			failures++;                                                                                                                    \
+		}                                                                                                                                  \
+	} while (0)
+
+// Every word in want is in the table with its count, and nothing else is
+bool same(const WordTable &table, const std::map<std::string, int> &want)
+{
+	if (table.size() != want.size())
+	{
+		printf("  %zu words, expected %zu\n", table.size(), want.size());
+		return false;
+	}
+	size_t seen = 0;
+	for (auto [word, count] : table)
+	{
+		auto it = want.find(std::string(word));
+		if (it == want.end() || it->second != count)
+		{
+			printf("  %.*s has count %d, expected %d\n", (int)word.size(), word.data(), count, it == want.end() ? 0 : it->second);
+			return false;
+		}
+		seen++;
+	}
+	return seen == want.size();
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	std::vector<std::string> vocabulary;
+	for (int i = 0; i < 3000; i++)
+	{
+		vocabulary.push_back("w" + std::to_string(i) + std::string(rng() % 20, 'x'));
+	}
+	WordTable table;
+	std::map<std::string, int> want;
+	for (int step = 0; step < 200000; step++)
+	{
+		const std::string &word = vocabulary[rng() % vocabulary.size()];
+		if (rng() % 3 == 0)
+		{
+			table.erase(word.data(), word.size());
+			want.erase(word);
+		}
+		else
+		{
+			table.add(word.data(), word.size());
+			want[word]++;
+		}
+		// Lookups must still find every word after any erase has shuffled its probe run
+		if (step % 997 == 0 && !same(table, want))
+		{
+			CHECK(!"table matches after a mix of adds and erases");
+			break;
+		}
+	}
+	CHECK(same(table, want));
+
+	// Erasing a word that isn't there does nothing, and erasing everything leaves an empty table that still works
+	table.erase("nowhere", 7);
+	CHECK(same(table, want));
+	for (auto &[word, count] : want)
+	{
+		table.erase(word.data(), word.size());
+	}
+	want.clear();
+	CHECK(same(table, want));
+	table.add("again", 5, 3);
+	want["again"] = 3;
+	CHECK(same(table, want));
+
+	if (failures > 0)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
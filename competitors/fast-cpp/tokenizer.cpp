@@ -0,0 +1,262 @@
+#include "tokenizer.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TOKENIZER_NEON 1
+#endif
+
+namespace {
+
+// The vector kernels classify a byte by splitting it into its two 4-bit halves and looking each half up in a 16-entry table with
+// a single shuffle instruction.  A byte is a token character if the two lookups have a bit in common.  For the high half we give
+// each distinct "row" of the 256-entry table (the set of low halves that are tokens, for that high half) its own bit, so the
+// answer is exact as long as the alphabet has at most 8 distinct rows.  a-zA-Z0-9_ has 4, and the other policies have 5 or 6.
+// The tables are worked out at compile time, and a policy that needs more than 8 rows won't compile at all.
+struct NibbleTables
+{
+	uint8_t lo[16];
+	uint8_t hi[16];
+	bool ok;
+};
+
+template <class Policy>
+constexpr NibbleTables build_nibble_tables()
+{
+	NibbleTables t{};
+	uint16_t rows[16] = {};
+	int nbits = 0;
+	t.ok = true;
+	for (int h = 0; h < 16; h++)
+	{
+		for (int l = 0; l < 16; l++)
+		{
+			if (Policy::is_token(h << 4 | l))
+			{
+				rows[h] |= 1 << l;
+			}
+		}
+		if (rows[h] == 0)
+		{
+			continue;
+		}
+		// Rows with the same pattern share a bit
+		int bit = -1;
+		for (int other = 0; other < h; other++)
+		{
+			if (rows[other] == rows[h])
+			{
+				bit = __builtin_ctz(t.hi[other]);
+			}
+		}
+		if (bit == -1)
+		{
+			if (nbits == 8)
+			{
+				t.ok = false;
+				return t;
+			}
+			bit = nbits++;
+			for (int l = 0; l < 16; l++)
+			{
+				if (rows[h] & (1 << l))
+				{
+					t.lo[l] |= 1 << bit;
+				}
+			}
+		}
+		t.hi[h] = 1 << bit;
+	}
+	return t;
+}
+
+template <class Policy>
+struct Luts
+{
+	static constexpr NibbleTables tables = build_nibble_tables<Policy>();
+	static_assert(tables.ok, "token policy has more than 8 distinct nibble rows");
+	alignas(16) static constexpr std::array<uint8_t, 16> lo = std::to_array(tables.lo);
+	alignas(16) static constexpr std::array<uint8_t, 16> hi = std::to_array(tables.hi);
+};
+
+const char *chosen_name = "scalar";
+
+template <class Policy>
+void classify_scalar(const char *p, size_t len, uint64_t *masks)
+{
+	for (size_t k = 0; k * 64 < len; k++)
+	{
+		size_t n = len - k * 64 < 64 ? len - k * 64 : 64;
+		uint64_t m = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			m |= (uint64_t)tokenizer::is_token<Policy>(p[k * 64 + i]) << i;
+		}
+		masks[k] = m;
+	}
+}
+
+// All of the vector kernels do the whole 64-byte groups with vectors and then finish the ragged end with the scalar code, so that
+// they never read past the end of the buffer (which matters when the buffer is a memory-mapped file ending on a page boundary).
+template <class Policy>
+inline void classify_tail(const char *p, size_t len, size_t done, uint64_t *masks)
+{
+	if (done < len)
+	{
+		classify_scalar<Policy>(p + done, len - done, masks + done / 64);
+	}
+}
+
+#ifdef TOKENIZER_X86
+template <class Policy>
+__attribute__((target("avx2"))) void classify_avx2(const char *p, size_t len, uint64_t *masks)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)Luts<Policy>::lo.data()));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)Luts<Policy>::hi.data()));
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t k = 0;
+	for (; k + 64 <= len; k += 64)
+	{
+		uint64_t m = 0;
+		for (int half = 0; half < 2; half++)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *)(p + k + 32 * half));
+			__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+			__m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+			__m256i is_delim = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), zero);
+			m |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(is_delim) << (32 * half);
+		}
+		masks[k / 64] = m;
+	}
+	classify_tail<Policy>(p, len, k, masks);
+}
+
+template <class Policy>
+__attribute__((target("ssse3"))) void classify_ssse3(const char *p, size_t len, uint64_t *masks)
+{
+	const __m128i lo = _mm_load_si128((const __m128i *)Luts<Policy>::lo.data());
+	const __m128i hi = _mm_load_si128((const __m128i *)Luts<Policy>::hi.data());
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	size_t k = 0;
+	for (; k + 64 <= len; k += 64)
+	{
+		uint64_t m = 0;
+		for (int quarter = 0; quarter < 4; quarter++)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + k + 16 * quarter));
+			__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+			__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+			__m128i is_delim = _mm_cmpeq_epi8(_mm_and_si128(l, h), zero);
+			m |= (uint64_t)(0xFFFF & ~_mm_movemask_epi8(is_delim)) << (16 * quarter);
+		}
+		masks[k / 64] = m;
+	}
+	classify_tail<Policy>(p, len, k, masks);
+}
+#endif
+
+#ifdef TOKENIZER_NEON
+template <class Policy>
+void classify_neon(const char *p, size_t len, uint64_t *masks)
+{
+	const uint8x16_t lo = vld1q_u8(Luts<Policy>::lo.data());
+	const uint8x16_t hi = vld1q_u8(Luts<Policy>::hi.data());
+	const uint8x16_t nibble = vdupq_n_u8(0x0F);
+	// NEON has no movemask, so we AND each lane with its bit position and add neighbouring lanes together until 64 lanes
+	// have become 8 bytes
+	const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	size_t k = 0;
+	for (; k + 64 <= len; k += 64)
+	{
+		uint8x16_t r[4];
+		for (int quarter = 0; quarter < 4; quarter++)
+		{
+			uint8x16_t v = vld1q_u8((const uint8_t *)(p + k + 16 * quarter));
+			uint8x16_t l = vqtbl1q_u8(lo, vandq_u8(v, nibble));
+			uint8x16_t h = vqtbl1q_u8(hi, vshrq_n_u8(v, 4));
+			r[quarter] = vandq_u8(vtstq_u8(l, h), bits);
+		}
+		uint8x16_t sum = vpaddq_u8(vpaddq_u8(r[0], r[1]), vpaddq_u8(r[2], r[3]));
+		sum = vpaddq_u8(sum, sum);
+		masks[k / 64] = vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+	}
+	classify_tail<Policy>(p, len, k, masks);
+}
+#endif
+
+// Choose this policy's kernel.  The instruction set is the same for every policy, so this also names it for the banner.
+template <class Policy>
+void pick_kernel()
+{
+	tokenizer::Kernel<Policy>::classify = classify_scalar<Policy>;
+	chosen_name = "scalar";
+#ifdef TOKENIZER_X86
+	if (__builtin_cpu_supports("avx2"))
+	{
+		tokenizer::Kernel<Policy>::classify = classify_avx2<Policy>;
+		chosen_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("ssse3"))
+	{
+		tokenizer::Kernel<Policy>::classify = classify_ssse3<Policy>;
+		chosen_name = "ssse3";
+	}
+#elif defined(TOKENIZER_NEON)
+	tokenizer::Kernel<Policy>::classify = classify_neon<Policy>;
+	chosen_name = "neon";
+#endif
+}
+
+}  // namespace
+
+template <class Policy>
+tokenizer::Classifier tokenizer::Kernel<Policy>::classify = classify_scalar<Policy>;
+
+template struct tokenizer::Kernel<tokenizer::Ident>;
+template struct tokenizer::Kernel<tokenizer::Hyphen>;
+template struct tokenizer::Kernel<tokenizer::Utf8>;
+
+void tokenizer::init()
+{
+#ifdef TOKENIZER_X86
+	__builtin_cpu_init();
+#endif
+	pick_kernel<Ident>();
+	pick_kernel<Hyphen>();
+	pick_kernel<Utf8>();
+}
+
+const char *tokenizer::kernel_name()
+{
+	return chosen_name;
+}
+
+template <class Policy>
+std::vector<tokenizer::NamedClassifier> tokenizer::classifiers()
+{
+	std::vector<NamedClassifier> all = {{"scalar", classify_scalar<Policy>}};
+#ifdef TOKENIZER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		all.push_back({"avx2", classify_avx2<Policy>});
+	}
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		all.push_back({"ssse3", classify_ssse3<Policy>});
+	}
+#elif defined(TOKENIZER_NEON)
+	all.push_back({"neon", classify_neon<Policy>});
+#endif
+	return all;
+}
+
+template std::vector<tokenizer::NamedClassifier> tokenizer::classifiers<tokenizer::Ident>();
+template std::vector<tokenizer::NamedClassifier> tokenizer::classifiers<tokenizer::Hyphen>();
+template std::vector<tokenizer::NamedClassifier> tokenizer::classifiers<tokenizer::Utf8>();
@@ -0,0 +1,166 @@
+#pragma once
+
+/*
+ * The tokenizer kernel: find the words in a buffer, 64 bytes at a time.
+ */
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "word_table.hpp"
+
+namespace tokenizer {
+
+// A token policy says which bytes make up a word.  It is a type rather than a table filled in at run time, so that everything below
+// can be specialized for it at compile time: the byte table, the vector lookup tables, and the scan loop itself are all constants
+// baked into one instantiation per policy, with nothing left to look up or test while scanning.
+struct Ident
+{
+	static constexpr const char *name = "ident";
+	static constexpr bool is_token(unsigned char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+};
+
+// Identifiers that may contain hyphens, as in CSS, Lisp or command line options
+struct Hyphen
+{
+	static constexpr const char *name = "hyphen";
+	static constexpr bool is_token(unsigned char c) { return Ident::is_token(c) || c == '-'; }
+};
+
+// Identifiers plus every byte of a multibyte UTF-8 sequence, so non-ASCII letters stay inside their words.  We don't decode anything:
+// a UTF-8 lead or continuation byte is always >= 0x80, and no ASCII character is.
+struct Utf8
+{
+	static constexpr const char *name = "utf8";
+	static constexpr bool is_token(unsigned char c) { return Ident::is_token(c) || c >= 0x80; }
+};
+
+// The policy as a 256-entry byte table, for the code that still looks at one byte at a time
+template <class Policy>
+struct Table
+{
+	static constexpr std::array<bool, 256> make()
+	{
+		std::array<bool, 256> t{};
+		for (int c = 0; c < 256; c++)
+		{
+			t[c] = Policy::is_token(c);
+		}
+		return t;
+	}
+	static constexpr std::array<bool, 256> chars = make();
+};
+
+template <class Policy>
+inline bool is_token(char c)
+{
+	return Table<Policy>::chars[(unsigned char)c];
+}
+
+// How many bytes we classify before walking the resulting bitmasks.  Small enough that the masks and the bytes are still in L1
+// when we go back over them, large enough that the indirect call to the kernel is amortized over a lot of work.
+const size_t BATCH = 64 * 256;
+
+// A classifier turns bytes into bitmasks: bit i of masks[k] is 1 if p[64 * k + i] is a token character.  Bits past len are
+// undefined.  There is one version per instruction set and policy, all behind this same signature.
+using Classifier = void (*)(const char *p, size_t len, uint64_t *masks);
+
+// The classifier init() picked for this machine, one per policy
+template <class Policy>
+struct Kernel
+{
+	static Classifier classify;
+};
+extern template struct Kernel<Ident>;
+extern template struct Kernel<Hyphen>;
+extern template struct Kernel<Utf8>;
+
+// Pick the fastest classifier this CPU supports.  Must be called once before any scanning starts.
+void init();
+
+// Name of the kernel init() picked, for the startup banner
+const char *kernel_name();
+
+// Every classifier built into this binary that this CPU can run, the scalar one first.  init() only ever uses the fastest of them, so
+// this is how the tests get at the others, to check each one against the scalar classifier.
+struct NamedClassifier
+{
+	const char *name;
+	Classifier classify;
+};
+template <class Policy>
+std::vector<NamedClassifier> classifiers();
+
+// Walk the words of buf[0, len).  For every word that ends inside the buffer we call on_word(start, end), where end is the offset
+// of the delimiter that ended it.  The return value is the offset of a word that runs right up to the end of the buffer (the
+// caller decides whether that is a split word or the end of the file), or len if the buffer ended on a delimiter.
+//
+// The loop finds word boundaries from the masks rather than testing bytes: a word starts at a 1 bit whose predecessor is 0, and
+// ends at a 0 bit whose predecessor is 1.  We get all of these with a few shifts, and then pull them out with count-trailing-zeros.
+template <class Policy, class OnWord>
+inline size_t scan_words(const char *buf, size_t len, OnWord &&on_word)
+{
+	const Classifier classify = Kernel<Policy>::classify;
+	uint64_t masks[BATCH / 64];
+	uint64_t carry = 0; // 1 if the previous byte was a token character
+	size_t sptr = len;
+	for (size_t batch = 0; batch < len; batch += BATCH)
+	{
+		size_t blen = len - batch < BATCH ? len - batch : BATCH;
+		classify(buf + batch, blen, masks);
+		for (size_t k = 0; k * 64 < blen; k++)
+		{
+			uint64_t m = masks[k];
+			size_t base = batch + k * 64;
+			size_t valid = blen - k * 64;
+			if (valid < 64)
+			{
+				m &= (1ull << valid) - 1;
+			}
+			uint64_t prev = (m << 1) | carry;
+			uint64_t starts = m & ~prev;
+			uint64_t ends = ~m & prev;
+			if (valid < 64)
+			{
+				ends &= (1ull << valid) - 1;
+			}
+			carry = m >> 63;
+			// Starts and ends strictly alternate, so we only ever need to look at one of the two masks at a time
+			while (starts | ends)
+			{
+				if (sptr == len)
+				{
+					sptr = base + __builtin_ctzll(starts);
+					starts &= starts - 1;
+				}
+				else
+				{
+					size_t eptr = base + __builtin_ctzll(ends);
+					ends &= ends - 1;
+					on_word(sptr, eptr);
+					sptr = len;
+				}
+			}
+		}
+	}
+	return sptr;
+}
+
+// The same walk, hashing each word as soon as we find its end, and calling on_word(start, end, hash) so the table can use add_hashed.
+// The word's bytes were classified moments ago and are still in L1, and the table never has to look at them again except for the one
+// memcmp that confirms a hit.  Here we also know how much of the buffer is left after the word, which lets nearly every word take
+// hash_word_padded's single masked load for its last chunk (see word_table.hpp).  Only the handful of words at the very end of the
+// buffer, where that load would run off the end, take the careful path.
+template <class Policy, class OnWord>
+inline size_t scan_hashed(const char *buf, size_t len, OnWord &&on_word)
+{
+	return scan_words<Policy>(buf, len, [&](size_t start, size_t end) {
+		const char *word = buf + start;
+		on_word(start, end, end + 8 <= len ? hash_word_padded(word, end - start) : hash_word(word, end - start));
+	});
+}
+
+}  // namespace tokenizer
@@ -0,0 +1,121 @@
+#include "uring.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Uring::~Uring()
+{
+	if (sqes != nullptr)
+	{
+		munmap(sqes, sqes_size);
+	}
+	if (cq_ring != nullptr && cq_ring != sq_ring)
+	{
+		munmap(cq_ring, cq_ring_size);
+	}
+	if (sq_ring != nullptr)
+	{
+		munmap(sq_ring, sq_ring_size);
+	}
+	if (fd != -1)
+	{
+		close(fd);
+	}
+}
+
+bool Uring::init(unsigned entries)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+	{
+		fd = -1;
+		return false;
+	}
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	// Since 5.4 both rings live in one mapping
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+	{
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	}
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+	{
+		sq_ring = nullptr;
+		return false;
+	}
+	cq_ring = single ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+	{
+		cq_ring = nullptr;
+		return false;
+	}
+	sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (s == MAP_FAILED)
+	{
+		return false;
+	}
+	sqes = (io_uring_sqe *)s;
+	char *sq = (char *)sq_ring;
+	char *cq = (char *)cq_ring;
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+	sqe_tail = submitted = *sq_tail;
+	return true;
+}
+
+bool Uring::register_buffers(const iovec *iovs, unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovs, n) == 0;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sqe_tail - head > *sq_mask)
+	{
+		return nullptr;
+	}
+	unsigned idx = sqe_tail & *sq_mask;
+	sq_array[idx] = idx;
+	sqe_tail++;
+	memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+	return &sqes[idx];
+}
+
+int Uring::submit_and_wait(unsigned wait_nr)
+{
+	// The entries have to be fully written before the kernel can see the new tail
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = sqe_tail - submitted;
+	submitted = sqe_tail;
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+}
+
+io_uring_cqe *Uring::peek()
+{
+	unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		return nullptr;
+	}
+	return &cqes[head & *cq_mask];
+}
+
+void Uring::seen()
+{
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
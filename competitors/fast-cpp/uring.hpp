@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+ * A minimal io_uring wrapper, talking to the kernel directly rather than through liburing.
+ */
+#include <cstddef>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+// An io_uring is a pair of rings shared with the kernel: we write requests ("submission queue entries") into one, and the kernel
+// writes results ("completion queue entries") into the other.  One io_uring_enter system call can hand the kernel a whole batch of
+// requests and wait for results, where the plain syscall approach costs one blocking call per read.  Each ring is only ever used by
+// the one wcounter thread that owns it, so no locking is needed on our side.
+class Uring
+{
+public:
+	Uring() = default;
+	~Uring();
+	Uring(const Uring &) = delete;
+	Uring &operator=(const Uring &) = delete;
+
+	// Returns false if this kernel doesn't have io_uring (before 5.1), or it has been disabled
+	bool init(unsigned entries);
+
+	// Registering buffers lets the kernel pin them once up front, instead of mapping them for every single read.  May fail if
+	// RLIMIT_MEMLOCK is low, in which case the caller should stick to plain reads.
+	bool register_buffers(const iovec *iovs, unsigned n);
+
+	// A cleared entry to fill in, or nullptr if the submission queue is full
+	io_uring_sqe *get_sqe();
+
+	// Tell the kernel about everything from get_sqe() since the last submit, and wait until at least wait_nr completions are ready
+	int submit_and_wait(unsigned wait_nr);
+
+	// The oldest unread completion, or nullptr.  Call seen() when done with it.
+	io_uring_cqe *peek();
+	void seen();
+
+private:
+	int fd = -1;
+	void *sq_ring = nullptr;
+	void *cq_ring = nullptr;
+	size_t sq_ring_size = 0;
+	size_t cq_ring_size = 0;
+	io_uring_sqe *sqes = nullptr;
+	size_t sqes_size = 0;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	io_uring_cqe *cqes;
+	unsigned sqe_tail = 0;
+	unsigned submitted = 0;
+};
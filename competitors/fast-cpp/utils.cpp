@@ -1,20 +1,302 @@
 #include "utils.hpp"
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
 
-std::vector<fs::path> utils::find_all_files(
-        const fs::path& dir, std::function<bool(const std::string&)> pred) {
-    std::list<fs::path> files_to_sweep;
-    // iterate recursively to find all files that satisfy pred
-    for(auto& entry : fs::recursive_directory_iterator(dir)) {
-        if(entry.is_regular_file()) {
-            fs::path cur_file = entry.path();
-            std::string type(cur_file.extension());
-            if(pred(type)) {
-	        files_to_sweep.push_back(std::move(cur_file));
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// What getdents64 fills our buffer with
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Same rule as fs::path::extension(): the part from the last '.', unless that '.' starts the name
+std::string_view extension_of(const char* name) {
+    const char* dot = strrchr(name, '.');
+    if(dot == nullptr || dot == name) {
+        return {};
+    }
+    return dot;
+}
+
+// Open a directory by its path relative to root.  A path longer than the kernel will take in one go (PATH_MAX, 4 KB) is opened a
+// stretch at a time, each stretch relative to the last, so there is no limit to how deep a tree can go.
+int open_dir(int root, const std::string& path) {
+    if(path.size() < PATH_MAX) {
+        return openat(root, path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    int dirfd = root;
+    for(size_t start = 0; start < path.size();) {
+        size_t stop = path.size();
+        if(stop - start >= PATH_MAX) {
+            stop = path.rfind('/', start + PATH_MAX - 1);
+            if(stop == std::string::npos || stop <= start) {
+                // A single name longer than that, which no filesystem allows
+                stop = path.size();
+            }
+        }
+        int next = openat(dirfd, path.substr(start, stop - start).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dirfd != root) {
+            close(dirfd);
+        }
+        if(next == -1) {
+            return -1;
+        }
+        dirfd = next;
+        start = stop + 1;
+    }
+    return dirfd;
+}
+
+// The directories waiting to be read, shared by all the traversal threads.  Each one is a path relative to the top of the walk, and
+// is only opened when somebody gets round to reading it, so the only directories that are ever open are the top and the one each
+// thread is reading: however deep or wide the tree, we never run out of file descriptors (or, with no recursion, stack).  Opening by
+// path does make the kernel walk it from the top again, but that's once per directory; the files, which far outnumber them, are still
+// opened relative to theirs.
+class Walker {
+public:
+    Walker(int root, utils::ExtensionPred pred, int nthreads, const utils::FileSink& sink)
+        : root(root), pred(pred), max_pending(4 * nthreads), sink(sink) {}
+
+    void push(std::string dir) {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back(std::move(dir));
+        more.notify_one();
+    }
+
+    void run() {
+        std::vector<std::string> mine;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                more.wait(guard, [&] { return !pending.empty() || busy == 0; });
+                if(pending.empty()) {
+                    return;
+                }
+                mine.push_back(std::move(pending.back()));
+                pending.pop_back();
+                busy++;
+            }
+            // Our own work stack, for the subdirectories we keep rather than share.  Going depth first keeps it short.
+            while(!mine.empty()) {
+                std::string dir = std::move(mine.back());
+                mine.pop_back();
+                read_dir(dir, mine);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if(--busy == 0 && pending.empty()) {
+                more.notify_all();
+            }
+        }
+    }
+
+private:
+    // Reads one directory and closes it again before any of its subdirectories are looked at.  They are shared with the other
+    // threads while there aren't many queued up yet, and otherwise go on our own stack.
+    void read_dir(const std::string& dir, std::vector<std::string>& mine) {
+        int dirfd = open_dir(root, dir);
+        if(dirfd == -1) {
+            return;
+        }
+        std::vector<std::string> subdirs;
+        alignas(linux_dirent64) char buf[16 * 1024];
+        long nread;
+        while((nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+            for(long pos = 0; pos < nread;) {
+                auto* entry = reinterpret_cast<linux_dirent64*>(buf + pos);
+                pos += entry->d_reclen;
+                const char* name = entry->d_name;
+                if(name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+                    continue;
+                }
+                unsigned char type = entry->d_type;
+                if(type == DT_UNKNOWN || type == DT_LNK) {
+                    // Some filesystems don't fill in d_type, and for a symlink we need to know what it points to
+                    struct stat sb;
+                    if(fstatat(dirfd, name, &sb, 0) == -1) {
+                        continue;
+                    }
+                    if(S_ISREG(sb.st_mode)) {
+                        type = DT_REG;
+                    } else if(S_ISDIR(sb.st_mode) && type == DT_UNKNOWN) {
+                        type = DT_DIR;
+                    } else {
+                        continue;
+                    }
+                }
+                if(type == DT_REG) {
+                    if(pred(extension_of(name))) {
+                        sink(dirfd, name);
+                    }
+                } else if(type == DT_DIR) {
+                    subdirs.push_back(dir.empty() ? std::string(name) : dir + "/" + name);
+                }
+            }
+        }
+        close(dirfd);
+        for(std::string& subdir : subdirs) {
+            bool share;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                share = pending.size() < max_pending;
+            }
+            if(share) {
+                push(std::move(subdir));
+            } else {
+                mine.push_back(std::move(subdir));
+            }
+        }
+    }
+
+    int root;
+    utils::ExtensionPred pred;
+    size_t max_pending;
+    const utils::FileSink& sink;
+    std::mutex lock;
+    std::condition_variable more;
+    std::vector<std::string> pending;
+    int busy = 0;
+};
+
+}  // namespace
+
+void utils::walk_files(const char* dir, ExtensionPred pred, int nthreads, const FileSink& sink) {
+    int root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(root == -1) {
+        throw fs::filesystem_error("unable to open directory", dir, std::error_code(errno, std::generic_category()));
+    }
+    Walker walker(root, pred, nthreads, sink);
+    walker.push("");
+    std::vector<std::thread> threads;
+    for(int n = 1; n < nthreads; n++) {
+        threads.emplace_back(&Walker::run, &walker);
+    }
+    walker.run();
+    for(auto& t : threads) {
+        t.join();
+    }
+    close(root);
+}
+
+// The list is read into one buffer and cut up where it lies: each delimiter becomes the NUL that ends a name, and so does the last '/'
+// in each name, which splits it into its directory and the name within that.  Sorting by directory then lets us open each directory
+// just once and open its files relative to it, as walk_files does, rather than have the kernel walk every full path from the top.
+void utils::list_files(const char* list, int nthreads, const FileSink& sink) {
+    bool from_stdin = strcmp(list, "-") == 0;
+    int fdesc = from_stdin ? STDIN_FILENO : open(list, O_RDONLY | O_CLOEXEC);
+    if(fdesc == -1) {
+        throw fs::filesystem_error("unable to open file list", list, std::error_code(errno, std::generic_category()));
+    }
+    std::vector<char> text(64 * 1024);
+    size_t len = 0;
+    while(true) {
+        if(len == text.size()) {
+            text.resize(2 * text.size());
+        }
+        ssize_t got = read(fdesc, text.data() + len, text.size() - len);
+        if(got == -1 && errno == EINTR) {
+            continue;
+        }
+        if(got == -1) {
+            int err = errno;
+            if(!from_stdin) {
+                close(fdesc);
+            }
+            throw fs::filesystem_error("unable to read file list", list, std::error_code(err, std::generic_category()));
+        }
+        if(got == 0) {
+            break;
+        }
+        len += got;
+    }
+    if(!from_stdin) {
+        close(fdesc);
+    }
+    char delim = memchr(text.data(), '\0', len) != nullptr ? '\0' : '\n';
+    text.resize(len);
+    text.push_back(delim);
+
+    struct Entry {
+        std::string_view dir;  // "" for the current directory
+        char* name;
+    };
+    std::vector<Entry> entries;
+    for(char *p = text.data(), *end = p + len; p <= end;) {
+        char* stop = static_cast<char*>(memchr(p, delim, end + 1 - p));
+        *stop = '\0';
+        if(stop > p) {
+            char* slash = static_cast<char*>(memrchr(p, '/', stop - p));
+            if(slash == nullptr) {
+                entries.push_back({{}, p});
+            } else if(slash == p) {
+                // Right under the root: keep the '/' as the directory, which the empty string couldn't say
+                entries.push_back({{p, 1}, slash + 1});
+            } else {
+                *slash = '\0';
+                entries.push_back({{p, size_t(slash - p)}, slash + 1});
+            }
+        }
+        p = stop + 1;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.dir != b.dir ? a.dir < b.dir : strcmp(a.name, b.name) < 0;
+    });
+
+    std::vector<size_t> groups;
+    for(size_t i = 0; i < entries.size(); i++) {
+        if(i == 0 || entries[i].dir != entries[i - 1].dir) {
+            groups.push_back(i);
+        }
+    }
+    groups.push_back(entries.size());
+    std::atomic<size_t> next(0);
+    auto run = [&] {
+        for(size_t g; (g = next++) + 1 < groups.size();) {
+            std::string_view dir = entries[groups[g]].dir;
+            int dirfd = AT_FDCWD;
+            if(!dir.empty()) {
+                // "/" is the only directory that isn't followed by the NUL we wrote over its slash
+                dirfd = open(dir == "/" ? "/" : dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+            for(size_t i = groups[g]; i < groups[g + 1]; i++) {
+                if(dirfd == -1) {
+                    // Put the path back together, so that sink can say which file it couldn't open
+                    if(dir != "/") {
+                        entries[i].name[-1] = '/';
+                    }
+                    sink(AT_FDCWD, entries[i].dir.data());
+                    continue;
+                }
+                sink(dirfd, entries[i].name);
+            }
+            if(dirfd >= 0) {
+                close(dirfd);
             }
         }
+    };
+    std::vector<std::thread> threads;
+    for(int n = 1; n < nthreads; n++) {
+        threads.emplace_back(run);
+    }
+    run();
+    for(auto& t : threads) {
+        t.join();
     }
-    return std::vector<fs::path>(std::make_move_iterator(files_to_sweep.begin()),
-				 std::make_move_iterator(files_to_sweep.end()));
 }
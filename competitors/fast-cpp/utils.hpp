@@ -1,12 +1,57 @@
+#pragma once
+
 #include <filesystem>
 #include <functional>
+#include <string_view>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 namespace utils {
-std::vector<fs::path> find_all_files(
-        const fs::path& dir, std::function<bool(const std::string&)> pred);
+// Decides whether a file is wanted, given its extension (".c", or "" if it has none)
+using ExtensionPred = bool (*)(std::string_view extension);
+
+// The extension sets we know about.  The lists are constexpr arrays, so has_extension<Set> compiles down to a handful of length and
+// character compares against constants, and &has_extension<Set> is an ExtensionPred that can be handed straight to walk_files.
+struct CSources {
+    static constexpr const char* name = "c";
+    static constexpr std::string_view extensions[] = {".c", ".h"};
+};
+
+struct CppSources {
+    static constexpr const char* name = "cpp";
+    static constexpr std::string_view extensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx"};
+};
+
+struct RustSources {
+    static constexpr const char* name = "rust";
+    static constexpr std::string_view extensions[] = {".rs"};
+};
+
+template <class Set>
+bool has_extension(std::string_view extension) {
+    for (std::string_view e : Set::extensions) {
+        if (extension == e) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called once for every regular file whose extension passes the predicate.  dirfd is an open descriptor for the directory
+// the file is in, so the file can be opened with openat(dirfd, name, ...); both are only valid during the call.
+using FileSink = std::function<void(int dirfd, const char* name)>;
+
+// Walk dir recursively with nthreads traversal threads, calling sink as files are found rather than collecting them first.
+// sink is called concurrently from several threads.  Like fs::recursive_directory_iterator, symlinks to files are followed
+// and symlinks to directories are not.  Throws fs::filesystem_error if dir itself can't be opened.
+void walk_files(const char* dir, ExtensionPred pred, int nthreads, const FileSink& sink);
+
+// Instead of walking a tree, take the files from a list (a file, or "-" for stdin), such as the output of git ls-files.  The names
+// are separated by NULs if there are any in the list (as from ls-files -z), and by newlines otherwise, and are relative to the
+// current directory.  Every file listed is handed to sink, whatever its extension: whoever made the list already chose.  They go in
+// order of directory, with nthreads threads each taking whole directories.  Throws fs::filesystem_error if the list can't be read.
+void list_files(const char* list, int nthreads, const FileSink& sink);
 
 
 }  // namespace utils
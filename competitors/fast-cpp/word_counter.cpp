@@ -0,0 +1,183 @@
+#include "word_counter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <semaphore>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ranking.hpp"
+#include "scanning.hpp"
+#include "tokenizer.hpp"
+#include "work_queue.hpp"
+
+WordCounter::WordCounter(const Options &opts) : options(opts), workers(std::max(1, opts.nthreads))
+{
+	// Harmless to repeat: it only picks kernels, and every counter picks the same ones
+	static std::once_flag tokenizer_ready;
+	std::call_once(tokenizer_ready, tokenizer::init);
+	for (int n = 0; n < (int)workers.size(); n++)
+	{
+		threads.emplace_back(&WordCounter::pool_thread, this, n);
+	}
+}
+
+WordCounter::~WordCounter()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+}
+
+// The pool threads sleep between jobs.  Each new job bumps the generation, which is how a thread that wakes up tells a new job from
+// the one it already did.
+void WordCounter::pool_thread(int n)
+{
+	// Each thread allocates its own read buffer, so that its pages are on the thread's own NUMA node
+	workers[n].buffer.resize(scanning::BUFFER_SIZE);
+	uint64_t seen = 0;
+	while (true)
+	{
+		std::function<void(int)> mine;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+			if (stopping)
+			{
+				return;
+			}
+			seen = generation;
+			mine = job;
+		}
+		mine(n);
+		std::lock_guard<std::mutex> guard(lock);
+		if (--running == 0)
+		{
+			finished.notify_all();
+		}
+	}
+}
+
+void WordCounter::start(std::function<void(int)> j)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		job = std::move(j);
+		running = workers.size();
+		generation++;
+	}
+	wake.notify_all();
+}
+
+void WordCounter::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard, [&] { return running == 0; });
+}
+
+// The same reading as fast-wc's (scanning::ReadScan): one read() for a small file, and blocks of the worker's buffer for a big one, with
+// any word that runs from one block into the next glued back together.  So memory stays at one buffer per thread however big the files.
+void WordCounter::count_file(Worker &w, int fdesc)
+{
+	scanning::ReadScan<tokenizer::Ident, scanning::CountInto> scan({&w.counts}, fdesc, 0, -1, -1, scanning::BUFFER_SIZE, w.buffer.data());
+	scanning::read_all(scan, w.buffer.data());
+}
+
+size_t WordCounter::add_directory(const char *dir)
+{
+	// The same shape as fast-wc: the traversal threads open files as they find them and queue them, while the pool threads are
+	// already counting.  fdescs throttles the traversal so at most scanning::FDESCS files are open and waiting.
+	WorkQueues<int> queue(workers.size(), scanning::FDESCS);
+	std::counting_semaphore<scanning::FDESCS> fdescs(scanning::FDESCS);
+	std::atomic<size_t> files(0);
+	start([&](int n) {
+		int fdesc;
+		while (queue.pop(n, fdesc))
+		{
+			count_file(workers[n], fdesc);
+			close(fdesc);
+			fdescs.release();
+		}
+	});
+	try
+	{
+		utils::walk_files(dir, options.filter, options.ndiscovery, [&](int dirfd, const char *name) {
+			fdescs.acquire();
+			int fdesc = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+			if (fdesc == -1)
+			{
+				fdescs.release();
+				return;
+			}
+			files++;
+			queue.push(fdesc);
+		});
+	}
+	catch (...)
+	{
+		// The pool is still waiting for work, and has to be let go before we pass the error on
+		queue.close();
+		wait();
+		throw;
+	}
+	queue.close();
+	wait();
+	return files;
+}
+
+void WordCounter::add_buffer(std::string_view text)
+{
+	auto scan = [&](Worker &w, size_t begin, size_t end) {
+		scanning::CountInto sink{&w.counts};
+		scanning::scan_text<tokenizer::Ident>(text.data() + begin, end - begin, sink);
+	};
+	if (text.size() <= options.parallel_buffer || workers.size() == 1)
+	{
+		// Not worth waking the pool for; the pool is idle between calls, so its first table is ours to use
+		scan(workers[0], 0, text.size());
+		return;
+	}
+	// One piece per thread.  Each cut is moved forward past the end of any word it lands in, so that no word is split between pieces.
+	size_t nparts = workers.size();
+	std::vector<size_t> cuts(nparts + 1);
+	cuts[nparts] = text.size();
+	for (size_t i = 1; i < nparts; i++)
+	{
+		size_t c = std::max(cuts[i - 1], text.size() * i / nparts);
+		while (c < text.size() && c > 0 && tokenizer::is_token<tokenizer::Ident>(text[c - 1]) && tokenizer::is_token<tokenizer::Ident>(text[c]))
+		{
+			c++;
+		}
+		cuts[i] = c;
+	}
+	start([&](int n) { scan(workers[n], cuts[n], cuts[n + 1]); });
+	wait();
+}
+
+std::vector<WordCounter::Result> WordCounter::results(size_t k)
+{
+	for (Worker &w : workers)
+	{
+		total.merge(w.counts);
+		w.counts.clear();
+	}
+	// The collecting and sorting go through the pool as well, rather than on threads started for each call
+	return ranking::rank(total, k, workers.size(), [this](const std::function<void(int)> &j) {
+		start(j);
+		wait();
+	});
+}
+
+void WordCounter::clear()
+{
+	for (Worker &w : workers)
+	{
+		w.counts.clear();
+	}
+	total.clear();
+}
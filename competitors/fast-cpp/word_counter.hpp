@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * The word counter as a library: everything fast-wc does, minus the globals, so it can live inside another program.
+ */
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ranking.hpp"
+#include "utils.hpp"
+#include "word_table.hpp"
+
+// A WordCounter owns its threads, their read buffers and their count tables, and keeps all of them from one call to the next.  A
+// service that counts one request after another therefore pays for thread start-up and buffer allocation once, not per request, and
+// the buffers and tables are already warm in cache when the next request comes in.
+//
+// The counts accumulate over every add_directory() and add_buffer() until clear().  A WordCounter is meant to be used from one thread
+// at a time (it uses its own threads internally); use one WordCounter per concurrent client.
+//
+// Words are a-zA-Z0-9_ runs, the tokenizer's Ident policy, the same as fast-wc's default.
+class WordCounter
+{
+public:
+	struct Options
+	{
+		int nthreads = std::max(1u, std::thread::hardware_concurrency());
+		int ndiscovery = 4;                                                 // directory traversal threads
+		utils::ExtensionPred filter = utils::has_extension<utils::CSources>; // which files add_directory() counts
+		size_t parallel_buffer = 1024 * 1024;                               // add_buffer() splits buffers bigger than this
+	};
+
+	// (count, word), most common first and then alphabetical, just like fast-wc's output
+	using Result = ranking::Ranked;
+
+	WordCounter() : WordCounter(Options{}) {}
+	explicit WordCounter(const Options &options);
+	~WordCounter();
+	WordCounter(const WordCounter &) = delete;
+	WordCounter &operator=(const WordCounter &) = delete;
+
+	// Count every matching file under dir.  Returns the number of files counted.  Throws fs::filesystem_error if dir can't be opened.
+	size_t add_directory(const char *dir);
+
+	// Count the words in a buffer of text.  The text is not kept, so it only has to stay valid for the duration of the call.
+	void add_buffer(std::string_view text);
+
+	// Everything counted since the last clear(), sorted.  k > 0 keeps just the k most common.  The words point into the counter's own
+	// storage, and stay valid until the next call to any non-const method.
+	std::vector<Result> results(size_t k = 0);
+
+	// Forget all counts, but keep the threads and the (cleared) tables for next time
+	void clear();
+
+private:
+	struct Worker
+	{
+		WordTable counts;
+		std::vector<char> buffer; // scanning::BUFFER_SIZE, allocated by the worker's own thread
+	};
+
+	// Run job(worker index) on every pool thread at once, and wait() until they have all returned
+	void start(std::function<void(int)> job);
+	void wait();
+	void pool_thread(int n);
+	void count_file(Worker &w, int fdesc);
+
+	Options options;
+	std::vector<Worker> workers;
+	WordTable total;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	std::function<void(int)> job;
+	uint64_t generation = 0;
+	int running = 0;
+	bool stopping = false;
+	std::vector<std::thread> threads;
+};
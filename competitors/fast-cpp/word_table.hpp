@@ -0,0 +1,319 @@
+#pragma once
+
+/*
+ * A flat, open-addressing word -> count table for the word counter.
+ */
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Hash a word 8 bytes at a time.  The words we see are short identifiers, so the important thing is that the common case
+// (one or two 8-byte chunks) is a couple of multiplies with no per-byte loop.  The final "fmix" step is the one from MurmurHash3:
+// it spreads the bits so that the low bits we use as a table index are as good as the high bits.
+constexpr uint64_t hash_start(size_t len)
+{
+	return 0x9E3779B97F4A7C15ull ^ (len * 0xC2B2AE3D27D4EB4Full);
+}
+
+constexpr uint64_t hash_chunk(uint64_t h, uint64_t w)
+{
+	return (h ^ w) * 0xFF51AFD7ED558CCDull;
+}
+
+constexpr uint64_t hash_finish(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+inline uint64_t hash_word(const char *p, size_t len)
+{
+	uint64_t h = hash_start(len);
+	while (len >= 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = hash_chunk(h, w);
+		h ^= h >> 29;
+		p += 8;
+		len -= 8;
+	}
+	if (len)
+	{
+		uint64_t w = 0;
+		memcpy(&w, p, len);
+		h = hash_chunk(h, w);
+	}
+	return hash_finish(h);
+}
+
+// The same hash, for a caller that knows there are at least 8 readable bytes from the end of the last full chunk onwards (7 past the
+// end of the word will do).  The tokenizer knows that for nearly every word in its buffer.  The last, partial chunk is then one plain
+// 8-byte load with the bytes past the end masked off, rather than a variable-length memcpy, which compiles to a call or a chain of
+// branches.  On a little endian machine the low bytes of the load are the first bytes in memory, so the mask leaves exactly what
+// hash_word's memcpy into a zeroed word would.
+inline uint64_t hash_word_padded(const char *p, size_t len)
+{
+	if constexpr (std::endian::native != std::endian::little)
+	{
+		return hash_word(p, len);
+	}
+	uint64_t h = hash_start(len);
+	while (len >= 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = hash_chunk(h, w);
+		h ^= h >> 29;
+		p += 8;
+		len -= 8;
+	}
+	if (len)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = hash_chunk(h, w & ((1ull << (8 * len)) - 1));
+	}
+	return hash_finish(h);
+}
+
+// WordTable replaces the std::map<std::string, int> the counter originally used.  A std::map costs an O(log n) walk over a
+// red-black tree for every token, with a string compare (and a likely cache miss) at each node, and every new word costs a
+// heap allocation for the tree node plus another for the std::string.
+//
+// Here instead we keep one flat array of slots and use linear probing: hash the word, start at hash & mask, and walk forward
+// until we find either the word or an empty slot.  Each slot remembers the full hash and the length, so almost every mismatch
+// is rejected without touching the characters at all.  The characters themselves live in a "bump" arena owned by the table:
+// a new word is just appended to the end of one big char vector, and the slot stores its offset.  Because each thread has its own
+// table, each thread also has its own arena, and a hit (the overwhelmingly common case) never allocates anything.
+//
+// The per-thread tables sit side by side in a vector, and each thread writes its own table's size and pointers as it grows.  The
+// alignment gives every table a cache line to itself, so that one thread's growing doesn't keep knocking its neighbour's line out of
+// cache ("false sharing").
+class alignas(64) WordTable
+{
+public:
+	struct Slot
+	{
+		uint64_t hash;
+		uint64_t offset;
+		uint32_t len; // 0 marks an empty slot; a word always has at least one character
+		int count;
+	};
+
+	WordTable() { rehash(1024); }
+
+	// Count n more copies of a word.  This is the hot path used by found().
+	inline void add(const char *word, size_t len, int n = 1)
+	{
+		slot_for(word, len, hash_word(word, len)).count += n;
+	}
+
+	// The same, for a caller that already knows the word's hash
+	inline void add_hashed(const char *word, size_t len, uint64_t hash, int n = 1)
+	{
+		slot_for(word, len, hash).count += n;
+	}
+
+	// The std::map style interface, so code like totals[word] += count still reads naturally
+	inline int &operator[](std::string_view word)
+	{
+		return slot_for(word.data(), word.size(), hash_word(word.data(), word.size())).count;
+	}
+
+	// Fold another table into this one.  The other table already knows the hash of each word, so we don't recompute it.
+	void merge(const WordTable &other)
+	{
+		for (const Slot &s : other.slots)
+		{
+			if (s.len != 0)
+			{
+				slot_for(other.arena.data() + s.offset, s.len, s.hash).count += s.count;
+			}
+		}
+	}
+
+	// Take a word out of the table altogether; a word that isn't in it is left alone.  Rather than leaving a "tombstone" in the slot,
+	// which every later probe would have to step over, the words after it in its probe run move back to close the gap, each one as far
+	// as it can go without moving in front of its own home slot.  The characters are left in the arena until more than half of it is
+	// erased words, and then the arena is compacted, which like an insertion invalidates the string_views iterating handed out.
+	// Nothing in the counting itself erases; this is for tables that are kept up to date, such as the --serve totals.
+	void erase(const char *word, size_t len)
+	{
+		uint64_t hash = hash_word(word, len);
+		size_t i = hash & mask;
+		while (true)
+		{
+			const Slot &s = slots[i];
+			if (s.len == 0)
+			{
+				return;
+			}
+			if (s.hash == hash && s.len == len && memcmp(arena.data() + s.offset, word, len) == 0)
+			{
+				break;
+			}
+			i = (i + 1) & mask;
+		}
+		erased += len;
+		used--;
+		for (size_t j = (i + 1) & mask; slots[j].len != 0; j = (j + 1) & mask)
+		{
+			// The word in slot j can move back to the gap at i if i is no further from j than its home slot is
+			size_t home = slots[j].hash & mask;
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i] = Slot{};
+		if (2 * erased > arena.size())
+		{
+			compact();
+		}
+	}
+
+	size_t size() const { return used; }
+
+	// The number of slots.  begin_at(i) starts iterating at slot i, which lets several threads each walk their own range of slots.
+	size_t capacity() const { return slots.size(); }
+
+	// Roughly how much memory the table holds on to: the slots, and the arena of characters
+	size_t memory() const { return slots.capacity() * sizeof(Slot) + arena.capacity(); }
+
+	void clear()
+	{
+		slots.assign(slots.size(), Slot{});
+		arena.clear();
+		used = 0;
+		erased = 0;
+	}
+
+	// Iterating yields (word, count) pairs, much like iterating the std::map did.  The string_views point into the arena, so they
+	// remain valid until the next insertion of a new word into this same table.
+	class const_iterator
+	{
+	public:
+		const_iterator(const WordTable *t, size_t i) : table(t), idx(i) { skip(); }
+		std::pair<std::string_view, int> operator*() const
+		{
+			const Slot &s = table->slots[idx];
+			return {std::string_view(table->arena.data() + s.offset, s.len), s.count};
+		}
+		const Slot &slot() const { return table->slots[idx]; }
+		const_iterator &operator++()
+		{
+			++idx;
+			skip();
+			return *this;
+		}
+		bool operator!=(const const_iterator &o) const { return idx != o.idx; }
+		bool operator==(const const_iterator &o) const { return idx == o.idx; }
+
+	private:
+		void skip()
+		{
+			while (idx < table->slots.size() && table->slots[idx].len == 0)
+			{
+				++idx;
+			}
+		}
+		const WordTable *table;
+		size_t idx;
+	};
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, slots.size()); }
+	const_iterator begin_at(size_t slot) const { return const_iterator(this, std::min(slot, slots.size())); }
+
+private:
+	inline Slot &slot_for(const char *word, size_t len, uint64_t hash)
+	{
+		size_t i = hash & mask;
+		while (true)
+		{
+			Slot &s = slots[i];
+			if (s.len == 0)
+			{
+				return insert(i, word, len, hash);
+			}
+			if (s.hash == hash && s.len == len && memcmp(arena.data() + s.offset, word, len) == 0)
+			{
+				return s;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+
+	// The miss path: append the characters to the arena and claim the empty slot.  We keep the table at most half full, which
+	// keeps the linear probe sequences very short.
+	Slot &insert(size_t i, const char *word, size_t len, uint64_t hash)
+	{
+		if (2 * (used + 1) > slots.size())
+		{
+			rehash(slots.size() * 2);
+			i = hash & mask;
+			while (slots[i].len != 0)
+			{
+				i = (i + 1) & mask;
+			}
+		}
+		uint64_t offset = arena.size();
+		arena.insert(arena.end(), word, word + len);
+		used++;
+		slots[i] = Slot{hash, offset, (uint32_t)len, 0};
+		return slots[i];
+	}
+
+	// Copy the characters of the words still in the table into a new arena, leaving the erased ones behind
+	void compact()
+	{
+		std::vector<char> live;
+		live.reserve(arena.size() - erased);
+		for (Slot &s : slots)
+		{
+			if (s.len != 0)
+			{
+				uint64_t offset = live.size();
+				live.insert(live.end(), arena.data() + s.offset, arena.data() + s.offset + s.len);
+				s.offset = offset;
+			}
+		}
+		arena.swap(live);
+		erased = 0;
+	}
+
+	void rehash(size_t capacity)
+	{
+		std::vector<Slot> old(capacity);
+		old.swap(slots);
+		mask = capacity - 1;
+		for (const Slot &s : old)
+		{
+			if (s.len != 0)
+			{
+				size_t i = s.hash & mask;
+				while (slots[i].len != 0)
+				{
+					i = (i + 1) & mask;
+				}
+				slots[i] = s;
+			}
+		}
+	}
+
+	std::vector<Slot> slots;
+	std::vector<char> arena;
+	size_t mask = 0;
+	size_t used = 0;
+	// Bytes of the arena that belong to erased words
+	size_t erased = 0;
+};
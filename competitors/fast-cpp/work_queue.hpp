@@ -0,0 +1,183 @@
+#pragma once
+
+/*
+ * Lock-free queues for handing work from the file opener to the wcounter threads.
+ */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+// A bounded multi-producer, multi-consumer ring (this is Dmitry Vyukov's well known design).  Every cell has a sequence number
+// that says whose turn it is: a producer may fill cell i when its sequence equals the producer's ticket, and a consumer may empty
+// it when the sequence is ticket + 1.  Nobody ever takes a lock; a producer or consumer claims a ticket with one compare-and-swap
+// and then owns that one cell until it bumps the sequence number.  Capacity must be a power of two.
+template <class T>
+class MpmcRing
+{
+public:
+	explicit MpmcRing(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1)
+	{
+		for (size_t i = 0; i < capacity; i++)
+		{
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool try_push(const T &value)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell &c = cells[pos & mask];
+			intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					c.value = value;
+					c.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // full
+			}
+			else
+			{
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T &value)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell &c = cells[pos & mask];
+			intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					value = c.value;
+					c.seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // empty
+			}
+			else
+			{
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		T value;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	// The producers' end and the consumers' end each get their own cache line, so they don't slow each other down
+	alignas(64) std::atomic<size_t> tail{0};
+	alignas(64) std::atomic<size_t> head{0};
+};
+
+// One ring per worker.  The producers deal work out round robin, each worker takes from its own ring first, and a worker whose ring is
+// empty steals from the others.  So a thread that got stuck with one slow file doesn't leave work sitting behind it while other threads
+// go idle.
+//
+// Idle workers sleep on "state", which counts the items that have been pushed but not yet taken.  The top bit means the producer has
+// called close(): once that is set and the count is zero, there will never be more work.  Keeping both in one atomic means that
+// closing changes the value a sleeping worker is waiting on, so it can't miss the wake-up.
+template <class T>
+class WorkQueues
+{
+public:
+	WorkQueues(int nworkers, size_t capacity)
+	{
+		for (int i = 0; i < nworkers; i++)
+		{
+			rings.emplace_back(new MpmcRing<T>(capacity));
+		}
+	}
+
+	// Safe to call from several producer threads.  The caller is responsible for never having more than "capacity" items in flight,
+	// which guarantees that the round robin never finds every ring full.
+	void push(const T &value)
+	{
+		// Announce the item before it's visible, never after, so that state can't go negative when a worker takes it quickly
+		state.fetch_add(1);
+		while (!rings[next.fetch_add(1, std::memory_order_relaxed) % rings.size()]->try_push(value))
+		{
+		}
+		state.notify_one();
+	}
+
+	void close()
+	{
+		state.fetch_or(CLOSED);
+		state.notify_all();
+	}
+
+	// Never sleeps: returns false if there is nothing to take right now, whether or not more is coming
+	bool try_pop(int worker, T &value)
+	{
+		for (size_t i = 0; i < rings.size(); i++)
+		{
+			if (rings[(worker + i) % rings.size()]->try_pop(value))
+			{
+				state.fetch_sub(1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Returns false once the queues are closed and drained
+	bool pop(int worker, T &value)
+	{
+		while (true)
+		{
+			for (size_t i = 0; i < rings.size(); i++)
+			{
+				if (rings[(worker + i) % rings.size()]->try_pop(value))
+				{
+					state.fetch_sub(1);
+					return true;
+				}
+			}
+			uint32_t s = state.load();
+			if ((s & ~CLOSED) == 0)
+			{
+				if (s & CLOSED)
+				{
+					return false;
+				}
+				state.wait(s);
+			}
+			else
+			{
+				// Some item was announced but isn't in its ring yet, or another worker beat us to it
+				std::this_thread::yield();
+			}
+		}
+	}
+
+private:
+	static const uint32_t CLOSED = 1u << 31;
+	std::vector<std::unique_ptr<MpmcRing<T>>> rings;
+	std::atomic<size_t> next{0};
+	std::atomic<uint32_t> state{0};
+};